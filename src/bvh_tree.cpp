@@ -0,0 +1,122 @@
+#include "bvh_tree.h"
+#include <algorithm>
+#include <numeric>
+#include <iostream>
+
+// Median split gives at most two different item counts per depth, tabulate their subtree node counts
+void bvh_tree::subtree_sizes(int N_items)
+{
+    level_N.assign(1,N_items);
+    while(level_N.back() >= BVH_LEAF_SIZE) level_N.push_back(level_N.back()/2);
+
+    const int depth = level_N.size();
+    level_size.assign(2*depth,1);
+
+    for(int k = depth-2; k >= 0; k--)
+    {
+        for(int j = 0; j < 2; j++)
+        {
+            const int n = level_N[k]+j;
+            if(n <= BVH_LEAF_SIZE) continue;
+            level_size[2*k+j] = 1+subtree_size(n/2,k+1)+subtree_size(n-n/2,k+1);
+        }
+    }
+}
+
+int bvh_tree::subtree_size(int N_items, int depth) const
+{
+    if(N_items <= BVH_LEAF_SIZE) return 1;
+    return level_size[2*depth+N_items-level_N[depth]];
+}
+
+// Builds node over Item_idx[begin,end), children are split at the median of the widest center extent
+void bvh_tree::build_node(int node_idx, int begin, int end, int depth)
+{
+    bvh_node& node = nodes[node_idx];
+
+    double cmin[3], cmax[3];
+    for(int d = 0; d < 3; d++)
+    {
+        node.bmin[d] = cmin[d] = std::numeric_limits<double>::max();
+        node.bmax[d] = cmax[d] = std::numeric_limits<double>::lowest();
+    }
+
+    for(int i = begin; i < end; i++)
+    {
+        const int item = Item_idx[i];
+        for(int d = 0; d < 3; d++)
+        {
+            node.bmin[d] = std::min(node.bmin[d],boxes[6*item+d]);
+            node.bmax[d] = std::max(node.bmax[d],boxes[6*item+3+d]);
+            cmin[d] = std::min(cmin[d],centers[3*item+d]);
+            cmax[d] = std::max(cmax[d],centers[3*item+d]);
+        }
+    }
+
+    const int N = end-begin;
+    if(N <= BVH_LEAF_SIZE)
+    {
+        node.first = begin;
+        node.count = N;
+        node.right_idx = -1;
+        return;
+    }
+
+    int axis = 0;
+    for(int d = 1; d < 3; d++)
+    {
+        if(cmax[d]-cmin[d] > cmax[axis]-cmin[axis]) axis = d;
+    }
+
+    const int mid = begin+N/2;
+    std::nth_element(Item_idx.begin()+begin,Item_idx.begin()+mid,Item_idx.begin()+end,
+                     [this,axis](int32_t a, int32_t b){return centers[3*a+axis] < centers[3*b+axis];});
+
+    node.first = begin;
+    node.count = 0;
+    node.right_idx = node_idx+1+subtree_size(mid-begin,depth+1);
+
+    const int right_idx = node.right_idx;
+    if(N > 4096)
+    {
+        #pragma omp task
+        build_node(node_idx+1,begin,mid,depth+1);
+        build_node(right_idx,mid,end,depth+1);
+        #pragma omp taskwait
+    }
+    else
+    {
+        build_node(node_idx+1,begin,mid,depth+1);
+        build_node(right_idx,mid,end,depth+1);
+    }
+}
+
+// Builds tree over boxes, 6 values per item
+void bvh_tree::build(const std::vector<double>& item_boxes)
+{
+    const int N_items = item_boxes.size()/6;
+
+    boxes = item_boxes.data();
+    centers.resize(3*N_items);
+    for(int i = 0; i < N_items; i++)
+    {
+        for(int d = 0; d < 3; d++) centers[3*i+d] = 0.5*(boxes[6*i+d]+boxes[6*i+3+d]);
+    }
+
+    Item_idx.resize(N_items);
+    std::iota(Item_idx.begin(),Item_idx.end(),0);
+
+    nodes.clear();
+    if(N_items == 0) return;
+
+    subtree_sizes(N_items);
+    nodes.resize(subtree_size(N_items,0));
+
+    #pragma omp parallel
+    #pragma omp single
+    build_node(0,0,N_items,0);
+
+    centers.clear();
+    centers.shrink_to_fit();
+    boxes = nullptr;
+}
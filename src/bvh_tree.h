@@ -0,0 +1,118 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <limits>
+
+#define BVH_LEAF_SIZE 4     // Max items in leaf node
+#define BVH_STACK_SIZE 64   // Traversal stack, enough for median split trees
+
+// Tree node, inner nodes have left child at idx+1 and right child at right_idx
+struct bvh_node
+{
+    double bmin[3], bmax[3];    // Node bounding box
+    int32_t first;              // First item in Item_idx (leafs)
+    int32_t count;              // Number of items, 0 for inner nodes
+    int32_t right_idx;          // Right child (inner nodes)
+};
+
+// Bounding volume hierarchy over axis aligned boxes, median split construction
+class bvh_tree
+{
+    private:
+    const double* boxes;        // 6 values per item (xmin,ymin,zmin,xmax,ymax,zmax)
+    std::vector<double> centers;
+
+    // Item counts at depth k are level_N[k] or level_N[k]+1, with subtree sizes level_size[2k], level_size[2k+1]
+    std::vector<int> level_N, level_size;
+
+    void subtree_sizes(int N_items);
+    int subtree_size(int N_items, int depth) const;
+    void build_node(int node_idx, int begin, int end, int depth);
+
+    public:
+    std::vector<bvh_node> nodes;
+    std::vector<int32_t> Item_idx;  // Item indices ordered by leafs
+
+    void build(const std::vector<double>& item_boxes);
+
+    // Squared distance of point to box, 0 inside
+    static double box_distance2(const double* bmin, const double* bmax, const double* p)
+    {
+        double d2 = 0;
+        for(int d = 0; d < 3; d++)
+        {
+            const double t = (p[d] < bmin[d]) ? bmin[d]-p[d] : ((p[d] > bmax[d]) ? p[d]-bmax[d] : 0);
+            d2 += t*t;
+        }
+        return d2;
+    }
+
+    // Calls f(item) for items whose box contains p until f returns true, returns that item or -1
+    template<typename F>
+    int find_containing(const double* p, F f) const
+    {
+        if(nodes.empty()) return -1;
+
+        int stack[BVH_STACK_SIZE];
+        int top = 0;
+        stack[top++] = 0;
+
+        while(top > 0)
+        {
+            const bvh_node& node = nodes[stack[--top]];
+            if(box_distance2(node.bmin,node.bmax,p) > 0) continue;
+
+            if(node.count > 0)
+            {
+                for(int i = node.first; i < node.first+node.count; i++)
+                {
+                    if(f(Item_idx[i])) return Item_idx[i];
+                }
+                continue;
+            }
+
+            const int left = &node-nodes.data()+1;
+            stack[top++] = node.right_idx;
+            stack[top++] = left;
+        }
+        return -1;
+    }
+
+    // Branch and bound nearest item, dist2(item) returns squared distance to item which must not be less than its box distance
+    template<typename F>
+    int find_nearest(const double* p, F dist2, double& best_dist2) const
+    {
+        int best = -1;
+        if(nodes.empty()) return best;
+
+        int stack[BVH_STACK_SIZE];
+        int top = 0;
+        stack[top++] = 0;
+
+        while(top > 0)
+        {
+            const int node_idx = stack[--top];
+            const bvh_node& node = nodes[node_idx];
+            if(box_distance2(node.bmin,node.bmax,p) >= best_dist2) continue;
+
+            if(node.count > 0)
+            {
+                for(int i = node.first; i < node.first+node.count; i++)
+                {
+                    const double d2 = dist2(Item_idx[i]);
+                    if(d2 < best_dist2){best_dist2 = d2; best = Item_idx[i];}
+                }
+                continue;
+            }
+
+            // Visit closer child first
+            const int left = node_idx+1, right = node.right_idx;
+            const double dl = box_distance2(nodes[left].bmin,nodes[left].bmax,p);
+            const double dr = box_distance2(nodes[right].bmin,nodes[right].bmax,p);
+
+            if(dl < dr){stack[top++] = right; stack[top++] = left;}
+            else{stack[top++] = left; stack[top++] = right;}
+        }
+        return best;
+    }
+};
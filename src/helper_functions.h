@@ -2,14 +2,11 @@
 #include <iostream>
 #include <algorithm>
 
+// True if the array is already allocated (allocating again would leak it)
 template<typename T>
-void check_if_allocated(T* p)
+bool check_if_allocated(T* p)
 {
-    if(p != nullptr)
-    {
-        std::cout << "Memory is already allocated, exiting...\n";
-        exit(1);
-    }
+    return p != nullptr;
 }
 
 template<typename T>
@@ -21,7 +18,7 @@ bool contains(T* array, T value)
 }
 
 template<typename T>
-bool contains(std::vector<T> array, T value)
+bool contains(const std::vector<T>& array, T value)
 {
     auto it = std::find(array.begin(),array.end(),value);
     if(it != array.end()){return true;}
@@ -0,0 +1,367 @@
+#include "mesh_agglomeration.h"
+#include <algorithm>
+#include <math.h>
+#include <metis.h>
+
+mesh_agglomerator::mesh_agglomerator(const mesh_struct& _mesh) : mesh(_mesh){}
+
+// Returns the dual graph of given level, level 0 is the mesh itself
+mesh_agglomerator::level_graph mesh_agglomerator::fine_graph(int level) const
+{
+    level_graph graph;
+
+    if(level == 0)
+    {
+        graph.N_cells = mesh.N_elements;
+        graph.N_faces = mesh.N_faces;
+        graph.Face_ON_idx = mesh.Face_ON_idx;
+        graph.Face_normal_array = mesh.Face_normal_array;
+        graph.V_array = mesh.V_array;
+
+        graph.is_ghost.resize(graph.N_cells);
+        #pragma omp parallel for schedule(static)
+        for(int i = 0; i < graph.N_cells; i++)
+        {
+            graph.is_ghost[i] = mesh.is_boundary_element(i);
+        }
+    }
+    else
+    {
+        const multigrid_level& coarse = levels[level-1];
+
+        graph.N_cells = coarse.N_cells;
+        graph.N_faces = coarse.N_faces;
+        graph.Face_ON_idx = coarse.Face_ON_idx.data();
+        graph.Face_normal_array = coarse.Face_normal_array.data();
+        graph.V_array = coarse.V_array.data();
+
+        graph.is_ghost.assign(graph.N_cells,0);
+        std::fill(graph.is_ghost.end()-coarse.N_ghosts,graph.is_ghost.end(),1);
+    }
+
+    return graph;
+}
+
+// Cell to cell adjacency of non ghost cells weighted by face area
+void mesh_agglomerator::build_cell_adjacency(const level_graph& graph, std::vector<int32_t>& xadj, std::vector<int32_t>& adjncy, std::vector<double>& weights) const
+{
+    xadj.assign(graph.N_cells+1,0);
+
+    for(int i = 0; i < graph.N_faces; i++)
+    {
+        const int o = graph.Face_ON_idx[2*i], n = graph.Face_ON_idx[2*i+1];
+        if(graph.is_ghost[o] || graph.is_ghost[n]) continue;
+        xadj[o+1]++;
+        xadj[n+1]++;
+    }
+
+    for(int i = 0; i < graph.N_cells; i++) xadj[i+1] += xadj[i];
+
+    adjncy.resize(xadj[graph.N_cells]);
+    weights.resize(xadj[graph.N_cells]);
+
+    std::vector<int32_t> fill(xadj.begin(),xadj.end()-1);
+    for(int i = 0; i < graph.N_faces; i++)
+    {
+        const int o = graph.Face_ON_idx[2*i], n = graph.Face_ON_idx[2*i+1];
+        if(graph.is_ghost[o] || graph.is_ghost[n]) continue;
+
+        const double* S = &graph.Face_normal_array[3*i];
+        const double A = sqrt(S[0]*S[0]+S[1]*S[1]+S[2]*S[2]);
+
+        adjncy[fill[o]] = n; weights[fill[o]++] = A;
+        adjncy[fill[n]] = o; weights[fill[n]++] = A;
+    }
+}
+
+// Greedy agglomeration, each chunk of cells grows groups from seeds by the strongest face connection
+int mesh_agglomerator::group_greedy(const level_graph& graph, std::vector<int32_t>& group, int target_size) const
+{
+    std::vector<int32_t> xadj, adjncy;
+    std::vector<double> weights;
+    build_cell_adjacency(graph,xadj,adjncy,weights);
+
+    const int N_cells = graph.N_cells;
+    const int N_chunks = (N_cells+AGGLOMERATION_CHUNK_SIZE-1)/AGGLOMERATION_CHUNK_SIZE;
+
+    group.assign(N_cells,-1);
+    std::vector<int> chunk_groups(N_chunks+1,0);
+
+    #pragma omp parallel for schedule(dynamic)
+    for(int c = 0; c < N_chunks; c++)
+    {
+        const int begin = c*AGGLOMERATION_CHUNK_SIZE;
+        const int end = std::min(N_cells,begin+AGGLOMERATION_CHUNK_SIZE);
+        auto in_chunk = [&](int i){return i >= begin && i < end && !graph.is_ghost[i];};
+
+        std::vector<int> group_size;
+        std::vector<int> members;
+        std::vector<std::pair<int,double>> candidates;
+        members.reserve(target_size);
+
+        for(int seed = begin; seed < end; seed++)
+        {
+            if(graph.is_ghost[seed] || group[seed] >= 0) continue;
+
+            const int id = group_size.size();
+            group[seed] = id;
+            members.assign(1,seed);
+
+            // Add the free neighbour with the largest total face area to the group
+            while((int)members.size() < target_size)
+            {
+                candidates.clear();
+                for(auto const m : members)
+                {
+                    for(int j = xadj[m]; j < xadj[m+1]; j++)
+                    {
+                        const int nb = adjncy[j];
+                        if(!in_chunk(nb) || group[nb] >= 0) continue;
+
+                        auto it = std::find_if(candidates.begin(),candidates.end(),[nb](const std::pair<int,double>& p){return p.first == nb;});
+                        if(it == candidates.end()) candidates.push_back({nb,weights[j]});
+                        else it->second += weights[j];
+                    }
+                }
+                if(candidates.empty()) break;
+
+                auto best = std::max_element(candidates.begin(),candidates.end(),[](const std::pair<int,double>& a, const std::pair<int,double>& b){return a.second < b.second;});
+                group[best->first] = id;
+                members.push_back(best->first);
+            }
+
+            group_size.push_back(members.size());
+        }
+
+        // Merge singletons into the strongest connected neighbouring group
+        for(int i = begin; i < end; i++)
+        {
+            if(graph.is_ghost[i] || group_size[group[i]] != 1) continue;
+
+            int best = -1;
+            double best_w = 0;
+            for(int j = xadj[i]; j < xadj[i+1]; j++)
+            {
+                const int nb = adjncy[j];
+                if(in_chunk(nb) && weights[j] > best_w){best = group[nb]; best_w = weights[j];}
+            }
+            if(best < 0) continue;
+
+            group_size[group[i]] = 0;
+            group_size[best]++;
+            group[i] = best;
+        }
+
+        // Compact local group ids
+        std::vector<int> new_id(group_size.size(),-1);
+        int n = 0;
+        for(unsigned int g = 0; g < group_size.size(); g++)
+        {
+            if(group_size[g] > 0) new_id[g] = n++;
+        }
+        for(int i = begin; i < end; i++)
+        {
+            if(!graph.is_ghost[i]) group[i] = new_id[group[i]];
+        }
+        chunk_groups[c+1] = n;
+    }
+
+    for(int c = 0; c < N_chunks; c++) chunk_groups[c+1] += chunk_groups[c];
+
+    #pragma omp parallel for schedule(static)
+    for(int i = 0; i < N_cells; i++)
+    {
+        if(!graph.is_ghost[i]) group[i] += chunk_groups[i/AGGLOMERATION_CHUNK_SIZE];
+    }
+
+    return chunk_groups[N_chunks];
+}
+
+// METIS agglomeration, partitions the dual graph into N_cells/target_size parts
+int mesh_agglomerator::group_metis(const level_graph& graph, std::vector<int32_t>& group, int target_size) const
+{
+    std::vector<int32_t> xadj, adjncy;
+    std::vector<double> weights;
+    build_cell_adjacency(graph,xadj,adjncy,weights);
+
+    // Compact to non ghost cells
+    std::vector<int32_t> real_idx(graph.N_cells,-1);
+    idx_t N_real = 0;
+    for(int i = 0; i < graph.N_cells; i++)
+    {
+        if(!graph.is_ghost[i]) real_idx[i] = N_real++;
+    }
+
+    const double w_max = weights.empty() ? 1 : *std::max_element(weights.begin(),weights.end());
+
+    std::vector<idx_t> r_xadj(N_real+1,0), r_adjncy, r_adjwgt;
+    r_adjncy.reserve(adjncy.size());
+    r_adjwgt.reserve(adjncy.size());
+    for(int i = 0; i < graph.N_cells; i++)
+    {
+        if(graph.is_ghost[i]) continue;
+        for(int j = xadj[i]; j < xadj[i+1]; j++)
+        {
+            r_adjncy.push_back(real_idx[adjncy[j]]);
+            r_adjwgt.push_back(std::max<idx_t>(1,(idx_t)(1000*weights[j]/w_max)));
+        }
+        r_xadj[real_idx[i]+1] = r_adjncy.size();
+    }
+
+    idx_t N_parts = std::max(1,(int)N_real/target_size);
+    std::vector<idx_t> part(N_real,0);
+
+    if(N_parts > 1)
+    {
+        idx_t N_constraints = 1, edgecut;
+        auto output = METIS_PartGraphKway(&N_real,&N_constraints,r_xadj.data(),r_adjncy.data(),NULL,NULL,r_adjwgt.data(),
+                                          &N_parts,NULL,NULL,NULL,&edgecut,part.data());
+        if(output != METIS_OK)
+        {
+            mesh.out() << "METIS agglomeration failed\n";
+            return -1;
+        }
+    }
+
+    // Remove empty parts
+    std::vector<int32_t> new_id(N_parts,-1);
+    int n = 0;
+    for(int i = 0; i < N_real; i++)
+    {
+        if(new_id[part[i]] < 0) new_id[part[i]] = n++;
+    }
+
+    group.assign(graph.N_cells,-1);
+    for(int i = 0; i < graph.N_cells; i++)
+    {
+        if(!graph.is_ghost[i]) group[i] = new_id[part[real_idx[i]]];
+    }
+
+    return n;
+}
+
+// Merges fine faces between the same pair of coarse cells, sums their area vectors
+void mesh_agglomerator::build_coarse_faces(const level_graph& graph, multigrid_level& level) const
+{
+    const int N_fine_faces = graph.N_faces;
+
+    std::vector<std::pair<uint64_t,int32_t>> keys(N_fine_faces);
+    level.Fine_face_to_coarse.assign(N_fine_faces,-1);
+    level.Fine_face_sign.assign(N_fine_faces,0);
+
+    #pragma omp parallel for schedule(static)
+    for(int i = 0; i < N_fine_faces; i++)
+    {
+        const uint64_t co = level.Fine_to_coarse[graph.Face_ON_idx[2*i]];
+        const uint64_t cn = level.Fine_to_coarse[graph.Face_ON_idx[2*i+1]];
+
+        if(co == cn){keys[i] = {UINT64_MAX,i}; continue;}
+
+        keys[i] = {(std::min(co,cn) << 32) | std::max(co,cn),i};
+        level.Fine_face_sign[i] = (co < cn) ? 1 : -1;
+    }
+
+    std::sort(keys.begin(),keys.end());
+
+    // Coarse faces are consecutive runs of equal keys
+    std::vector<int32_t> face_start;
+    for(int i = 0; i < N_fine_faces && keys[i].first != UINT64_MAX; i++)
+    {
+        if(i == 0 || keys[i].first != keys[i-1].first) face_start.push_back(i);
+    }
+    level.N_faces = face_start.size();
+    face_start.push_back(face_start.empty() ? 0 : std::lower_bound(keys.begin(),keys.end(),std::make_pair(UINT64_MAX,(int32_t)-1))-keys.begin());
+
+    level.Face_ON_idx.resize(2*level.N_faces);
+    level.Face_normal_array.assign(3*level.N_faces,0);
+
+    #pragma omp parallel for schedule(static)
+    for(int f = 0; f < level.N_faces; f++)
+    {
+        level.Face_ON_idx[2*f] = keys[face_start[f]].first >> 32;
+        level.Face_ON_idx[2*f+1] = keys[face_start[f]].first & 0xffffffff;
+
+        for(int k = face_start[f]; k < face_start[f+1]; k++)
+        {
+            const int i = keys[k].second;
+            level.Fine_face_to_coarse[i] = f;
+            for(int d = 0; d < 3; d++)
+            {
+                level.Face_normal_array[3*f+d] += level.Fine_face_sign[i]*graph.Face_normal_array[3*i+d];
+            }
+        }
+    }
+}
+
+// Coarse cell -> face CSR table
+void mesh_agglomerator::build_cell_face_table(multigrid_level& level) const
+{
+    level.Cell_faces_offsets.assign(level.N_cells+1,0);
+    for(int f = 0; f < level.N_faces; f++)
+    {
+        level.Cell_faces_offsets[level.Face_ON_idx[2*f]+1]++;
+        level.Cell_faces_offsets[level.Face_ON_idx[2*f+1]+1]++;
+    }
+    for(int i = 0; i < level.N_cells; i++) level.Cell_faces_offsets[i+1] += level.Cell_faces_offsets[i];
+
+    level.Cell_faces_idx.resize(level.Cell_faces_offsets[level.N_cells]);
+    std::vector<int32_t> fill(level.Cell_faces_offsets.begin(),level.Cell_faces_offsets.end()-1);
+    for(int f = 0; f < level.N_faces; f++)
+    {
+        level.Cell_faces_idx[fill[level.Face_ON_idx[2*f]]++] = f;
+        level.Cell_faces_idx[fill[level.Face_ON_idx[2*f+1]]++] = f;
+    }
+}
+
+// Builds up to N_levels coarse levels, stops when coarsening stalls or level has less than min_cells
+bool mesh_agglomerator::build_levels(int N_levels, agglomeration_method method, int target_size, int min_cells)
+{
+    if(mesh.Face_ON_idx == nullptr || mesh.Face_normal_array == nullptr || mesh.V_array == nullptr)
+    {
+        mesh.out() << "Agglomeration needs faces, face geometry and volumes\n";
+        return false;
+    }
+
+    if(target_size <= 0) target_size = (mesh.Dimension == 2) ? 4 : 8;
+
+    levels.clear();
+    for(int l = 0; l < N_levels; l++)
+    {
+        const level_graph graph = fine_graph(l);
+        const int N_ghosts = std::count(graph.is_ghost.begin(),graph.is_ghost.end(),1);
+        const int N_real = graph.N_cells-N_ghosts;
+
+        if(N_real <= min_cells) break;
+
+        multigrid_level level;
+        int N_groups;
+        if(method == agglomeration_method::metis) N_groups = group_metis(graph,level.Fine_to_coarse,target_size);
+        else N_groups = group_greedy(graph,level.Fine_to_coarse,target_size);
+        if(N_groups < 0) return false;
+
+        if(N_groups > 0.9*N_real) break;
+
+        // Ghosts stay separate cells after the agglomerates
+        int k = N_groups;
+        for(int i = 0; i < graph.N_cells; i++)
+        {
+            if(graph.is_ghost[i]) level.Fine_to_coarse[i] = k++;
+        }
+
+        level.N_cells = N_groups+N_ghosts;
+        level.N_ghosts = N_ghosts;
+
+        level.V_array.assign(level.N_cells,0);
+        for(int i = 0; i < graph.N_cells; i++)
+        {
+            level.V_array[level.Fine_to_coarse[i]] += graph.V_array[i];
+        }
+
+        build_coarse_faces(graph,level);
+        build_cell_face_table(level);
+
+        mesh.out() << "Multigrid level " << l+1 << ":\t" << N_groups << " cells, " << level.N_faces << " faces\n";
+        levels.push_back(std::move(level));
+    }
+    return true;
+}
@@ -0,0 +1,67 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+
+#include "mesh_manager.h"
+
+#define AGGLOMERATION_CHUNK_SIZE 4096   // Cells per greedy chunk, fixed so results do not depend on thread count
+
+// Grouping algorithm for coarse cells
+enum class agglomeration_method
+{
+    greedy,     // Face area weighted growth, parallel over cell chunks
+    metis       // METIS k-way partition of the level dual graph
+};
+
+// One coarse level, fine indices refer to the previous level (level 0 refers to mesh_struct)
+struct multigrid_level
+{
+    int N_cells = 0;        // Coarse cells, agglomerates first then ghosts
+    int N_ghosts = 0;       // Boundary ghost cells, kept one to one with the fine ghosts
+    int N_faces = 0;        // Coarse faces
+
+    std::vector<int32_t> Fine_to_coarse;        // Fine cell -> coarse cell
+    std::vector<int32_t> Fine_face_to_coarse;   // Fine face -> coarse face, -1 if the face is inside an agglomerate
+    std::vector<int8_t> Fine_face_sign;         // Orientation of fine face relative to its coarse face (+1/-1)
+
+    std::vector<uint32_t> Face_ON_idx;          // Coarse face owner/neighbour pairs
+    std::vector<double> Face_normal_array;      // Summed fine face area vectors, oriented owner -> neighbour
+    std::vector<double> V_array;                // Coarse volumes
+
+    std::vector<int32_t> Cell_faces_offsets;    // Coarse cell -> face table (CSR)
+    std::vector<int32_t> Cell_faces_idx;        // Faces of each coarse cell
+};
+
+class mesh_agglomerator
+{
+    private:
+    const mesh_struct& mesh;
+
+    // Level graph, real cells first for coarse levels, ghosts flagged for level 0
+    struct level_graph
+    {
+        int N_cells;
+        int N_faces;
+        std::vector<uint8_t> is_ghost;
+        const uint32_t* Face_ON_idx;
+        const double* Face_normal_array;
+        const double* V_array;
+    };
+
+    level_graph fine_graph(int level) const;
+    void build_cell_adjacency(const level_graph& graph, std::vector<int32_t>& xadj, std::vector<int32_t>& adjncy, std::vector<double>& weights) const;
+
+    int group_greedy(const level_graph& graph, std::vector<int32_t>& group, int target_size) const;
+    int group_metis(const level_graph& graph, std::vector<int32_t>& group, int target_size) const;     // -1 if METIS fails
+
+    void build_coarse_faces(const level_graph& graph, multigrid_level& level) const;
+    void build_cell_face_table(multigrid_level& level) const;
+
+    public:
+    std::vector<multigrid_level> levels;
+
+    mesh_agglomerator(const mesh_struct& _mesh);
+
+    // False if inputs are missing or METIS fails
+    bool build_levels(int N_levels, agglomeration_method method = agglomeration_method::greedy, int target_size = 0, int min_cells = 16);
+};
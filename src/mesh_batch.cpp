@@ -0,0 +1,89 @@
+#include "mesh_batch.h"
+#include <thread>
+#include <chrono>
+#include <sstream>
+#include <omp.h>
+
+work_stealing_pool::work_stealing_pool(int _N_workers, int _N_cores) : N_workers(std::max(_N_workers,1)),
+                                                                      N_cores(_N_cores > 0 ? _N_cores : omp_get_num_procs())
+{
+    for(int w = 0; w < N_workers; w++) queues.push_back(std::make_unique<worker_queue>());
+}
+
+// Own tasks are taken from the front, stolen ones from the back of another worker
+bool work_stealing_pool::take(int worker, int& task)
+{
+    for(int k = 0; k < N_workers; k++)
+    {
+        worker_queue& queue = *queues[(worker+k) % N_workers];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if(queue.tasks.empty()) continue;
+
+        if(k == 0)
+        {
+            task = queue.tasks.front();
+            queue.tasks.pop_front();
+        }
+        else
+        {
+            task = queue.tasks.back();
+            queue.tasks.pop_back();
+        }
+        return true;
+    }
+    return false;
+}
+
+void work_stealing_pool::work(int worker, const std::function<void(int)>& task)
+{
+    int i;
+    while(take(worker,i))
+    {
+        const int N_waiting = --N_unstarted;
+        const int N_busy = std::min(N_workers,++N_running+N_waiting);
+
+        // OpenMP settings are per thread, they apply to the parallel regions of this task only
+        omp_set_num_threads(std::max(1,N_cores/N_busy));
+        task(i);
+
+        N_running--;
+    }
+}
+
+// Tasks are dealt in contiguous blocks, neighbouring (often similar) files start on the same worker
+void work_stealing_pool::run(int N_tasks, const std::function<void(int)>& task)
+{
+    for(int i = 0; i < N_tasks; i++) queues[(int64_t)i*N_workers/N_tasks]->tasks.push_back(i);
+    N_unstarted = N_tasks;
+    N_running = 0;
+
+    std::vector<std::thread> threads;
+    for(int w = 0; w < N_workers; w++) threads.emplace_back([this,w,&task]{work(w,task);});
+    for(auto& thread : threads) thread.join();
+}
+
+// Runs the pipeline of one mesh with its own manager and log, failures are returned instead of exiting
+batch_result preprocess_mesh(const batch_job& job)
+{
+    batch_result result;
+    std::ostringstream log;
+    auto start = std::chrono::steady_clock::now();
+
+    {
+        mesh_manager manager(&log);
+
+        result.ok = manager.read_mesh(job.mesh_path) && manager.require(job.quantities);
+        if(result.ok && job.N_parts > 0) result.ok = manager.write_partitions(job.output_base,job.N_parts);
+
+        result.error = manager.error;
+        if(result.ok)
+        {
+            result.N_elements = manager.mesh.N_elements;
+            result.N_faces = manager.mesh.N_faces;
+        }
+    }
+
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+    result.log = log.str();
+    return result;
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include <vector>
+#include <deque>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <cstdint>
+
+#include "mesh_manager.h"
+
+// Fixed set of tasks run by N workers, each worker takes tasks from the front of its own deque
+// and steals from the back of the others once it runs dry
+// Cores are shared between workers and the OpenMP stages of each task: a starting task gets
+// cores/(busy workers) threads, so the last tasks of a batch run with more threads each
+class work_stealing_pool
+{
+    private:
+    struct worker_queue
+    {
+        std::mutex mutex;
+        std::deque<int> tasks;
+    };
+
+    int N_workers;
+    int N_cores;
+    std::vector<std::unique_ptr<worker_queue>> queues;
+    std::atomic<int> N_unstarted{0};
+    std::atomic<int> N_running{0};
+
+    bool take(int worker, int& task);
+    void work(int worker, const std::function<void(int)>& task);
+
+    public:
+    work_stealing_pool(int _N_workers, int _N_cores = 0);     // 0 cores = all hardware threads
+
+    // Runs task(i) for i in [0,N_tasks), returns once all are done
+    void run(int N_tasks, const std::function<void(int)>& task);
+};
+
+// One mesh of a batch: read, derived quantities, partition and partition files (snapshot)
+struct batch_job
+{
+    std::string mesh_path;
+    std::string output_base;        // Partition files <output_base>.part<p>
+    int N_parts = 0;                // 0 skips partitioning and partition files
+    uint32_t quantities = quantity_faces | quantity_volumes | quantity_face_geometry;
+};
+
+struct batch_result
+{
+    bool ok = false;
+    std::string error;
+    std::string log;                // Messages of the mesh, kept per file so threads do not interleave
+    int N_elements = 0, N_faces = 0;
+    double seconds = 0;
+};
+
+batch_result preprocess_mesh(const batch_job& job);
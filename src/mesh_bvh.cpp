@@ -0,0 +1,172 @@
+#include "mesh_bvh.h"
+#include <math.h>
+
+// Signed volume (x6) of tetrahedron a,b,c,d
+static inline double orient3d(const double* a, const double* b, const double* c, const double* d)
+{
+    const double u[3] = {b[0]-a[0],b[1]-a[1],b[2]-a[2]};
+    const double v[3] = {c[0]-a[0],c[1]-a[1],c[2]-a[2]};
+    const double w[3] = {d[0]-a[0],d[1]-a[1],d[2]-a[2]};
+    return u[0]*(v[1]*w[2]-v[2]*w[1])-u[1]*(v[0]*w[2]-v[2]*w[0])+u[2]*(v[0]*w[1]-v[1]*w[0]);
+}
+
+mesh_bvh::mesh_bvh(const mesh_struct& _mesh) : mesh(_mesh){}
+
+// Builds tree over bounding boxes of non ghost elements
+bool mesh_bvh::build()
+{
+    if(mesh.Element_centroids_array == nullptr)
+    {
+        mesh.out() << "BVH needs element centroids\n";
+        return false;
+    }
+
+    Element_idx.clear();
+    Element_idx.reserve(mesh.N_elements-mesh.N_boundary_elements);
+    for(int i = 0; i < mesh.N_elements; i++)
+    {
+        if(!mesh.is_boundary_element(i)) Element_idx.push_back(i);
+    }
+
+    const int N_items = Element_idx.size();
+    std::vector<double> boxes(6*N_items);
+
+    #pragma omp parallel for schedule(static)
+    for(int k = 0; k < N_items; k++)
+    {
+        const int i = Element_idx[k];
+        double* box = &boxes[6*k];
+        for(int d = 0; d < 3; d++)
+        {
+            box[d] = std::numeric_limits<double>::max();
+            box[3+d] = std::numeric_limits<double>::lowest();
+        }
+
+        for(int j = mesh.Element_vertices_idx_offsets[i]; j < mesh.Element_vertices_idx_offsets[i+1]; j++)
+        {
+            const double* x = &mesh.node_pos_array[3*mesh.Element_vertices_idx_array[j]];
+            for(int d = 0; d < 3; d++)
+            {
+                box[d] = std::min(box[d],x[d]);
+                box[3+d] = std::max(box[3+d],x[d]);
+            }
+        }
+
+        // Pad flat boxes (2D meshes, axis aligned faces) so boundary points are not lost to round off
+        double size = 0;
+        for(int d = 0; d < 3; d++) size = std::max(size,box[3+d]-box[d]);
+        for(int d = 0; d < 3; d++)
+        {
+            box[d] -= 1e-9*size;
+            box[3+d] += 1e-9*size;
+        }
+    }
+
+    tree.build(boxes);
+    return true;
+}
+
+// Tetrahedron containment from the signs of the four sub volumes
+bool mesh_bvh::point_in_tetrahedron(const double* a, const double* b, const double* c, const double* d, const double* p, const double tol) const
+{
+    const double V = orient3d(a,b,c,d);
+    if(V == 0) return false;
+
+    const double s = (V > 0) ? 1 : -1;
+    const double eps = -tol*fabs(V);
+
+    return s*orient3d(p,b,c,d) >= eps && s*orient3d(a,p,c,d) >= eps
+        && s*orient3d(a,b,p,d) >= eps && s*orient3d(a,b,c,p) >= eps;
+}
+
+// Exact containment for the element geometry used by compute_volumes (face fans around vertex averages)
+bool mesh_bvh::point_in_element(const int element_idx, const double* p) const
+{
+    const double tol = 1e-10;
+    const double* X = mesh.node_pos_array;
+    const int32_t* v = &mesh.Element_vertices_idx_array[mesh.Element_vertices_idx_offsets[element_idx]];
+    const int n = mesh.Element_vertices_idx_offsets[element_idx+1]-mesh.Element_vertices_idx_offsets[element_idx];
+    const int type = mesh.Element_type_array[element_idx];
+
+    if(mesh.Dimension == 2)
+    {
+        // Convex polygon, point on the inner side of every edge
+        const double s = (mesh.V_array[element_idx] >= 0) ? 1 : -1;
+        const double eps = -tol*fabs(mesh.V_array[element_idx]);
+        for(int j = 0; j < n; j++)
+        {
+            const double* a = &X[3*v[j]];
+            const double* b = &X[3*v[(j+1)%n]];
+            if(s*((b[0]-a[0])*(p[1]-a[1])-(b[1]-a[1])*(p[0]-a[0])) < eps) return false;
+        }
+        return true;
+    }
+
+    if(type == 4)
+    {
+        return point_in_tetrahedron(&X[3*v[0]],&X[3*v[1]],&X[3*v[2]],&X[3*v[3]],p,tol);
+    }
+
+    // Other 3D elements are split to tetrahedra (vertex average, face average, edge)
+    double c[3] = {0,0,0};
+    for(int j = 0; j < n; j++)
+    {
+        for(int d = 0; d < 3; d++) c[d] += X[3*v[j]+d];
+    }
+    for(int d = 0; d < 3; d++) c[d] /= n;
+
+    for(auto const& face : element_type_to_faces.at(type))
+    {
+        const int nf = face.size();
+        double fc[3] = {0,0,0};
+        for(int j = 0; j < nf; j++)
+        {
+            for(int d = 0; d < 3; d++) fc[d] += X[3*v[face[j]]+d];
+        }
+        for(int d = 0; d < 3; d++) fc[d] /= nf;
+
+        for(int j = 0; j < nf; j++)
+        {
+            if(point_in_tetrahedron(c,fc,&X[3*v[face[j]]],&X[3*v[face[(j+1)%nf]]],p,tol)) return true;
+        }
+    }
+    return false;
+}
+
+// Returns element containing p or -1
+int mesh_bvh::locate_point(const double* p) const
+{
+    const int item = tree.find_containing(p,[this,p](int k){return point_in_element(Element_idx[k],p);});
+    return (item < 0) ? -1 : Element_idx[item];
+}
+
+void mesh_bvh::locate_points(const double* points, const int N_points, int32_t* element_idxs) const
+{
+    #pragma omp parallel for schedule(dynamic,64)
+    for(int i = 0; i < N_points; i++)
+    {
+        element_idxs[i] = locate_point(&points[3*i]);
+    }
+}
+
+// Returns element with the closest centroid
+int mesh_bvh::nearest_element(const double* p) const
+{
+    double best_dist2 = std::numeric_limits<double>::max();
+    const int item = tree.find_nearest(p,[this,p](int k)
+    {
+        const double* x = &mesh.Element_centroids_array[3*Element_idx[k]];
+        return (x[0]-p[0])*(x[0]-p[0])+(x[1]-p[1])*(x[1]-p[1])+(x[2]-p[2])*(x[2]-p[2]);
+    },best_dist2);
+
+    return (item < 0) ? -1 : Element_idx[item];
+}
+
+void mesh_bvh::nearest_elements(const double* points, const int N_points, int32_t* element_idxs) const
+{
+    #pragma omp parallel for schedule(dynamic,64)
+    for(int i = 0; i < N_points; i++)
+    {
+        element_idxs[i] = nearest_element(&points[3*i]);
+    }
+}
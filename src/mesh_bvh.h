@@ -0,0 +1,31 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+
+#include "mesh_manager.h"
+#include "bvh_tree.h"
+
+// Spatial index over mesh elements (ghosts excluded) for point location and nearest element queries
+class mesh_bvh
+{
+    private:
+    const mesh_struct& mesh;
+
+    bool point_in_tetrahedron(const double* a, const double* b, const double* c, const double* d, const double* p, const double tol) const;
+
+    public:
+    bvh_tree tree;
+    std::vector<int32_t> Element_idx;   // Tree item -> element
+
+    mesh_bvh(const mesh_struct& _mesh);
+
+    bool build();     // False without element centroids
+
+    bool point_in_element(const int element_idx, const double* p) const;
+
+    int locate_point(const double* p) const;
+    void locate_points(const double* points, const int N_points, int32_t* element_idxs) const;
+
+    int nearest_element(const double* p) const;
+    void nearest_elements(const double* points, const int N_points, int32_t* element_idxs) const;
+};
@@ -0,0 +1,291 @@
+#include "mesh_compressed_connectivity.h"
+#include <algorithm>
+
+// Splits items into runs of equal stride and type, then packs each chunk in parallel (chunks start on word boundaries)
+template<typename S, typename T, typename V>
+static void encode_stream(packed_stream& stream, int N_items, S stride, T type, V value)
+{
+    stream.N_items = N_items;
+    stream.chunks.clear();
+
+    for(int i = 0; i < N_items; i++)
+    {
+        if(stream.chunks.empty() || stream.chunks.back().N_items == CONNECTIVITY_CHUNK_SIZE ||
+           stream.chunks.back().stride != stride(i) || stream.chunks.back().type != type(i))
+        {
+            stream.chunks.push_back(packed_chunk{i,0,0,0,(uint8_t)stride(i),0,(uint8_t)type(i)});
+        }
+        stream.chunks.back().N_items++;
+    }
+
+    const int N_chunks = stream.chunks.size();
+
+    // Chunk base and bit width
+    #pragma omp parallel for schedule(static)
+    for(int c = 0; c < N_chunks; c++)
+    {
+        packed_chunk& chunk = stream.chunks[c];
+        int32_t vmin = INT32_MAX, vmax = INT32_MIN;
+        for(int i = chunk.first; i < chunk.first+chunk.N_items; i++)
+        {
+            for(int k = 0; k < chunk.stride; k++)
+            {
+                vmin = std::min(vmin,value(i,k));
+                vmax = std::max(vmax,value(i,k));
+            }
+        }
+        const uint32_t range = vmax-vmin;
+        chunk.base = vmin;
+        chunk.bits = range ? 32-__builtin_clz(range) : 0;
+    }
+
+    uint32_t N_words = 0;
+    for(auto& chunk : stream.chunks)
+    {
+        chunk.word_offset = N_words;
+        N_words += ((uint64_t)chunk.N_items*chunk.stride*chunk.bits+63)/64;
+    }
+    stream.Packed_data.assign(N_words+2,0);
+
+    #pragma omp parallel for schedule(static)
+    for(int c = 0; c < N_chunks; c++)
+    {
+        const packed_chunk& chunk = stream.chunks[c];
+        if(chunk.bits == 0) continue;
+
+        uint64_t* data = &stream.Packed_data[chunk.word_offset];
+        uint64_t bit = 0;
+        for(int i = chunk.first; i < chunk.first+chunk.N_items; i++)
+        {
+            for(int k = 0; k < chunk.stride; k++, bit += chunk.bits)
+            {
+                const uint64_t v = (uint32_t)(value(i,k)-chunk.base);
+                const uint64_t w = bit >> 6, s = bit & 63;
+                data[w] |= v << s;
+                if(s+chunk.bits > 64) data[w+1] |= v >> (64-s);
+            }
+        }
+    }
+}
+
+int packed_stream::find_chunk(int item) const
+{
+    auto it = std::upper_bound(chunks.begin(),chunks.end(),item,[](int i, const packed_chunk& chunk){return i < chunk.first;});
+    return (it-chunks.begin())-1;
+}
+
+// Branch free block decoder, every value reads two neighbouring words
+void packed_stream::decode(int c, int first, int N, int32_t* out) const
+{
+    const packed_chunk& chunk = chunks[c];
+    const uint64_t* data = &Packed_data[chunk.word_offset];
+    const uint64_t bits = chunk.bits;
+    const uint64_t mask = (1ull << bits)-1;
+    const int32_t base = chunk.base;
+
+    #pragma omp simd
+    for(int j = 0; j < N; j++)
+    {
+        const uint64_t bit = (first+j)*bits;
+        const uint64_t w = bit >> 6, s = bit & 63;
+        const uint64_t v = (data[w] >> s) | ((data[w+1] << 1) << (63-s));
+        out[j] = base+(int32_t)(v & mask);
+    }
+}
+
+compressed_connectivity::compressed_connectivity(const mesh_struct& _mesh) : mesh(_mesh){}
+
+void compressed_connectivity::compress()
+{
+    const int32_t* offsets = mesh.Element_vertices_idx_offsets;
+    const int32_t* vertices = mesh.Element_vertices_idx_array;
+    const uint8_t* types = mesh.Element_type_array;
+
+    encode_stream(elements,mesh.N_elements,
+                  [&](int i){return offsets[i+1]-offsets[i];},
+                  [&](int i){return types[i];},
+                  [&](int i, int k){return vertices[offsets[i]+k];});
+
+    N_face_vertices = 0;
+    if(mesh.Face_ON_idx == nullptr)
+    {
+        faces = packed_stream();
+        face_nodes = packed_stream();
+        return;
+    }
+
+    const uint32_t* face_on = mesh.Face_ON_idx;
+    encode_stream(faces,mesh.N_faces,
+                  [](int){return 2;},
+                  [](int){return 0;},
+                  [&](int i, int k){return (int32_t)face_on[2*i+k];});
+
+    // Mixed triangle/quad faces alternate in face order, one padded stride keeps the chunks full
+    const uint32_t* face_offsets = mesh.Face_vertices_idx_offsets;
+    const uint32_t* face_vertices = mesh.Face_vertices_idx_array;
+    uint32_t stride = 0;
+    for(int i = 0; i < mesh.N_faces; i++) stride = std::max(stride,face_offsets[i+1]-face_offsets[i]);
+    N_face_vertices = face_offsets[mesh.N_faces];
+
+    encode_stream(face_nodes,mesh.N_faces,
+                  [&](int){return stride;},
+                  [](int){return 0;},
+                  [&](int i, int k)
+                  {
+                      const uint32_t n = face_offsets[i+1]-face_offsets[i];
+                      return (int32_t)face_vertices[face_offsets[i]+((uint32_t)k < n ? k : 0)];
+                  });
+}
+
+int compressed_connectivity::element_vertices(int i, int32_t* out) const
+{
+    const int c = elements.find_chunk(i);
+    const packed_chunk& chunk = elements.chunks[c];
+
+    elements.decode(c,(i-chunk.first)*chunk.stride,chunk.stride,out);
+    return chunk.stride;
+}
+
+uint8_t compressed_connectivity::element_type(int i) const
+{
+    return elements.chunks[elements.find_chunk(i)].type;
+}
+
+void compressed_connectivity::face_owner_neighbour(int i, uint32_t& owner, uint32_t& neighbour) const
+{
+    const int c = faces.find_chunk(i);
+    int32_t on[2];
+
+    faces.decode(c,2*(i-faces.chunks[c].first),2,on);
+    owner = on[0];
+    neighbour = on[1];
+}
+
+// Vertex count of a padded face, a face never repeats its first vertex
+static int unpadded_count(const int32_t* v, int stride)
+{
+    int n = stride;
+    while(n > 2 && v[n-1] == v[0]) n--;
+    return n;
+}
+
+int compressed_connectivity::face_vertices(int i, int32_t* out) const
+{
+    const int c = face_nodes.find_chunk(i);
+    const packed_chunk& chunk = face_nodes.chunks[c];
+
+    face_nodes.decode(c,(i-chunk.first)*chunk.stride,chunk.stride,out);
+    return unpadded_count(out,chunk.stride);
+}
+
+void compressed_connectivity::decode_element_chunk(int c, int32_t* out) const
+{
+    elements.decode(c,0,elements.chunks[c].N_items*elements.chunks[c].stride,out);
+}
+
+void compressed_connectivity::decode_face_chunk(int c, int32_t* out) const
+{
+    faces.decode(c,0,2*faces.chunks[c].N_items,out);
+}
+
+void compressed_connectivity::decode_face_vertex_chunk(int c, int32_t* out) const
+{
+    face_nodes.decode(c,0,face_nodes.chunks[c].N_items*face_nodes.chunks[c].stride,out);
+}
+
+void compressed_connectivity::decompress(int32_t** vertices, int32_t** offsets, uint8_t** types, uint32_t** face_on,
+                                         uint32_t** face_vertices, uint32_t** face_offsets) const
+{
+    const int N_chunks = elements.chunks.size();
+
+    *offsets = (int32_t*)malloc((elements.N_items+1)*sizeof(int32_t));
+    *types = (uint8_t*)malloc(elements.N_items*sizeof(uint8_t));
+
+    (*offsets)[0] = 0;
+    for(auto const& chunk : elements.chunks)
+    {
+        for(int i = chunk.first; i < chunk.first+chunk.N_items; i++)
+        {
+            (*offsets)[i+1] = (*offsets)[i]+chunk.stride;
+            (*types)[i] = chunk.type;
+        }
+    }
+
+    *vertices = (int32_t*)malloc((*offsets)[elements.N_items]*sizeof(int32_t));
+
+    #pragma omp parallel for schedule(static)
+    for(int c = 0; c < N_chunks; c++)
+    {
+        decode_element_chunk(c,&(*vertices)[(*offsets)[elements.chunks[c].first]]);
+    }
+
+    if(face_on == nullptr) return;
+
+    const int N_face_chunks = faces.chunks.size();
+    *face_on = (uint32_t*)malloc(2*faces.N_items*sizeof(uint32_t));
+
+    #pragma omp parallel for schedule(static)
+    for(int c = 0; c < N_face_chunks; c++)
+    {
+        decode_face_chunk(c,(int32_t*)&(*face_on)[2*faces.chunks[c].first]);
+    }
+
+    if(face_vertices == nullptr || face_offsets == nullptr) return;
+
+    // Padding is dropped, counts first then vertices
+    auto unpack = [&](auto f)
+    {
+        #pragma omp parallel
+        {
+            std::vector<int32_t> padded;
+
+            #pragma omp for schedule(static)
+            for(int c = 0; c < (int)face_nodes.chunks.size(); c++)
+            {
+                const packed_chunk& chunk = face_nodes.chunks[c];
+                padded.resize(chunk.N_items*chunk.stride);
+                decode_face_vertex_chunk(c,padded.data());
+
+                for(int j = 0; j < chunk.N_items; j++)
+                {
+                    const int32_t* v = &padded[j*chunk.stride];
+                    f(chunk.first+j,v,unpadded_count(v,chunk.stride));
+                }
+            }
+        }
+    };
+
+    *face_offsets = (uint32_t*)malloc((face_nodes.N_items+1)*sizeof(uint32_t));
+    (*face_offsets)[0] = 0;
+    unpack([&](int i, const int32_t*, int n){(*face_offsets)[i+1] = n;});
+    for(int i = 0; i < face_nodes.N_items; i++) (*face_offsets)[i+1] += (*face_offsets)[i];
+
+    *face_vertices = (uint32_t*)malloc(std::max((*face_offsets)[face_nodes.N_items],1u)*sizeof(uint32_t));
+    unpack([&](int i, const int32_t* v, int n){std::copy(v,v+n,&(*face_vertices)[(*face_offsets)[i]]);});
+}
+
+size_t compressed_connectivity::compressed_bytes() const
+{
+    return elements.bytes()+faces.bytes()+face_nodes.bytes();
+}
+
+// Plain arrays replaced by the compressed streams (element vertices, offsets and types, face pairs, face vertices and offsets)
+size_t compressed_connectivity::uncompressed_bytes() const
+{
+    size_t N_vertices = 0;
+    for(auto const& chunk : elements.chunks) N_vertices += chunk.N_items*chunk.stride;
+
+    size_t bytes = N_vertices*sizeof(int32_t)+(elements.N_items+1)*sizeof(int32_t)+elements.N_items*sizeof(uint8_t);
+    if(faces.N_items > 0) bytes += 2*faces.N_items*sizeof(uint32_t)+N_face_vertices*sizeof(uint32_t)+(face_nodes.N_items+1)*sizeof(uint32_t);
+    return bytes;
+}
+
+void compressed_connectivity::print_info() const
+{
+    const double N_cells = std::max(elements.N_items,1);
+
+    mesh.out() << "Compressed connectivity:\t" << elements.chunks.size() << " element chunks, " << faces.chunks.size() << " face chunks, "
+               << face_nodes.chunks.size() << " face vertex chunks\n";
+    mesh.out() << "Bytes per element:\t" << uncompressed_bytes()/N_cells << " -> " << compressed_bytes()/N_cells << "\n";
+    mesh.out() << "Compression ratio:\t" << (double)uncompressed_bytes()/std::max(compressed_bytes(),(size_t)1) << "\n";
+}
@@ -0,0 +1,72 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+
+#include "mesh_manager.h"
+
+#define CONNECTIVITY_CHUNK_SIZE 256     // Max elements (or faces) per compressed chunk
+
+// Run of items with the same number of values, stored as bit packed differences to the chunk minimum
+struct packed_chunk
+{
+    int32_t first;          // First item in chunk
+    int32_t base;           // Minimum value in chunk
+    uint32_t word_offset;   // Start of chunk data in Packed_data
+    uint16_t N_items;       // Items in chunk
+    uint8_t stride;         // Values per item
+    uint8_t bits;           // Bits per value (0 if all values equal base)
+    uint8_t type;           // Element type (GMSH), 0 for faces
+};
+
+// Fixed stride chunks need no per item offsets, item k of a chunk starts at bit k*stride*bits
+struct packed_stream
+{
+    int N_items = 0;
+    std::vector<packed_chunk> chunks;
+    std::vector<uint64_t> Packed_data;      // Padded with two words so the block decoder never reads past the end
+
+    // Chunk containing item
+    int find_chunk(int item) const;
+
+    // Decodes N values of chunk c starting at value first
+    void decode(int c, int first, int N, int32_t* out) const;
+
+    size_t bytes() const {return chunks.size()*sizeof(packed_chunk)+Packed_data.size()*sizeof(uint64_t);}
+};
+
+// Compact copy of element connectivity, face owner/neighbour pairs and face vertices, best after mesh_manager::renumber_nodes
+// Together the streams replace every connectivity array the mesh keeps resident (offsets follow from chunk strides)
+class compressed_connectivity
+{
+    private:
+    const mesh_struct& mesh;
+    size_t N_face_vertices = 0;     // Without padding
+
+    public:
+    packed_stream elements;     // Element vertices, chunks never mix element types
+    packed_stream faces;        // Face owner/neighbour pairs
+    packed_stream face_nodes;   // Face vertices padded to the largest face (repeating the first vertex), one stride for all chunks
+
+    compressed_connectivity(const mesh_struct& _mesh);
+
+    void compress();
+
+    // Vertices of element i written to out, returns their count
+    int element_vertices(int i, int32_t* out) const;
+    uint8_t element_type(int i) const;
+    void face_owner_neighbour(int i, uint32_t& owner, uint32_t& neighbour) const;
+    int face_vertices(int i, int32_t* out) const;      // out holds the stride (padded) values
+
+    // Whole chunk decoding for streaming kernels, out holds N_items*stride values (face vertices padded)
+    void decode_element_chunk(int c, int32_t* out) const;
+    void decode_face_chunk(int c, int32_t* out) const;
+    void decode_face_vertex_chunk(int c, int32_t* out) const;
+
+    // Rebuilds plain arrays (allocated with malloc) e.g. after the originals were freed, nullptr skips face arrays
+    void decompress(int32_t** vertices, int32_t** offsets, uint8_t** types, uint32_t** face_on,
+                    uint32_t** face_vertices = nullptr, uint32_t** face_offsets = nullptr) const;
+
+    size_t compressed_bytes() const;
+    size_t uncompressed_bytes() const;
+    void print_info() const;
+};
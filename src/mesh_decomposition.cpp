@@ -0,0 +1,353 @@
+#include "mesh_decomposition.h"
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+#include "helper_functions.h"
+
+// Header fields after magic
+enum partition_header
+{
+    h_part, h_N_parts, h_dimension, h_N_elements, h_N_owned, h_N_halo, h_N_nodes,
+    h_N_element_vertices, h_N_faces, h_N_face_vertices, h_N_neighbours, h_N_send, h_size
+};
+
+template<typename T>
+static void write_array(std::ofstream& stream, const T* data, size_t N)
+{
+    stream.write(reinterpret_cast<const char*>(data),N*sizeof(T));
+}
+
+template<typename T>
+static void read_array(std::ifstream& stream, T* data, size_t N)
+{
+    stream.read(reinterpret_cast<char*>(data),N*sizeof(T));
+}
+
+// Local index of global index in sorted (global, local) pairs
+static inline int32_t to_local(const std::vector<std::pair<int32_t,int32_t>>& map, int32_t global_idx)
+{
+    auto it = std::lower_bound(map.begin(),map.end(),std::make_pair(global_idx,INT32_MIN));
+    return (it != map.end() && it->first == global_idx) ? it->second : -1;
+}
+
+mesh_decomposer::mesh_decomposer(mesh_struct& _mesh) : mesh(_mesh){}
+
+std::string mesh_decomposer::partition_path(const std::string& base_path, int part) const
+{
+    return base_path + ".part" + std::to_string(part);
+}
+
+// Buckets elements and faces by partition, partitions are then written in parallel
+bool mesh_decomposer::write_partitions(const std::string& base_path)
+{
+    if(mesh.Element_partition_array == nullptr || mesh.Face_vertices_idx_array == nullptr)
+    {
+        error = "Decomposition needs partitioned mesh with faces";
+        return false;
+    }
+
+    const int N_parts = mesh.N_mesh_blocks;
+    const int32_t* part = mesh.Element_partition_array;
+
+    std::vector<int32_t> element_offsets(N_parts+1,0), face_offsets(N_parts+1,0);
+    for(int i = 0; i < mesh.N_elements; i++) element_offsets[part[i]+1]++;
+    for(int i = 0; i < mesh.N_faces; i++)
+    {
+        const int po = part[mesh.Face_ON_idx[2*i]], pn = part[mesh.Face_ON_idx[2*i+1]];
+        face_offsets[po+1]++;
+        if(pn != po) face_offsets[pn+1]++;
+    }
+    for(int p = 0; p < N_parts; p++)
+    {
+        element_offsets[p+1] += element_offsets[p];
+        face_offsets[p+1] += face_offsets[p];
+    }
+
+    std::vector<int32_t> elements(mesh.N_elements), faces(face_offsets[N_parts]);
+    std::vector<int32_t> element_fill(element_offsets.begin(),element_offsets.end()-1), face_fill(face_offsets.begin(),face_offsets.end()-1);
+    for(int i = 0; i < mesh.N_elements; i++) elements[element_fill[part[i]]++] = i;
+    for(int i = 0; i < mesh.N_faces; i++)
+    {
+        const int po = part[mesh.Face_ON_idx[2*i]], pn = part[mesh.Face_ON_idx[2*i+1]];
+        faces[face_fill[po]++] = i;
+        if(pn != po) faces[face_fill[pn]++] = i;
+    }
+
+    int failed_part = -1;
+
+    #pragma omp parallel for schedule(dynamic)
+    for(int p = 0; p < N_parts; p++)
+    {
+        if(!write_partition(base_path,p,&elements[element_offsets[p]],element_offsets[p+1]-element_offsets[p],
+                                        &faces[face_offsets[p]],face_offsets[p+1]-face_offsets[p]))
+        {
+            #pragma omp atomic write
+            failed_part = p;
+        }
+    }
+
+    if(failed_part >= 0)
+    {
+        error = "Cannot write " + partition_path(base_path,failed_part);
+        return false;
+    }
+
+    mesh.out() << "Written " << N_parts << " partitions to " << base_path << ".part*\n";
+    return true;
+}
+
+// Extracts local mesh of one partition, owned elements and faces are given in global order
+bool mesh_decomposer::write_partition(const std::string& base_path, int p, const int32_t* owned, int N_owned, const int32_t* faces, int N_faces) const
+{
+    const int32_t* part = mesh.Element_partition_array;
+
+    // Halo elements grouped by neighbour part, send elements grouped the same way
+    std::vector<std::pair<int32_t,int32_t>> halo, send;
+    for(int k = 0; k < N_faces; k++)
+    {
+        const int o = mesh.Face_ON_idx[2*faces[k]], n = mesh.Face_ON_idx[2*faces[k]+1];
+        if(part[o] == part[n]) continue;
+
+        const int inner = (part[o] == p) ? o : n;
+        const int outer = (part[o] == p) ? n : o;
+        halo.push_back({part[outer],outer});
+        send.push_back({part[outer],inner});
+    }
+    std::sort(halo.begin(),halo.end());
+    halo.erase(std::unique(halo.begin(),halo.end()),halo.end());
+    std::sort(send.begin(),send.end());
+    send.erase(std::unique(send.begin(),send.end()),send.end());
+
+    std::vector<int32_t> neighbour_parts;
+    for(auto const& h : halo)
+    {
+        if(neighbour_parts.empty() || neighbour_parts.back() != h.first) neighbour_parts.push_back(h.first);
+    }
+    const int N_neighbours = neighbour_parts.size();
+
+    // Local elements, owned first then halo
+    const int N_halo = halo.size();
+    const int N_elements = N_owned+N_halo;
+    std::vector<int32_t> element_global(owned,owned+N_owned);
+    for(auto const& h : halo) element_global.push_back(h.second);
+
+    std::vector<std::pair<int32_t,int32_t>> element_map(N_elements);
+    for(int i = 0; i < N_elements; i++) element_map[i] = {element_global[i],i};
+    std::sort(element_map.begin(),element_map.end());
+
+    std::vector<int32_t> halo_offsets(N_neighbours+1,0), send_offsets(N_neighbours+1,0), send_elements(send.size());
+    for(int k = 0, j = 0; k < N_halo; k++)
+    {
+        while(halo[k].first != neighbour_parts[j]) j++;
+        halo_offsets[j+1]++;
+    }
+    for(unsigned int k = 0, j = 0; k < send.size(); k++)
+    {
+        while(send[k].first != neighbour_parts[j]) j++;
+        send_offsets[j+1]++;
+        send_elements[k] = to_local(element_map,send[k].second);
+    }
+    for(int j = 0; j < N_neighbours; j++)
+    {
+        halo_offsets[j+1] += halo_offsets[j];
+        send_offsets[j+1] += send_offsets[j];
+    }
+
+    // Local nodes are the sorted global nodes of local elements
+    std::vector<int32_t> node_global;
+    for(auto const e : element_global)
+    {
+        node_global.insert(node_global.end(),&mesh.Element_vertices_idx_array[mesh.Element_vertices_idx_offsets[e]],
+                                             &mesh.Element_vertices_idx_array[mesh.Element_vertices_idx_offsets[e+1]]);
+    }
+    std::sort(node_global.begin(),node_global.end());
+    node_global.erase(std::unique(node_global.begin(),node_global.end()),node_global.end());
+    const int N_nodes = node_global.size();
+
+    auto node_local = [&node_global](int32_t g){return (int32_t)(std::lower_bound(node_global.begin(),node_global.end(),g)-node_global.begin());};
+
+    std::vector<double> node_pos(3*N_nodes);
+    for(int i = 0; i < N_nodes; i++)
+    {
+        for(int d = 0; d < 3; d++) node_pos[3*i+d] = mesh.node_pos_array[3*node_global[i]+d];
+    }
+
+    std::vector<uint8_t> types(N_elements), phys(N_elements);
+    std::vector<int32_t> vertex_offsets(N_elements+1,0), vertices;
+    for(int i = 0; i < N_elements; i++)
+    {
+        const int e = element_global[i];
+        types[i] = mesh.Element_type_array[e];
+        phys[i] = mesh.Phys_idx_array[e];
+        for(int j = mesh.Element_vertices_idx_offsets[e]; j < mesh.Element_vertices_idx_offsets[e+1]; j++)
+        {
+            vertices.push_back(node_local(mesh.Element_vertices_idx_array[j]));
+        }
+        vertex_offsets[i+1] = vertices.size();
+    }
+
+    std::vector<uint32_t> face_ON(2*N_faces), face_offsets(N_faces+1,0), face_vertices;
+    for(int k = 0; k < N_faces; k++)
+    {
+        const int f = faces[k];
+        face_ON[2*k] = to_local(element_map,mesh.Face_ON_idx[2*f]);
+        face_ON[2*k+1] = to_local(element_map,mesh.Face_ON_idx[2*f+1]);
+        for(uint32_t j = mesh.Face_vertices_idx_offsets[f]; j < mesh.Face_vertices_idx_offsets[f+1]; j++)
+        {
+            face_vertices.push_back(node_local(mesh.Face_vertices_idx_array[j]));
+        }
+        face_offsets[k+1] = face_vertices.size();
+    }
+
+    int32_t header[h_size];
+    header[h_part] = p;
+    header[h_N_parts] = mesh.N_mesh_blocks;
+    header[h_dimension] = mesh.Dimension;
+    header[h_N_elements] = N_elements;
+    header[h_N_owned] = N_owned;
+    header[h_N_halo] = N_halo;
+    header[h_N_nodes] = N_nodes;
+    header[h_N_element_vertices] = vertices.size();
+    header[h_N_faces] = N_faces;
+    header[h_N_face_vertices] = face_vertices.size();
+    header[h_N_neighbours] = N_neighbours;
+    header[h_N_send] = send_elements.size();
+
+    std::ofstream stream(partition_path(base_path,p),std::ios::binary);
+    if(!stream) return false;
+
+    write_array(stream,PARTITION_FILE_MAGIC,8);
+    write_array(stream,header,h_size);
+
+    write_array(stream,node_pos.data(),node_pos.size());
+    write_array(stream,node_global.data(),N_nodes);
+
+    write_array(stream,types.data(),N_elements);
+    write_array(stream,phys.data(),N_elements);
+    write_array(stream,vertex_offsets.data(),N_elements+1);
+    write_array(stream,vertices.data(),vertices.size());
+    write_array(stream,element_global.data(),N_elements);
+    write_array(stream,element_map.data(),N_elements);
+
+    write_array(stream,face_ON.data(),2*N_faces);
+    write_array(stream,face_offsets.data(),N_faces+1);
+    write_array(stream,face_vertices.data(),face_vertices.size());
+
+    write_array(stream,neighbour_parts.data(),N_neighbours);
+    write_array(stream,halo_offsets.data(),N_neighbours+1);
+    write_array(stream,send_offsets.data(),N_neighbours+1);
+    write_array(stream,send_elements.data(),send_elements.size());
+    return (bool)stream;
+}
+
+// Reads one partition file into an empty mesh_struct
+bool mesh_decomposer::read_partition(const std::string& base_path, int part)
+{
+    std::ifstream stream(partition_path(base_path,part),std::ios::binary);
+    if(!stream)
+    {
+        error = "Partition file " + partition_path(base_path,part) + " not found";
+        return false;
+    }
+
+    char magic[8];
+    int32_t header[h_size];
+    read_array(stream,magic,8);
+    read_array(stream,header,h_size);
+
+    if(!stream || strncmp(magic,PARTITION_FILE_MAGIC,8) != 0 || header[h_part] != part)
+    {
+        error = "File " + partition_path(base_path,part) + " is not partition " + std::to_string(part);
+        return false;
+    }
+
+    if(mesh.node_pos_array != nullptr || mesh.Element_vertices_idx_array != nullptr)
+    {
+        error = "Partition has to be read into an empty mesh";
+        return false;
+    }
+
+    mesh.Partition_idx = part;
+    mesh.N_mesh_blocks = header[h_N_parts];
+    mesh.set_dimension(header[h_dimension]);
+    mesh.N_elements = header[h_N_elements];
+    mesh.N_owned_elements = header[h_N_owned];
+    mesh.N_halo_elements = header[h_N_halo];
+    mesh.N_nodes = header[h_N_nodes];
+    mesh.N_element_vertices = header[h_N_element_vertices];
+    mesh.N_faces = header[h_N_faces];
+
+    const int N_face_vertices = header[h_N_face_vertices];
+    const int N_neighbours = header[h_N_neighbours];
+    const int N_send = header[h_N_send];
+
+    mesh.node_pos_array = (double*)malloc(3*mesh.N_nodes*sizeof(double));
+    mesh.Node_global_idx.resize(mesh.N_nodes);
+    read_array(stream,mesh.node_pos_array,3*mesh.N_nodes);
+    read_array(stream,mesh.Node_global_idx.data(),mesh.N_nodes);
+
+    mesh.Element_type_array = (uint8_t*)malloc(mesh.N_elements*sizeof(uint8_t));
+    mesh.Phys_idx_array = (uint8_t*)malloc(mesh.N_elements*sizeof(uint8_t));
+    mesh.Element_vertices_idx_offsets = (int32_t*)malloc((mesh.N_elements+1)*sizeof(int32_t));
+    mesh.Element_vertices_idx_array = (int32_t*)malloc(mesh.N_element_vertices*sizeof(int32_t));
+    mesh.Element_global_idx.resize(mesh.N_elements);
+    mesh.Element_global_to_local.resize(mesh.N_elements);
+    read_array(stream,mesh.Element_type_array,mesh.N_elements);
+    read_array(stream,mesh.Phys_idx_array,mesh.N_elements);
+    read_array(stream,mesh.Element_vertices_idx_offsets,mesh.N_elements+1);
+    read_array(stream,mesh.Element_vertices_idx_array,mesh.N_element_vertices);
+    read_array(stream,mesh.Element_global_idx.data(),mesh.N_elements);
+    read_array(stream,mesh.Element_global_to_local.data(),mesh.N_elements);
+
+    mesh.Face_ON_idx = (uint32_t*)malloc(2*mesh.N_faces*sizeof(uint32_t));
+    mesh.Face_vertices_idx_offsets = (uint32_t*)malloc((mesh.N_faces+1)*sizeof(uint32_t));
+    mesh.Face_vertices_idx_array = (uint32_t*)malloc(N_face_vertices*sizeof(uint32_t));
+    read_array(stream,mesh.Face_ON_idx,2*mesh.N_faces);
+    read_array(stream,mesh.Face_vertices_idx_offsets,mesh.N_faces+1);
+    read_array(stream,mesh.Face_vertices_idx_array,N_face_vertices);
+
+    mesh.Neighbour_parts.resize(N_neighbours);
+    mesh.Halo_offsets.resize(N_neighbours+1);
+    mesh.Send_offsets.resize(N_neighbours+1);
+    mesh.Send_elements.resize(N_send);
+    read_array(stream,mesh.Neighbour_parts.data(),N_neighbours);
+    read_array(stream,mesh.Halo_offsets.data(),N_neighbours+1);
+    read_array(stream,mesh.Send_offsets.data(),N_neighbours+1);
+    read_array(stream,mesh.Send_elements.data(),N_send);
+
+    if(!stream)
+    {
+        error = "Partition file " + partition_path(base_path,part) + " is truncated";
+        return false;
+    }
+
+    // Element counts and boundary index array
+    mesh.N_points = mesh.N_lines = mesh.N_triangles = mesh.N_quads = 0;
+    mesh.N_tetrahedra = mesh.N_prisms = mesh.N_pyramids = mesh.N_hexahedra = 0;
+    mesh.N_boundary_elements = 0;
+
+    std::vector<uint32_t> boundary;
+    for(int i = 0; i < mesh.N_elements; i++)
+    {
+        if(mesh.is_boundary_element(i)) boundary.push_back(i);
+
+        switch(mesh.Element_type_array[i])
+        {
+            case 1: mesh.N_lines++; break;
+            case 2: mesh.N_triangles++; break;
+            case 3: mesh.N_quads++; break;
+            case 4: mesh.N_tetrahedra++; break;
+            case 5: mesh.N_hexahedra++; break;
+            case 6: mesh.N_prisms++; break;
+            case 7: mesh.N_pyramids++; break;
+        }
+    }
+
+    mesh.N_boundary_elements = boundary.size();
+    mesh.Boundary_idxs_array = (uint32_t*)malloc(mesh.N_boundary_elements*sizeof(uint32_t));
+    std::copy(boundary.begin(),boundary.end(),mesh.Boundary_idxs_array);
+
+    mesh.out() << "Partition " << part << "/" << mesh.N_mesh_blocks << ":\t" << mesh.N_owned_elements << " owned, "
+              << mesh.N_halo_elements << " halo elements, " << N_neighbours << " neighbours\n";
+    return true;
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "mesh_manager.h"
+
+#define PARTITION_FILE_MAGIC "MMPART1"
+
+// Writes self contained partition files of a partitioned mesh and reads them back one at a time
+//
+// Partition file <base_path>.part<p> (binary, native endianness):
+//  header:   magic, part, N_parts, Dimension, N_elements, N_owned_elements, N_halo_elements, N_nodes,
+//            N_element_vertices, N_faces, N_face_vertices, N_neighbour_parts, N_send_elements
+//  nodes:    node_pos_array, Node_global_idx
+//  elements: Element_type_array, Phys_idx_array, Element_vertices_idx_offsets, Element_vertices_idx_array,
+//            Element_global_idx, Element_global_to_local
+//  faces:    Face_ON_idx, Face_vertices_idx_offsets, Face_vertices_idx_array
+//  halo:     Neighbour_parts, Halo_offsets, Send_offsets, Send_elements
+class mesh_decomposer
+{
+    private:
+    mesh_struct& mesh;
+
+    std::string partition_path(const std::string& base_path, int part) const;
+    bool write_partition(const std::string& base_path, int part, const int32_t* owned, int N_owned, const int32_t* faces, int N_faces) const;
+
+    public:
+    std::string error;      // Why the last write or read failed
+
+    mesh_decomposer(mesh_struct& _mesh);
+
+    bool write_partitions(const std::string& base_path);
+    bool read_partition(const std::string& base_path, int part);
+};
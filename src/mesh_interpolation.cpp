@@ -0,0 +1,332 @@
+#include "mesh_interpolation.h"
+#include <math.h>
+#include <omp.h>
+#include <algorithm>
+#include <limits>
+
+mesh_interpolator::mesh_interpolator(const mesh_struct& _source, const mesh_struct& _target) : source(_source), target(_target), source_bvh(_source){}
+
+// Containing source element, nearest element for points outside source mesh
+int mesh_interpolator::locate(const double* p) const
+{
+    const int element_idx = source_bvh.locate_point(p);
+    if(element_idx >= 0) return element_idx;
+    return source_bvh.nearest_element(p);
+}
+
+// Least squares matrix inverse of the stencil, false when the stencil does not span the space
+static bool stencil_inverse(const mesh_struct& mesh, const int element_idx, const std::vector<int32_t>& stencil, double Minv[3][3])
+{
+    const double* xc = &mesh.Element_centroids_array[3*element_idx];
+    const int dim = mesh.Dimension;
+
+    double M[3][3] = {{0,0,0},{0,0,0},{0,0,0}};
+    for(auto const n : stencil)
+    {
+        const double* xn = &mesh.Element_centroids_array[3*n];
+        for(int a = 0; a < dim; a++)
+        {
+            for(int b = 0; b < dim; b++) M[a][b] += (xn[a]-xc[a])*(xn[b]-xc[b]);
+        }
+    }
+
+    double det;
+    if(dim == 2)
+    {
+        det = M[0][0]*M[1][1]-M[0][1]*M[1][0];
+        if(fabs(det) < 1e-12*(M[0][0]*M[1][1]+1e-300)) return false;
+        Minv[0][0] = M[1][1]/det; Minv[0][1] = -M[0][1]/det;
+        Minv[1][0] = -M[1][0]/det; Minv[1][1] = M[0][0]/det;
+        return true;
+    }
+
+    det = M[0][0]*(M[1][1]*M[2][2]-M[1][2]*M[2][1])-M[0][1]*(M[1][0]*M[2][2]-M[1][2]*M[2][0])+M[0][2]*(M[1][0]*M[2][1]-M[1][1]*M[2][0]);
+    if(fabs(det) < 1e-12*(M[0][0]*M[1][1]*M[2][2]+1e-300)) return false;
+    for(int a = 0; a < 3; a++)
+    {
+        for(int b = 0; b < 3; b++)
+        {
+            const int a1 = (b+1)%3, a2 = (b+2)%3, b1 = (a+1)%3, b2 = (a+2)%3;
+            Minv[a][b] = (M[a1][b1]*M[a2][b2]-M[a1][b2]*M[a2][b1])/det;
+        }
+    }
+    return true;
+}
+
+// Weights of phi(p) = phi_c + g.(p-x_c), g is the least squares gradient from face neighbours, exact for linear fields
+void mesh_interpolator::linear_weights(const int element_idx, const double* p, std::vector<int32_t>& cols, std::vector<double>& weights) const
+{
+    const double* xc = &source.Element_centroids_array[3*element_idx];
+    const int dim = source.Dimension;
+
+    cols.assign(1,element_idx);
+    weights.assign(1,1.0);
+
+    std::vector<int32_t> stencil(source_adjncy.begin()+source_xadj[element_idx],source_adjncy.begin()+source_xadj[element_idx+1]);
+
+    // Corner elements, extend stencil by second layer of neighbours
+    double Minv[3][3] = {{0,0,0},{0,0,0},{0,0,0}};
+    if(!stencil_inverse(source,element_idx,stencil,Minv))
+    {
+        const int N_first = stencil.size();
+        for(int k = 0; k < N_first; k++)
+        {
+            for(int j = source_xadj[stencil[k]]; j < source_xadj[stencil[k]+1]; j++)
+            {
+                const int n = source_adjncy[j];
+                if(n != element_idx && std::find(stencil.begin(),stencil.end(),n) == stencil.end()) stencil.push_back(n);
+            }
+        }
+
+        // Still degenerate, keep element value
+        if(!stencil_inverse(source,element_idx,stencil,Minv)) return;
+    }
+
+    double r[3] = {0,0,0};
+    for(int a = 0; a < dim; a++)
+    {
+        for(int b = 0; b < dim; b++) r[a] += Minv[a][b]*(p[b]-xc[b]);
+    }
+
+    for(auto const n : stencil)
+    {
+        const double* xn = &source.Element_centroids_array[3*n];
+        double w = 0;
+        for(int a = 0; a < dim; a++) w += r[a]*(xn[a]-xc[a]);
+
+        cols.push_back(n);
+        weights.push_back(w);
+        weights[0] -= w;
+    }
+}
+
+// Sub element sample points with their volumes (same decomposition as compute_volumes)
+void mesh_interpolator::element_samples(const int element_idx, std::vector<double>& points, std::vector<double>& volumes) const
+{
+    const double* X = target.node_pos_array;
+    const int32_t* v = &target.Element_vertices_idx_array[target.Element_vertices_idx_offsets[element_idx]];
+    const int n = target.Element_vertices_idx_offsets[element_idx+1]-target.Element_vertices_idx_offsets[element_idx];
+
+    points.clear();
+    volumes.clear();
+
+    double c[3] = {0,0,0};
+    for(int j = 0; j < n; j++)
+    {
+        for(int d = 0; d < 3; d++) c[d] += X[3*v[j]+d];
+    }
+    for(int d = 0; d < 3; d++) c[d] /= n;
+
+    if(target.Dimension == 2)
+    {
+        for(int j = 0; j < n; j++)
+        {
+            const double* a = &X[3*v[j]];
+            const double* b = &X[3*v[(j+1)%n]];
+
+            volumes.push_back(fabs(0.5*((a[0]-c[0])*(b[1]-c[1])-(a[1]-c[1])*(b[0]-c[0]))));
+            for(int d = 0; d < 3; d++) points.push_back((a[d]+b[d]+c[d])/3);
+        }
+        return;
+    }
+
+    for(auto const& face : element_type_to_faces.at(target.Element_type_array[element_idx]))
+    {
+        const int nf = face.size();
+        double fc[3] = {0,0,0};
+        for(int j = 0; j < nf; j++)
+        {
+            for(int d = 0; d < 3; d++) fc[d] += X[3*v[face[j]]+d];
+        }
+        for(int d = 0; d < 3; d++) fc[d] /= nf;
+
+        for(int j = 0; j < nf; j++)
+        {
+            const double* a = &X[3*v[face[j]]];
+            const double* b = &X[3*v[face[(j+1)%nf]]];
+
+            const double u[3] = {a[0]-fc[0],a[1]-fc[1],a[2]-fc[2]};
+            const double w[3] = {b[0]-fc[0],b[1]-fc[1],b[2]-fc[2]};
+            const double S[3] = {u[1]*w[2]-u[2]*w[1],u[2]*w[0]-u[0]*w[2],u[0]*w[1]-u[1]*w[0]};
+
+            volumes.push_back(fabs(S[0]*(fc[0]-c[0])+S[1]*(fc[1]-c[1])+S[2]*(fc[2]-c[2]))/6);
+            for(int d = 0; d < 3; d++) points.push_back((a[d]+b[d]+c[d]+fc[d])/4);
+        }
+    }
+}
+
+// Builds the transfer operator, rows are assembled per thread then concatenated
+bool mesh_interpolator::build(interpolation_method _method)
+{
+    method = _method;
+
+    if(source.Element_centroids_array == nullptr || target.Element_centroids_array == nullptr || source.Face_ON_idx == nullptr)
+    {
+        target.out() << "Interpolation needs faces and element centroids on both meshes\n";
+        return false;
+    }
+
+    if(method == interpolation_method::conservative && (source.V_array == nullptr || target.V_array == nullptr))
+    {
+        target.out() << "Conservative interpolation needs volumes on both meshes\n";
+        return false;
+    }
+
+    if(!source_bvh.build()) return false;
+
+    // Source face neighbours without ghosts
+    source_xadj.assign(source.N_elements+1,0);
+    for(int i = 0; i < source.N_faces; i++)
+    {
+        const int o = source.Face_ON_idx[2*i], n = source.Face_ON_idx[2*i+1];
+        if(source.is_boundary_element(n)) continue;
+        source_xadj[o+1]++;
+        source_xadj[n+1]++;
+    }
+    for(int i = 0; i < source.N_elements; i++) source_xadj[i+1] += source_xadj[i];
+
+    source_adjncy.resize(source_xadj[source.N_elements]);
+    std::vector<int32_t> fill(source_xadj.begin(),source_xadj.end()-1);
+    for(int i = 0; i < source.N_faces; i++)
+    {
+        const int o = source.Face_ON_idx[2*i], n = source.Face_ON_idx[2*i+1];
+        if(source.is_boundary_element(n)) continue;
+        source_adjncy[fill[o]++] = n;
+        source_adjncy[fill[n]++] = o;
+    }
+
+    const int N_rows = target.N_elements;
+    std::vector<int32_t> row_length(N_rows+1,0);
+    std::vector<std::vector<int32_t>> thread_cols;
+    std::vector<std::vector<double>> thread_weights;
+    int N_out = 0;
+
+    #pragma omp parallel reduction(+:N_out)
+    {
+        std::vector<int32_t> cols, local_cols;
+        std::vector<double> weights, local_weights, points, volumes;
+
+        // Static schedule, each thread owns one contiguous row range
+        #pragma omp single
+        {
+            thread_cols.resize(omp_get_num_threads());
+            thread_weights.resize(omp_get_num_threads());
+        }
+
+        #pragma omp for schedule(static)
+        for(int i = 0; i < N_rows; i++)
+        {
+            if(target.is_boundary_element(i)) continue;
+
+            cols.clear();
+            weights.clear();
+
+            if(method == interpolation_method::linear)
+            {
+                const double* p = &target.Element_centroids_array[3*i];
+                int element_idx = source_bvh.locate_point(p);
+                if(element_idx < 0){element_idx = source_bvh.nearest_element(p); N_out++;}
+
+                linear_weights(element_idx,p,cols,weights);
+            }
+            else
+            {
+                element_samples(i,points,volumes);
+
+                double V = 0;
+                for(unsigned int k = 0; k < volumes.size(); k++)
+                {
+                    const int element_idx = locate(&points[3*k]);
+                    auto it = std::find(cols.begin(),cols.end(),element_idx);
+                    if(it == cols.end()){cols.push_back(element_idx); weights.push_back(volumes[k]);}
+                    else weights[it-cols.begin()] += volumes[k];
+                    V += volumes[k];
+                }
+                for(auto& w : weights) w /= V;
+            }
+
+            row_length[i+1] = cols.size();
+            local_cols.insert(local_cols.end(),cols.begin(),cols.end());
+            local_weights.insert(local_weights.end(),weights.begin(),weights.end());
+        }
+
+        thread_cols[omp_get_thread_num()] = std::move(local_cols);
+        thread_weights[omp_get_thread_num()] = std::move(local_weights);
+    }
+    N_outside = N_out;
+
+    for(int i = 0; i < N_rows; i++) row_length[i+1] += row_length[i];
+    Row_offsets = std::move(row_length);
+
+    Col_idx.clear();
+    Weights.clear();
+    Col_idx.reserve(Row_offsets[N_rows]);
+    Weights.reserve(Row_offsets[N_rows]);
+    for(unsigned int t = 0; t < thread_cols.size(); t++)
+    {
+        Col_idx.insert(Col_idx.end(),thread_cols[t].begin(),thread_cols[t].end());
+        Weights.insert(Weights.end(),thread_weights[t].begin(),thread_weights[t].end());
+    }
+
+    target.out() << "Interpolation operator:\t" << Row_offsets[N_rows] << " weights, " << N_outside << " points outside source\n";
+    return true;
+}
+
+void mesh_interpolator::apply(const double* source_field, double* target_field, const int N_components) const
+{
+    const int N_rows = Row_offsets.size()-1;
+
+    #pragma omp parallel for schedule(static)
+    for(int i = 0; i < N_rows; i++)
+    {
+        if(Row_offsets[i] == Row_offsets[i+1]) continue;
+
+        for(int c = 0; c < N_components; c++)
+        {
+            double value = 0;
+            for(int j = Row_offsets[i]; j < Row_offsets[i+1]; j++)
+            {
+                value += Weights[j]*source_field[N_components*Col_idx[j]+c];
+            }
+            target_field[N_components*i+c] = value;
+        }
+    }
+
+    if(method != interpolation_method::conservative) return;
+
+    // Global integral correction of every component: one signed fields (densities, turbulence quantities) are rescaled
+    // so they keep their sign, fields changing sign or with zero target integral get a volume weighted constant shift
+    for(int c = 0; c < N_components; c++)
+    {
+        double I_source = 0, I_target = 0, V_target = 0;
+        double low = std::numeric_limits<double>::max(), high = std::numeric_limits<double>::lowest();
+
+        #pragma omp parallel for schedule(static) reduction(+:I_source)
+        for(int i = 0; i < source.N_elements; i++)
+        {
+            I_source += source.V_array[i]*source_field[N_components*i+c];
+        }
+
+        #pragma omp parallel for schedule(static) reduction(+:I_target,V_target) reduction(min:low) reduction(max:high)
+        for(int i = 0; i < N_rows; i++)
+        {
+            if(Row_offsets[i] == Row_offsets[i+1]) continue;
+            const double value = target_field[N_components*i+c];
+            I_target += target.V_array[i]*value;
+            V_target += target.V_array[i];
+            low = std::min(low,value);
+            high = std::max(high,value);
+        }
+
+        const bool rescale = (low >= 0 || high <= 0) && I_target != 0 && I_source/I_target >= 0;
+        const double scale = rescale ? I_source/I_target : 1;
+        const double shift = (!rescale && V_target != 0) ? (I_source-I_target)/V_target : 0;
+
+        #pragma omp parallel for schedule(static)
+        for(int i = 0; i < N_rows; i++)
+        {
+            if(Row_offsets[i] == Row_offsets[i+1]) continue;
+            target_field[N_components*i+c] = scale*target_field[N_components*i+c]+shift;
+        }
+    }
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+
+#include "mesh_manager.h"
+#include "mesh_bvh.h"
+
+// Interpolation type of the transfer operator
+enum class interpolation_method
+{
+    linear,         // Least squares linear fit from the containing source element and its face neighbours
+    conservative    // Volume weighted average over sub element samples of each target element, then the field integral over
+                    // the mesh is restored exactly (one signed fields are rescaled, others shifted by a constant)
+                    // Only globally conservative, the correction depends on the field so apply() is not linear
+};
+
+// Transfers element data from source to target mesh through a precomputed sparse operator
+class mesh_interpolator
+{
+    private:
+    const mesh_struct& source;
+    const mesh_struct& target;
+    mesh_bvh source_bvh;
+    interpolation_method method;
+
+    std::vector<int32_t> source_xadj, source_adjncy;   // Source element -> face neighbours (no ghosts)
+
+    int locate(const double* p) const;
+    void linear_weights(const int element_idx, const double* p, std::vector<int32_t>& cols, std::vector<double>& weights) const;
+    void element_samples(const int element_idx, std::vector<double>& points, std::vector<double>& volumes) const;
+
+    public:
+    // Operator rows are target elements (empty for ghosts), columns source elements
+    std::vector<int32_t> Row_offsets;
+    std::vector<int32_t> Col_idx;
+    std::vector<double> Weights;
+
+    int N_outside = 0;      // Target points outside source mesh, mapped to the nearest source element
+
+    mesh_interpolator(const mesh_struct& _source, const mesh_struct& _target);
+
+    // False if inputs are missing (conservative also needs volumes of both meshes), messages go to the target mesh log
+    bool build(interpolation_method _method = interpolation_method::linear);
+
+    // Fields are element arrays with N_components interleaved values per element
+    void apply(const double* source_field, double* target_field, const int N_components = 1) const;
+};
@@ -0,0 +1,187 @@
+#include "mesh_lsq_gradient.h"
+#include <cstdlib>
+#include <algorithm>
+#include <math.h>
+
+mesh_lsq_gradient::mesh_lsq_gradient(const mesh_struct& _mesh) : mesh(_mesh)
+{
+    Coef_x = Coef_y = Coef_z = nullptr;
+    Minv_xx = Minv_xy = Minv_xz = Minv_yy = Minv_yz = Minv_zz = nullptr;
+    Face_owner_x = Face_owner_y = Face_owner_z = nullptr;
+    Face_neighbour_x = Face_neighbour_y = Face_neighbour_z = nullptr;
+}
+
+mesh_lsq_gradient::~mesh_lsq_gradient()
+{
+    free_data();
+}
+
+// Zeroed array aligned to LSQ_ALIGNMENT, size rounded up to the alignment
+double* mesh_lsq_gradient::allocate(size_t N)
+{
+    const size_t bytes = ((N*sizeof(double)+LSQ_ALIGNMENT-1)/LSQ_ALIGNMENT)*LSQ_ALIGNMENT;
+    double* p = (double*)aligned_alloc(LSQ_ALIGNMENT,std::max<size_t>(bytes,LSQ_ALIGNMENT));
+    std::fill(p,p+bytes/sizeof(double),0.0);
+    return p;
+}
+
+void mesh_lsq_gradient::free_data()
+{
+    for(double* p : {Coef_x,Coef_y,Coef_z,Minv_xx,Minv_xy,Minv_xz,Minv_yy,Minv_yz,Minv_zz,
+                     Face_owner_x,Face_owner_y,Face_owner_z,Face_neighbour_x,Face_neighbour_y,Face_neighbour_z})
+    {
+        free(p);
+    }
+    Coef_x = Coef_y = Coef_z = nullptr;
+    Minv_xx = Minv_xy = Minv_xz = Minv_yy = Minv_yz = Minv_zz = nullptr;
+    Face_owner_x = Face_owner_y = Face_owner_z = nullptr;
+    Face_neighbour_x = Face_neighbour_y = Face_neighbour_z = nullptr;
+}
+
+// Builds stencils from faces, then matrices and coefficients element by element in parallel
+bool mesh_lsq_gradient::build()
+{
+    if(mesh.Face_ON_idx == nullptr || mesh.Element_centroids_array == nullptr)
+    {
+        mesh.out() << "LSQ gradients need faces and element centroids\n";
+        return false;
+    }
+
+    free_data();
+
+    const int N_elements = mesh.N_elements;
+    const int N_faces = mesh.N_faces;
+    const double* xc = mesh.Element_centroids_array;
+
+    // Element -> (neighbour, face) stencil, ghosts have none
+    Stencil_offsets.assign(N_elements+1,0);
+    for(int i = 0; i < N_faces; i++)
+    {
+        const int o = mesh.Face_ON_idx[2*i], n = mesh.Face_ON_idx[2*i+1];
+        Stencil_offsets[o+1]++;
+        if(!mesh.is_boundary_element(n)) Stencil_offsets[n+1]++;
+    }
+    for(int i = 0; i < N_elements; i++) Stencil_offsets[i+1] += Stencil_offsets[i];
+    N_stencil = Stencil_offsets[N_elements];
+
+    Stencil_idx.resize(N_stencil);
+    std::vector<int32_t> stencil_face(N_stencil);
+    std::vector<int32_t> fill(Stencil_offsets.begin(),Stencil_offsets.end()-1);
+    for(int i = 0; i < N_faces; i++)
+    {
+        const int o = mesh.Face_ON_idx[2*i], n = mesh.Face_ON_idx[2*i+1];
+        stencil_face[fill[o]] = i;
+        Stencil_idx[fill[o]++] = n;
+        if(mesh.is_boundary_element(n)) continue;
+        stencil_face[fill[n]] = i;
+        Stencil_idx[fill[n]++] = o;
+    }
+
+    Coef_x = allocate(N_stencil); Coef_y = allocate(N_stencil); Coef_z = allocate(N_stencil);
+    Minv_xx = allocate(N_elements); Minv_xy = allocate(N_elements); Minv_xz = allocate(N_elements);
+    Minv_yy = allocate(N_elements); Minv_yz = allocate(N_elements); Minv_zz = allocate(N_elements);
+    Face_owner_x = allocate(N_faces); Face_owner_y = allocate(N_faces); Face_owner_z = allocate(N_faces);
+    Face_neighbour_x = allocate(N_faces); Face_neighbour_y = allocate(N_faces); Face_neighbour_z = allocate(N_faces);
+
+    const bool is_2D = mesh.Dimension == 2;
+    int N_singular = 0;
+
+    #pragma omp parallel for schedule(static) reduction(+:N_singular)
+    for(int i = 0; i < N_elements; i++)
+    {
+        if(Stencil_offsets[i] == Stencil_offsets[i+1]) continue;
+
+        // M = sum w d d^T, w = 1/|d|^2
+        double M[6] = {0,0,0,0,0,0};
+        for(int j = Stencil_offsets[i]; j < Stencil_offsets[i+1]; j++)
+        {
+            const int nb = Stencil_idx[j];
+            const double d[3] = {xc[3*nb]-xc[3*i],xc[3*nb+1]-xc[3*i+1],is_2D ? 0 : xc[3*nb+2]-xc[3*i+2]};
+            const double w = 1/(d[0]*d[0]+d[1]*d[1]+d[2]*d[2]);
+
+            M[0] += w*d[0]*d[0]; M[1] += w*d[0]*d[1]; M[2] += w*d[0]*d[2];
+            M[3] += w*d[1]*d[1]; M[4] += w*d[1]*d[2]; M[5] += w*d[2]*d[2];
+        }
+
+        double I[6] = {0,0,0,0,0,0};
+        if(is_2D)
+        {
+            const double det = M[0]*M[3]-M[1]*M[1];
+            if(fabs(det) < 1e-12*M[0]*M[3]){N_singular++; continue;}
+            I[0] = M[3]/det; I[1] = -M[1]/det; I[3] = M[0]/det;
+        }
+        else
+        {
+            const double c0 = M[3]*M[5]-M[4]*M[4];
+            const double c1 = M[2]*M[4]-M[1]*M[5];
+            const double c2 = M[1]*M[4]-M[2]*M[3];
+            const double det = M[0]*c0+M[1]*c1+M[2]*c2;
+            if(fabs(det) < 1e-12*M[0]*M[3]*M[5]){N_singular++; continue;}
+
+            I[0] = c0/det; I[1] = c1/det; I[2] = c2/det;
+            I[3] = (M[0]*M[5]-M[2]*M[2])/det;
+            I[4] = (M[1]*M[2]-M[0]*M[4])/det;
+            I[5] = (M[0]*M[3]-M[1]*M[1])/det;
+        }
+
+        Minv_xx[i] = I[0]; Minv_xy[i] = I[1]; Minv_xz[i] = I[2];
+        Minv_yy[i] = I[3]; Minv_yz[i] = I[4]; Minv_zz[i] = I[5];
+
+        // Coefficient of each stencil member, c = w Minv d
+        for(int j = Stencil_offsets[i]; j < Stencil_offsets[i+1]; j++)
+        {
+            const int nb = Stencil_idx[j];
+            const double d[3] = {xc[3*nb]-xc[3*i],xc[3*nb+1]-xc[3*i+1],is_2D ? 0 : xc[3*nb+2]-xc[3*i+2]};
+            const double w = 1/(d[0]*d[0]+d[1]*d[1]+d[2]*d[2]);
+
+            Coef_x[j] = w*(I[0]*d[0]+I[1]*d[1]+I[2]*d[2]);
+            Coef_y[j] = w*(I[1]*d[0]+I[3]*d[1]+I[4]*d[2]);
+            Coef_z[j] = w*(I[2]*d[0]+I[4]*d[1]+I[5]*d[2]);
+
+            // Every stencil entry belongs to exactly one face side
+            const int f = stencil_face[j];
+            if(mesh.Face_ON_idx[2*f] == (uint32_t)i)
+            {
+                Face_owner_x[f] = Coef_x[j]; Face_owner_y[f] = Coef_y[j]; Face_owner_z[f] = Coef_z[j];
+            }
+            else
+            {
+                Face_neighbour_x[f] = Coef_x[j]; Face_neighbour_y[f] = Coef_y[j]; Face_neighbour_z[f] = Coef_z[j];
+            }
+        }
+    }
+
+    if(N_singular > 0) mesh.out() << "LSQ gradient:\t" << N_singular << " elements with degenerate stencil (zero gradient)\n";
+    return true;
+}
+
+// Gather form, one pass over the stencil arrays
+void mesh_lsq_gradient::compute_gradient(const double* phi, double* grad_x, double* grad_y, double* grad_z) const
+{
+    const int N_elements = mesh.N_elements;
+    const int32_t* offsets = Stencil_offsets.data();
+    const int32_t* idx = Stencil_idx.data();
+    const double* cx = (const double*)__builtin_assume_aligned(Coef_x,LSQ_ALIGNMENT);
+    const double* cy = (const double*)__builtin_assume_aligned(Coef_y,LSQ_ALIGNMENT);
+    const double* cz = (const double*)__builtin_assume_aligned(Coef_z,LSQ_ALIGNMENT);
+
+    #pragma omp parallel for schedule(static)
+    for(int i = 0; i < N_elements; i++)
+    {
+        const double phi_i = phi[i];
+        double gx = 0, gy = 0, gz = 0;
+
+        #pragma omp simd reduction(+:gx,gy,gz)
+        for(int j = offsets[i]; j < offsets[i+1]; j++)
+        {
+            const double dphi = phi[idx[j]]-phi_i;
+            gx += cx[j]*dphi;
+            gy += cy[j]*dphi;
+            gz += cz[j]*dphi;
+        }
+
+        grad_x[i] = gx;
+        grad_y[i] = gy;
+        grad_z[i] = gz;
+    }
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+
+#include "mesh_manager.h"
+
+#define LSQ_ALIGNMENT 64    // Byte alignment of coefficient arrays
+
+// Precomputed inverse distance weighted least squares gradient operators
+// Stencil of an element are its face neighbours, boundary faces use the ghost node as neighbour
+//
+// grad(phi)_i = sum_j Coef_j (phi_nb(j) - phi_i),   j in [Stencil_offsets[i], Stencil_offsets[i+1])
+class mesh_lsq_gradient
+{
+    private:
+    const mesh_struct& mesh;
+
+    double* allocate(size_t N);
+    void free_data();
+
+    public:
+    int N_stencil = 0;
+
+    // Element stencils (empty for ghosts)
+    std::vector<int32_t> Stencil_offsets;
+    std::vector<int32_t> Stencil_idx;
+    double *Coef_x, *Coef_y, *Coef_z;                   // Aligned SoA stencil coefficients
+
+    // Inverse LSQ matrix per element, symmetric (xx,xy,xz,yy,yz,zz)
+    double *Minv_xx, *Minv_xy, *Minv_xz, *Minv_yy, *Minv_yz, *Minv_zz;
+
+    // Per face weight vectors, owner side (w Minv_o d) and neighbour side (-w Minv_n d), zero on ghost side
+    double *Face_owner_x, *Face_owner_y, *Face_owner_z;
+    double *Face_neighbour_x, *Face_neighbour_y, *Face_neighbour_z;
+
+    mesh_lsq_gradient(const mesh_struct& _mesh);
+    ~mesh_lsq_gradient();
+    mesh_lsq_gradient(const mesh_lsq_gradient&) = delete;
+    mesh_lsq_gradient& operator=(const mesh_lsq_gradient&) = delete;
+
+    bool build();     // False without faces and element centroids
+    void compute_gradient(const double* phi, double* grad_x, double* grad_y, double* grad_z) const;
+};
@@ -8,10 +8,13 @@
 #include <iterator>
 #include <metis.h>
 #include <set>
+#include <chrono>
+#include <limits>
 #include "helper_functions.h"
+#include "mesh_decomposition.h"
 
 // Maps element type to {N_vertices,N_faces}
-std::map<int, std::vector<int>> element_type_to_props  = 
+const std::map<int, std::vector<int>> element_type_to_props  = 
                                    {{1,std::vector<int>{2,1}},      // Line
                                     {2,std::vector<int>{3,3}},      // Triangle
                                     {3,std::vector<int>{4,4}},      // Quadrangle
@@ -20,11 +23,30 @@ std::map<int, std::vector<int>> element_type_to_props  =
                                     {6,std::vector<int>{6,5}},      // Prism
                                     {7,std::vector<int>{5,5}}};     // Pyramid
 
-mesh_struct::mesh_struct()
+// Maps element type to its faces (gmsh node ordering), faces are oriented outwards
+const std::map<int, std::vector<std::vector<int>>> element_type_to_faces =
+                                   {{1,{{0,1}}},                                                            // Line
+                                    {2,{{0,1},{1,2},{2,0}}},                                                // Triangle
+                                    {3,{{0,1},{1,2},{2,3},{3,0}}},                                          // Quadrangle
+                                    {4,{{0,2,1},{0,1,3},{0,3,2},{1,2,3}}},                                  // Tetrahedron
+                                    {5,{{0,3,2,1},{4,5,6,7},{0,1,5,4},{1,2,6,5},{2,3,7,6},{0,4,7,3}}},      // Hexahedron
+                                    {6,{{0,2,1},{3,4,5},{0,1,4,3},{1,2,5,4},{0,3,5,2}}},                    // Prism
+                                    {7,{{0,3,2,1},{0,1,4},{1,2,4},{2,3,4},{3,0,4}}}};                       // Pyramid
+
+// Direct inputs of each derived quantity
+static const std::map<uint32_t, uint32_t> quantity_dependencies =
+                                   {{quantity_faces,quantity_connectivity},
+                                    {quantity_volumes,quantity_nodes | quantity_connectivity},
+                                    {quantity_face_geometry,quantity_nodes | quantity_faces},
+                                    {quantity_node_elements,quantity_nodes | quantity_connectivity},
+                                    {quantity_partition,quantity_faces}};
+
+mesh_struct::mesh_struct(std::ostream* _log) : log(_log)
 {
-    std::cout << "Mesh struct constructor\n";
+    out() << "Mesh struct constructor\n";
     node_pos_array = nullptr;
     V_array = nullptr;
+    Element_centroids_array = nullptr;
     Element_type_array = nullptr;
     Phys_idx_array = nullptr;
     Boundary_idxs_array = nullptr;
@@ -34,32 +56,141 @@ mesh_struct::mesh_struct()
     Face_vertices_idx_array = nullptr;
     Face_vertices_idx_offsets = nullptr;
     Face_ON_idx = nullptr;    
+
+    Face_normal_array = nullptr;
+    Face_area_array = nullptr;
+    Face_centroids_array = nullptr;
+
+    Node_elements_idx = nullptr;
+    Node_elements_offsets = nullptr;
+
+    Element_partition_array = nullptr;
+}
+
+void mesh_struct::set_dimension(int dimension)
+{
+    Dimension = dimension;
+    if(Dimension == 2)
+    {
+        Face_element_types = std::vector<uint8_t>{1};
+        Element_types = std::vector<uint8_t>{2,3};
+    }
+    else
+    {
+        Face_element_types = std::vector<uint8_t>{2,3};
+        Element_types = std::vector<uint8_t>{4,5,6,7};
+    }
+
+    std::fill(std::begin(Face_type),std::end(Face_type),false);
+    for(auto const type : Face_element_types) Face_type[type] = true;
 }
 
 void mesh_struct::free_data()
 {
-    free(node_pos_array);
-    free(V_array);
-    free(Element_type_array);
-    free(Phys_idx_array);
-    free(Boundary_idxs_array);
-    free(Element_vertices_idx_array);
-    free(Element_vertices_idx_offsets);
+    auto release = [](auto*& p){mesh_free(p); p = nullptr;};
+
+    release(node_pos_array);
+    release(V_array);
+    release(Element_centroids_array);
+    release(Element_type_array);
+    release(Phys_idx_array);
+    release(Boundary_idxs_array);
+    release(Element_vertices_idx_array);
+    release(Element_vertices_idx_offsets);
+
+    release(Face_vertices_idx_array);
+    release(Face_vertices_idx_offsets);
+    release(Face_ON_idx);
 
-    free(Face_vertices_idx_array);
-    free(Face_vertices_idx_offsets);
-    free(Face_ON_idx);
+    release(Face_normal_array);
+    release(Face_area_array);
+    release(Face_centroids_array);
+
+    release(Node_elements_idx);
+    release(Node_elements_offsets);
+
+    release(Element_partition_array);
+}
+
+// Messages go to log, a per thread sink discards them when log is nullptr
+std::ostream& mesh_struct::out() const
+{
+    static thread_local std::ostream null_stream(nullptr);
+    return log ? *log : null_stream;
 }
 
 mesh_struct::~mesh_struct()
 {
-    std::cout << "Freeing mesh struct\n";
+    out() << "Freeing mesh struct\n";
     free_data();
 }
 
-mesh_manager::mesh_manager(){}
+mesh_manager::mesh_manager(std::ostream* log) : mesh(log){}
 
-mesh_manager::~mesh_manager(){}
+// A running load still uses the mesh, it is stopped first
+mesh_manager::~mesh_manager()
+{
+    if(active_load)
+    {
+        active_load->cancel();
+        active_load->wait();
+    }
+}
+
+void mesh_load_handle::set_ready(uint32_t quantities)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    ready |= quantities;
+    changed.notify_all();
+}
+
+void mesh_load_handle::finish(bool ok)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    finished = true;
+    completed = ok;
+    changed.notify_all();
+}
+
+void mesh_load_handle::cancel()
+{
+    cancel_flag = true;
+}
+
+bool mesh_load_handle::wait()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock,[this]{return finished;});
+    return completed;
+}
+
+bool mesh_load_handle::wait_for(uint32_t quantities)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock,[&]{return finished || (ready & quantities) == quantities;});
+    return (ready & quantities) == quantities;
+}
+
+bool mesh_load_handle::is_ready(uint32_t quantities) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return (ready & quantities) == quantities;
+}
+
+// Records the error of a failed operation, always false
+bool mesh_manager::fail(const std::string& message)
+{
+    error = message;
+    mesh.out() << message << "\n";
+    return false;
+}
+
+// Passes progress to the load callback, false if the load was cancelled
+bool mesh_manager::report(load_phase phase, size_t done, size_t total)
+{
+    if(load_progress) load_progress(phase,done,total);
+    return !(load_cancel && *load_cancel);
+}
 
 // Prints some info to terminal
 void mesh_manager::print_info()
@@ -71,26 +202,26 @@ void mesh_manager::print_info()
     // std::cout << "Surface entities:\t" << data.msh_entities.dim_counts[2] << "\n";
     // std::cout << "Volume entities:\t" << data.msh_entities.dim_counts[3] << "\n";
 
-    std::cout << "Elements: " << mesh.N_elements << "\n";
-    std::cout << "Vertices: " << mesh.N_element_vertices << "\n";
-
-    std::cout << "Faces:\t" << mesh.N_boundary_elements << "\n";
-    std::cout << "Nodes:\t" << mesh.N_nodes << "\n";
-
-    std::cout << "1D element counts\n";
-    std::cout << "Lines: \t\t" << mesh.N_lines << "\n";
-    std::cout << "2D element counts\n";
-    std::cout << "Trigs:\t\t" << mesh.N_triangles << "\n";
-    std::cout << "Quads:\t\t" << mesh.N_quads << "\n";
-    std::cout << "3D element counts\n";
-    std::cout << "Tetrahedra:\t" << mesh.N_tetrahedra << "\n";
-    std::cout << "Prisms:\t\t" << mesh.N_prisms << "\n";
-    std::cout << "Pyramids:\t" << mesh.N_pyramids << "\n";
-    std::cout << "Hexahedra:\t" << mesh.N_hexahedra << "\n";
+    mesh.out() << "Elements: " << mesh.N_elements << "\n";
+    mesh.out() << "Vertices: " << mesh.N_element_vertices << "\n";
+
+    mesh.out() << "Faces:\t" << mesh.N_boundary_elements << "\n";
+    mesh.out() << "Nodes:\t" << mesh.N_nodes << "\n";
+
+    mesh.out() << "1D element counts\n";
+    mesh.out() << "Lines: \t\t" << mesh.N_lines << "\n";
+    mesh.out() << "2D element counts\n";
+    mesh.out() << "Trigs:\t\t" << mesh.N_triangles << "\n";
+    mesh.out() << "Quads:\t\t" << mesh.N_quads << "\n";
+    mesh.out() << "3D element counts\n";
+    mesh.out() << "Tetrahedra:\t" << mesh.N_tetrahedra << "\n";
+    mesh.out() << "Prisms:\t\t" << mesh.N_prisms << "\n";
+    mesh.out() << "Pyramids:\t" << mesh.N_pyramids << "\n";
+    mesh.out() << "Hexahedra:\t" << mesh.N_hexahedra << "\n";
 }
 
 // Computes mesh dimension, element counts, face element types, volume element types and boundary size
-void mesh_manager::mesh_dimension(const msh_data& data)
+bool mesh_manager::mesh_dimension(const msh_data& data)
 {
    
     mesh.N_lines = data.N_lines;
@@ -108,9 +239,7 @@ void mesh_manager::mesh_dimension(const msh_data& data)
 
     if (N_2D > 0 && N_3D == 0)
     {
-        mesh.Dimension = 2;
-        mesh.Face_element_types = std::vector<uint8_t>{1};
-        mesh.Element_types = std::vector<uint8_t>{2,3};
+        mesh.set_dimension(2);
 
         mesh.N_elements = N_2D+N_1D;
         mesh.N_boundary_elements = N_1D;
@@ -119,79 +248,529 @@ void mesh_manager::mesh_dimension(const msh_data& data)
     }
     else if(N_3D > 0 && N_2D > 0)
     {
-        mesh.Dimension = 3;
-        mesh.Face_element_types = std::vector<uint8_t>{2,3};
-        mesh.Element_types = std::vector<uint8_t>{4,5,6,7};
+        mesh.set_dimension(3);
 
-        mesh.N_elements = N_3D;// add boundary elements
+        mesh.N_elements = N_3D+N_2D;
         mesh.N_boundary_elements = N_2D;
 
-        mesh.N_element_vertices = mesh.N_tetrahedra*4+mesh.N_prisms*6+mesh.N_pyramids*5+mesh.N_hexahedra*8; // add boundary elements
-    }
-    else
-    {
-        std::cout << "Mesh dimension could not be set, exiting...\n";
-        exit(1);
+        mesh.N_element_vertices = mesh.N_tetrahedra*4+mesh.N_prisms*6+mesh.N_pyramids*5+mesh.N_hexahedra*8
+                                 +mesh.N_triangles*4+mesh.N_quads*5;
     }
+    else return fail("Mesh dimension could not be set");
 
     mesh.N_nodes = data.N_nodes+mesh.N_boundary_elements;
-    std::cout << "Mesh dimension is:\t" << mesh.Dimension << "\n";
+    mesh.out() << "Mesh dimension is:\t" << mesh.Dimension << "\n";
+    return true;
 }
 
 // Read and parse mesh
-void mesh_manager::read_mesh(std::string file_path)
+bool mesh_manager::read_mesh(std::string file_path)
 {
+    if(!load_mesh(file_path)) return false;
+
+    // Faces, volumes, partitions etc. are computed on request (require)
+    print_info();
+    return true;
+}
+
+// Reads nodes and elements, false if the load failed or was cancelled (mesh is left empty)
+bool mesh_manager::load_mesh(std::string file_path)
+{
+    error.clear();
+    if(valid_quantities) return fail("Mesh is already loaded");
+
     mesh_reader reader;
-    msh_data read_mesh = reader.read_msh4(file_path, std::vector<int>{15});
+    reader.log = mesh.log;
+    reader.on_progress = [this](size_t bytes, size_t file_size){return report(load_phase::read_file,bytes,file_size);};
+    msh_data read_mesh = reader.read_file(file_path, std::vector<int>{15});
+    if(reader.cancelled) return fail("Load cancelled");
+    if(!reader.error.empty()) return fail(reader.error);
 
-    mesh_dimension(read_mesh);      // Get mesh dimension
+    if(!mesh_dimension(read_mesh)) return false;      // Get mesh dimension
     
     // parse_mesh_boundary(read_mesh); // Parse boundary data
-    parse_mesh_nodes(read_mesh);    // Parse nodes 
-    parse_mesh_elements(read_mesh); // Parse elements
-    construct_internal_faces();
-    // compute_volumes();
-    // partition_mesh(mesh);
-    print_info();                   // Print info to terminal
+    bool ok = parse_mesh_nodes(read_mesh);                      // Parse nodes 
+    std::vector<msh_node>().swap(read_mesh.msh_nodes);          // Import data is released as soon as it is parsed
+    ok = ok && parse_mesh_elements(read_mesh);                  // Parse elements
 
+    if(!ok)
+    {
+        mesh.free_data();
+        return fail("Load cancelled");
+    }
 
-    for(int i = 0; i < mesh.N_faces; i++)
+    valid_quantities = quantity_nodes | quantity_connectivity;
+    return true;
+}
+
+// Each stage is published to the handle as soon as its arrays are written
+std::shared_ptr<mesh_load_handle> mesh_manager::read_mesh_async(std::string file_path, uint32_t quantities, load_progress_callback progress)
+{
+    if(active_load) active_load->wait();
+
+    auto handle = std::make_shared<mesh_load_handle>();
+    mesh_load_handle* h = handle.get();
+
+    active_load = handle;
+    load_progress = progress;
+    load_cancel = &h->cancel_flag;
+
+    h->task = std::async(std::launch::async,[this,h,file_path,quantities]()
+    {
+        const std::pair<mesh_quantity,load_phase> stages[] = {{quantity_faces,load_phase::faces},
+                                                              {quantity_volumes,load_phase::volumes},
+                                                              {quantity_face_geometry,load_phase::face_geometry},
+                                                              {quantity_node_elements,load_phase::node_elements},
+                                                              {quantity_partition,load_phase::partition}};
+
+        bool ok = load_mesh(file_path);
+        if(ok) h->set_ready(valid_quantities);
+
+        for(auto const& [quantity, phase] : stages)
+        {
+            if(!ok || !(quantities & quantity)) continue;
+
+            ok = report(phase,0,1);
+            if(!ok) break;
+
+            ok = require(quantity);
+            h->set_ready(valid_quantities);
+            ok = ok && report(phase,1,1);
+        }
+
+        if(!ok)
+        {
+            mesh.free_data();
+            valid_quantities = 0;
+        }
+
+        load_progress = nullptr;
+        load_cancel = nullptr;
+        h->finish(ok);
+    });
+
+    return handle;
+}
+
+// Nodes within tolerance get the lowest index of their cluster (label propagation), ghost nodes are kept
+int mesh_manager::weld_nodes(double tolerance)
+{
+    if(!(tolerance > 0))
+    {
+        fail("Welding tolerance has to be positive");
+        return -1;
+    }
+
+    const int N_real_nodes = mesh.N_nodes-mesh.N_boundary_elements;
+    spatial_hash hash;
+    hash.build(mesh.node_pos_array,N_real_nodes,tolerance);
+
+    std::vector<int32_t> label(N_real_nodes), next(N_real_nodes);
+    for(int i = 0; i < N_real_nodes; i++) label[i] = i;
+
+    bool changed = true;
+    while(changed)
+    {
+        changed = false;
+
+        #pragma omp parallel for schedule(static) reduction(||:changed)
+        for(int i = 0; i < N_real_nodes; i++)
+        {
+            int32_t l = label[label[i]];
+            hash.find_within(&mesh.node_pos_array[3*i],tolerance,[&](int j){l = std::min(l,label[j]);});
+
+            next[i] = l;
+            changed = changed || (l != label[i]);
+        }
+        label.swap(next);
+    }
+
+    std::vector<int32_t> new_idx(mesh.N_nodes);
+    int n = 0;
+    for(int i = 0; i < N_real_nodes; i++)
     {
-        std::cout << i << " " << mesh.Face_ON_idx[2*i] << " " << mesh.Face_ON_idx[2*i+1] << "\n";
+        if(label[i] == i) new_idx[i] = n++;
     }
+    for(int i = 0; i < N_real_nodes; i++) new_idx[i] = new_idx[label[i]];
 
-    // for(int i = 0; i < mesh.N_nodes; i++)
-    // {
-    //     std::cout << mesh.node_pos_array[3*i] << " ";
-    //     std::cout << mesh.node_pos_array[3*i+1] << " ";
-    //     std::cout << mesh.node_pos_array[3*i+2] << "\n";
-    // }
+    const int N_removed = N_real_nodes-n;
+    for(int i = N_real_nodes; i < mesh.N_nodes; i++) new_idx[i] = i-N_removed;
 
+    if(N_removed == 0) return 0;
 
-    // for(int i = 0; i < mesh.N_boundary_elements; i++)
-    // {
-    //     const int element_idx = mesh.Boundary_idxs_array[i];
+    double* node_pos = (double*)mesh_malloc(3*(mesh.N_nodes-N_removed)*sizeof(double),out_of_core);
 
-    //     std::cout << element_idx << ":\t";
+    #pragma omp parallel for schedule(static)
+    for(int i = 0; i < mesh.N_nodes; i++)
+    {
+        if(i < N_real_nodes && label[i] != i) continue;
+        for(int d = 0; d < 3; d++) node_pos[3*new_idx[i]+d] = mesh.node_pos_array[3*i+d];
+    }
+    mesh_free(mesh.node_pos_array);
+    mesh.node_pos_array = node_pos;
+    mesh.N_nodes -= N_removed;
 
-    //     for(int j = mesh.Element_vertices_idx_offsets[element_idx]; j < mesh.Element_vertices_idx_offsets[element_idx+1];j++)
-    //     {
-    //         std::cout << mesh.Element_vertices_idx_array[j] << " ";
-    //     }
-    //     std::cout << "\n";
-    // }
+    int N_degenerate = 0;
 
-    // for(int i = 0; i < mesh.N_elements; i++)
-    // {
-    //     std::cout << i << ":\t";
+    #pragma omp parallel for schedule(static) reduction(+:N_degenerate)
+    for(int i = 0; i < mesh.N_elements; i++)
+    {
+        int32_t* v = &mesh.Element_vertices_idx_array[mesh.Element_vertices_idx_offsets[i]];
+        const int N_v = mesh.Element_vertices_idx_offsets[i+1]-mesh.Element_vertices_idx_offsets[i];
 
-    //     for(int j = mesh.Element_vertices_idx_offsets[i]; j < mesh.Element_vertices_idx_offsets[i+1];j++)
-    //     {
-    //         std::cout << mesh.Element_vertices_idx_array[j] << " ";
-    //     }
-    //     std::cout << "\n";
-    // }
+        for(int j = 0; j < N_v; j++) v[j] = new_idx[v[j]];
+        for(int j = 0; j < N_v; j++)
+        {
+            if(std::find(v+j+1,v+N_v,v[j]) != v+N_v){N_degenerate++; break;}
+        }
+    }
+
+    mesh.out() << "Welded " << N_removed << " nodes\n";
+    if(N_degenerate > 0) mesh.out() << "Warning: " << N_degenerate << " elements collapsed by welding\n";
+
+    modified(quantity_nodes | quantity_connectivity);
+    return N_removed;
+}
+
+// Side a faces are mapped by the transform and matched to side b faces by centroid, then checked vertex by vertex
+int mesh_manager::match_periodic_faces(int tag_a, int tag_b, const periodic_transform& transform, double tolerance)
+{
+    // Hash cells are tolerance sized, also rejects NaN
+    if(!(tolerance > 0))
+    {
+        fail("Periodic matching tolerance has to be positive");
+        return -1;
+    }
+    if(!require(quantity_faces)) return -1;
+
+    // Boundary face of each ghost element
+    std::vector<int32_t> ghost_face(mesh.N_elements,-1);
+    for(int i = 0; i < mesh.N_faces; i++) ghost_face[mesh.Face_ON_idx[2*i+1]] = i;
+
+    std::vector<int32_t> side_a, side_b;
+    for(int k = 0; k < mesh.N_boundary_elements; k++)
+    {
+        const int i = mesh.Boundary_idxs_array[k];
+        if(mesh.Phys_idx_array[i] == tag_a) side_a.push_back(i);
+        if(mesh.Phys_idx_array[i] == tag_b) side_b.push_back(i);
+    }
+
+    // Ghost node (last vertex) is the face vertex average
+    auto ghost_node = [&](int i){return &mesh.node_pos_array[3*mesh.Element_vertices_idx_array[mesh.Element_vertices_idx_offsets[i+1]-1]];};
+
+    std::vector<double> centers_b(3*side_b.size());
+    for(unsigned int k = 0; k < side_b.size(); k++)
+    {
+        for(int d = 0; d < 3; d++) centers_b[3*k+d] = ghost_node(side_b[k])[d];
+    }
+
+    spatial_hash hash;
+    hash.build(centers_b.data(),side_b.size(),tolerance);
+
+    std::vector<int32_t> match(side_a.size(),-1);
+
+    #pragma omp parallel for schedule(dynamic,256)
+    for(unsigned int k = 0; k < side_a.size(); k++)
+    {
+        const int a = side_a[k];
+        const int32_t* va = &mesh.Element_vertices_idx_array[mesh.Element_vertices_idx_offsets[a]];
+        const int N_va = mesh.Element_vertices_idx_offsets[a+1]-mesh.Element_vertices_idx_offsets[a]-1;
+
+        double c[3];
+        transform.apply(ghost_node(a),c);
+
+        hash.find_within(c,tolerance,[&](int candidate)
+        {
+            const int b = side_b[candidate];
+            const int32_t* vb = &mesh.Element_vertices_idx_array[mesh.Element_vertices_idx_offsets[b]];
+            const int N_vb = mesh.Element_vertices_idx_offsets[b+1]-mesh.Element_vertices_idx_offsets[b]-1;
+            if(match[k] >= 0 || N_va != N_vb) return;
+
+            for(int j = 0; j < N_va; j++)
+            {
+                double x[3];
+                transform.apply(&mesh.node_pos_array[3*va[j]],x);
+
+                bool found = false;
+                for(int l = 0; l < N_vb && !found; l++)
+                {
+                    const double* y = &mesh.node_pos_array[3*vb[l]];
+                    found = (x[0]-y[0])*(x[0]-y[0])+(x[1]-y[1])*(x[1]-y[1])+(x[2]-y[2])*(x[2]-y[2]) <= tolerance*tolerance;
+                }
+                if(!found) return;
+            }
+            match[k] = b;
+        });
+    }
+
+    int N_matched = 0;
+    for(unsigned int k = 0; k < side_a.size(); k++)
+    {
+        if(match[k] < 0) continue;
+        mesh.Periodic_face_pairs.push_back({ghost_face[side_a[k]],ghost_face[match[k]]});
+        N_matched++;
+    }
+
+    mesh.out() << "Periodic faces " << tag_a << " -> " << tag_b << ":\t" << N_matched << " matched";
+    if(N_matched < (int)side_a.size() || N_matched < (int)side_b.size())
+    {
+        mesh.out() << ", " << side_a.size()-N_matched << " of side a and " << side_b.size()-N_matched << " of side b unmatched";
+    }
+    mesh.out() << "\n";
+
+    return N_matched;
+}
+
+// Computes missing quantities together with their inputs
+bool mesh_manager::require(uint32_t quantities)
+{
+    if(!(valid_quantities & quantity_connectivity) || !(valid_quantities & quantity_nodes))
+    {
+        if(quantities & ~valid_quantities) return fail("Mesh nodes and elements are not loaded");
+        return true;
+    }
+
+    for(auto const& [quantity, inputs] : quantity_dependencies)
+    {
+        if(!(quantities & quantity) || (valid_quantities & quantity)) continue;
+
+        if(!require(inputs) || !compute_quantity((mesh_quantity)quantity)) return false;
+        valid_quantities |= quantity;
+    }
+    return true;
+}
+
+// Marks quantities as changed (e.g. renumbered nodes/elements), everything derived from them is dropped
+void mesh_manager::modified(uint32_t quantities)
+{
+    for(auto const& [quantity, inputs] : quantity_dependencies)
+    {
+        if(!(inputs & quantities) || !(valid_quantities & quantity)) continue;
+
+        release_quantity((mesh_quantity)quantity);
+        modified(quantity);
+    }
+}
+
+bool mesh_manager::is_valid(mesh_quantity quantity) const
+{
+    return valid_quantities & quantity;
+}
+
+// Nodes are numbered in order of first use by non ghost elements, unused nodes (ghost nodes) follow in their old order
+void mesh_manager::renumber_nodes()
+{
+    if(out_of_core.enabled)
+    {
+        external_renumber_nodes(mesh,valid_quantities & quantity_faces,out_of_core);
+        modified(quantity_nodes);
+        return;
+    }
+
+    // New indices, coordinates and element/face vertices each read and written once
+    const double face_vertices = (valid_quantities & quantity_faces) ? 8.0*mesh.Face_vertices_idx_offsets[mesh.N_faces] : 0;
+    kernel_scope scope(profiler,"renumber_nodes",52.0*mesh.N_nodes+8.0*mesh.N_element_vertices+face_vertices);
+
+    std::vector<int32_t> new_idx(mesh.N_nodes,-1);
+    int n = 0;
+
+    for(int i = 0; i < mesh.N_elements; i++)
+    {
+        if(mesh.is_boundary_element(i)) continue;
+        for(int j = mesh.Element_vertices_idx_offsets[i]; j < mesh.Element_vertices_idx_offsets[i+1]; j++)
+        {
+            const int k = mesh.Element_vertices_idx_array[j];
+            if(new_idx[k] < 0) new_idx[k] = n++;
+        }
+    }
+    for(int k = 0; k < mesh.N_nodes; k++)
+    {
+        if(new_idx[k] < 0) new_idx[k] = n++;
+    }
+
+    double* node_pos = (double*)mesh_malloc(3*mesh.N_nodes*sizeof(double),out_of_core);
+
+    #pragma omp parallel for schedule(static)
+    for(int k = 0; k < mesh.N_nodes; k++)
+    {
+        for(int d = 0; d < 3; d++) node_pos[3*new_idx[k]+d] = mesh.node_pos_array[3*k+d];
+    }
+    mesh_free(mesh.node_pos_array);
+    mesh.node_pos_array = node_pos;
+
+    #pragma omp parallel for schedule(static)
+    for(int j = 0; j < mesh.N_element_vertices; j++)
+    {
+        mesh.Element_vertices_idx_array[j] = new_idx[mesh.Element_vertices_idx_array[j]];
+    }
+
+    if(valid_quantities & quantity_faces)
+    {
+        const int N_face_vertices = mesh.Face_vertices_idx_offsets[mesh.N_faces];
+
+        #pragma omp parallel for schedule(static)
+        for(int j = 0; j < N_face_vertices; j++)
+        {
+            mesh.Face_vertices_idx_array[j] = new_idx[mesh.Face_vertices_idx_array[j]];
+        }
+    }
+
+    if(!mesh.Node_global_idx.empty())
+    {
+        std::vector<int32_t> global_idx(mesh.N_nodes);
+        for(int k = 0; k < mesh.N_nodes; k++) global_idx[new_idx[k]] = mesh.Node_global_idx[k];
+        mesh.Node_global_idx = global_idx;
+    }
+
+    modified(quantity_nodes);
+}
+
+bool mesh_manager::compute_quantity(mesh_quantity quantity)
+{
+    static const std::map<uint32_t, std::string> kernel_names = {{quantity_faces,"faces"},
+                                                                 {quantity_volumes,"volumes"},
+                                                                 {quantity_face_geometry,"face_geometry"},
+                                                                 {quantity_node_elements,"node_elements"}};
+
+    // Partitioning is left out, its traffic is inside METIS
+    auto kernel = kernel_names.find(quantity);
+    kernel_scope scope(kernel != kernel_names.end() ? profiler : nullptr,kernel != kernel_names.end() ? kernel->second : "");
+    bool ok = true;
+
+    switch(quantity)
+    {
+        case quantity_faces: ok = construct_internal_faces(); break;
+        case quantity_volumes: ok = compute_volumes(); break;
+        case quantity_face_geometry: ok = compute_face_geometry(); break;
+        case quantity_node_elements: ok = compute_node_elements(); break;
+        case quantity_partition: return partition_mesh(mesh.N_mesh_blocks);
+        default: break;
+    }
+
+    if(ok && profiler)
+    {
+        double bytes, flops;
+        kernel_traffic(quantity,bytes,flops);
+        scope.traffic(bytes,flops);
+    }
+    return ok;
+}
+
+// Compulsory traffic (each array read or written once) and estimated flops of a derived quantity kernel
+// Flop counts follow the fan decompositions of element_geometry and face_geometry
+void mesh_manager::kernel_traffic(mesh_quantity quantity, double& bytes, double& flops) const
+{
+    const double N_elements = mesh.N_elements, N_nodes = mesh.N_nodes, N_faces = mesh.N_faces;
+    const double element_vertices = 4.0*(mesh.N_element_vertices+N_elements+1);
+    const double face_vertices = (mesh.Face_vertices_idx_offsets) ? 4.0*(mesh.Face_vertices_idx_offsets[mesh.N_faces]+N_faces+1) : 0;
+
+    bytes = 0;
+    flops = 0;
+
+    switch(quantity)
+    {
+        case quantity_faces:
+            bytes = element_vertices+N_elements+8*N_faces+face_vertices;
+            break;
+        case quantity_volumes:
+            bytes = element_vertices+N_elements+24*N_nodes+32*N_elements;
+            for(int i = 0; i < mesh.N_elements; i++)
+            {
+                if(mesh.is_boundary_element(i)) continue;
+                const int n = mesh.Element_vertices_idx_offsets[i+1]-mesh.Element_vertices_idx_offsets[i];
+
+                flops += 3*n+3;
+                if(mesh.Dimension == 2) flops += 21*n;
+                else for(auto const& face : element_type_to_faces.at(mesh.Element_type_array[i])) flops += 3*face.size()+3+40*face.size();
+            }
+            break;
+        case quantity_face_geometry:
+            bytes = face_vertices+24*N_nodes+56*N_faces;
+            for(int i = 0; i < mesh.N_faces; i++)
+            {
+                const int n = mesh.Face_vertices_idx_offsets[i+1]-mesh.Face_vertices_idx_offsets[i];
+                flops += (mesh.Dimension == 2) ? 14 : 43*n+9;
+            }
+            break;
+        case quantity_node_elements:
+            bytes = element_vertices+4.0*(N_nodes+1)+4.0*mesh.N_element_vertices;
+            break;
+        default: break;
+    }
+}
+
+// Frees arrays of a derived quantity
+void mesh_manager::release_quantity(mesh_quantity quantity)
+{
+    auto release = [](auto*& p){mesh_free(p); p = nullptr;};
+
+    switch(quantity)
+    {
+        case quantity_faces:
+            release(mesh.Face_ON_idx);
+            release(mesh.Face_vertices_idx_array);
+            release(mesh.Face_vertices_idx_offsets);
+            mesh.Periodic_face_pairs.clear();
+            mesh.N_faces = 0;
+            break;
+        case quantity_volumes:
+            release(mesh.V_array);
+            release(mesh.Element_centroids_array);
+            break;
+        case quantity_face_geometry:
+            release(mesh.Face_normal_array);
+            release(mesh.Face_area_array);
+            release(mesh.Face_centroids_array);
+            break;
+        case quantity_node_elements:
+            release(mesh.Node_elements_idx);
+            release(mesh.Node_elements_offsets);
+            break;
+        case quantity_partition:
+            release(mesh.Element_partition_array);
+            break;
+        default: break;
+    }
 
+    valid_quantities &= ~(uint32_t)quantity;
+}
+
+const uint32_t* mesh_manager::faces(){require(quantity_faces); return mesh.Face_ON_idx;}
+const double* mesh_manager::volumes(){require(quantity_volumes); return mesh.V_array;}
+const double* mesh_manager::element_centroids(){require(quantity_volumes); return mesh.Element_centroids_array;}
+const double* mesh_manager::face_normals(){require(quantity_face_geometry); return mesh.Face_normal_array;}
+const double* mesh_manager::face_areas(){require(quantity_face_geometry); return mesh.Face_area_array;}
+const double* mesh_manager::face_centroids(){require(quantity_face_geometry); return mesh.Face_centroids_array;}
+const int32_t* mesh_manager::node_elements_offsets(){require(quantity_node_elements); return mesh.Node_elements_offsets;}
+const int32_t* mesh_manager::node_elements(){require(quantity_node_elements); return mesh.Node_elements_idx;}
+const int32_t* mesh_manager::partitions(){require(quantity_partition); return mesh.Element_partition_array;}
+
+// Read one partition written by write_partitions, geometry is recomputed locally
+bool mesh_manager::read_partition(std::string base_path, int part)
+{
+    error.clear();
+    if(valid_quantities) return fail("Mesh is already loaded");
+
+    mesh_decomposer decomposer(mesh);
+    if(!decomposer.read_partition(base_path,part))
+    {
+        mesh.free_data();
+        return fail(decomposer.error);
+    }
+    valid_quantities = quantity_nodes | quantity_connectivity | quantity_faces;
+
+    print_info();
+    return true;
+}
+
+// Partition mesh and write one self contained file per partition
+bool mesh_manager::write_partitions(std::string base_path, int N_parts, const partition_weights& weights)
+{
+    if(!partition_mesh(N_parts,weights)) return false;
+
+    mesh_decomposer decomposer(mesh);
+    if(!decomposer.write_partitions(base_path)) return fail(decomposer.error);
+    return true;
 }
 
 // Export to legacy VTK format
@@ -212,7 +791,7 @@ void mesh_manager::parse_mesh_boundary(const msh_data& data)
         mesh.Face_vertices_idx_array = (uint32_t*)malloc(N_boundary_face_indices*sizeof(uint32_t));
         mesh.Face_vertices_idx_offsets = (uint32_t*)malloc(mesh.N_boundary_elements*sizeof(uint32_t));
     }
-    else{exit(1);}
+    else return;
 
     int i = 0, j = 0;
     for(auto const& element : data.msh_elements)
@@ -232,16 +811,16 @@ void mesh_manager::parse_mesh_boundary(const msh_data& data)
 }
 
 // Allocate mesh node coor. arrays and parse data
-void mesh_manager::parse_mesh_nodes(const msh_data& data)
+bool mesh_manager::parse_mesh_nodes(const msh_data& data)
 {
-    std::cout << "Parsing mesh nodes\n";
+    mesh.out() << "Parsing mesh nodes\n";
     const int N = mesh.N_nodes;
 
     // Check mesh data if allocated
-    check_if_allocated<double>(mesh.node_pos_array);
+    if(check_if_allocated<double>(mesh.node_pos_array)) return fail("Node arrays are already allocated");
 
     // Allocate memory for node pos data
-    mesh.node_pos_array = (double*)malloc(3*(N)*sizeof(double));
+    mesh.node_pos_array = (double*)mesh_malloc(3*(N)*sizeof(double),out_of_core);
 
     // Write to node pos memory
     int node_idx = 0;
@@ -252,27 +831,31 @@ void mesh_manager::parse_mesh_nodes(const msh_data& data)
         mesh.node_pos_array[node_idx+2] = node.z;
 
         node_idx += 3;
+        if((node_idx/3 & 0xffff) == 0 && !report(load_phase::parse_nodes,node_idx/3,data.msh_nodes.size())) return false;
     }
-    std::cout << "Parsing mesh nodes done...\n";
+    mesh.out() << "Parsing mesh nodes done...\n";
+    return report(load_phase::parse_nodes,data.msh_nodes.size(),data.msh_nodes.size());
 }
 
 // Alocate mesh element idx and offset data
-void mesh_manager::parse_mesh_elements(const msh_data& data)
+bool mesh_manager::parse_mesh_elements(const msh_data& data)
 {
-    std::cout << "Parsing mesh elements\n";
+    mesh.out() << "Parsing mesh elements\n";
     const int N_elements = mesh.N_elements;
     const int N_element_vertices = mesh.N_element_vertices;
     const int N_element_offsets = N_elements+1;
 
-    mesh.Element_type_array = (uint8_t*)malloc(N_elements*sizeof(uint8_t));                          // Element type array
-    mesh.Phys_idx_array = (uint8_t*)malloc(N_elements*sizeof(uint8_t));                              // Physical index of element
-    mesh.Element_vertices_idx_array = (int32_t*)malloc(N_element_vertices*sizeof(uint32_t));         // List of vertex nodes idxs for all elements
-    mesh.Element_vertices_idx_offsets = (int32_t*)malloc(N_element_offsets*sizeof(uint32_t));           // Where data for vertices starts for given element
-    mesh.Boundary_idxs_array = (uint32_t*)malloc(mesh.N_boundary_elements*sizeof(uint32_t));
+    mesh.Element_type_array = (uint8_t*)mesh_malloc(N_elements*sizeof(uint8_t),out_of_core);                          // Element type array
+    mesh.Phys_idx_array = (uint8_t*)mesh_malloc(N_elements*sizeof(uint8_t),out_of_core);                              // Physical index of element
+    mesh.Element_vertices_idx_array = (int32_t*)mesh_malloc(N_element_vertices*sizeof(uint32_t),out_of_core);         // List of vertex nodes idxs for all elements
+    mesh.Element_vertices_idx_offsets = (int32_t*)mesh_malloc(N_element_offsets*sizeof(uint32_t),out_of_core);           // Where data for vertices starts for given element
+    mesh.Boundary_idxs_array = (uint32_t*)mesh_malloc(mesh.N_boundary_elements*sizeof(uint32_t),out_of_core);
 
     int i = 0, j = 0, k = 0;
     for(const auto& element : data.msh_elements)
     {
+        if((i & 0xffff) == 0xffff && !report(load_phase::parse_elements,i,N_elements)) return false;
+
         if(!contains(mesh.Element_types,(uint8_t)element.element_type))
         {
             // Create and add ghost element
@@ -281,7 +864,9 @@ void mesh_manager::parse_mesh_elements(const msh_data& data)
             mesh.Element_type_array[i] = ghost.element_type;
             mesh.Phys_idx_array[i] = ghost.physical_idx;
             mesh.Element_vertices_idx_offsets[i] = j;
+            mesh.Boundary_idxs_array[k] = i;
             i++;
+            k++;
             
             for(auto const E_vertex : ghost.node_idxs)
             {
@@ -289,8 +874,6 @@ void mesh_manager::parse_mesh_elements(const msh_data& data)
                 j++;
             }
 
-            mesh.Boundary_idxs_array[k] = i;
-            k++;
             continue;
         }
 
@@ -308,27 +891,215 @@ void mesh_manager::parse_mesh_elements(const msh_data& data)
 
     mesh.Element_vertices_idx_offsets[N_element_offsets-1] = N_element_vertices;
 
-    std::cout << "Parsing mesh nodes done...\n";
+    mesh.out() << "Parsing mesh nodes done...\n";
+    return report(load_phase::parse_elements,N_elements,N_elements);
+}
+
+// Volume and centroid of one non ghost element
+void mesh_manager::element_geometry(const int i, double& V, double* xc) const
+{
+    const double* X = mesh.node_pos_array;
+    const int32_t* v = &mesh.Element_vertices_idx_array[mesh.Element_vertices_idx_offsets[i]];
+    const int n = mesh.Element_vertices_idx_offsets[i+1]-mesh.Element_vertices_idx_offsets[i];
+
+    // Vertex average as decomposition center
+    double c[3] = {0,0,0};
+    for(int j = 0; j < n; j++)
+    {
+        for(int d = 0; d < 3; d++) c[d] += X[3*v[j]+d];
+    }
+    for(int d = 0; d < 3; d++) c[d] /= n;
+
+    V = 0;
+    for(int d = 0; d < 3; d++) xc[d] = 0;
+
+    if(mesh.Dimension == 2)
+    {
+        // Triangle fan around vertex average
+        for(int j = 0; j < n; j++)
+        {
+            const double* a = &X[3*v[j]];
+            const double* b = &X[3*v[(j+1)%n]];
+            const double A = 0.5*((a[0]-c[0])*(b[1]-c[1])-(a[1]-c[1])*(b[0]-c[0]));
+
+            V += A;
+            for(int d = 0; d < 3; d++) xc[d] += A*(a[d]+b[d]+c[d])/3;
+        }
+    }
+    else
+    {
+        // Tetrahedra from vertex average to triangulated faces
+        for(auto const& face : element_type_to_faces.at(mesh.Element_type_array[i]))
+        {
+            const int nf = face.size();
+            double fc[3] = {0,0,0};
+            for(int j = 0; j < nf; j++)
+            {
+                for(int d = 0; d < 3; d++) fc[d] += X[3*v[face[j]]+d];
+            }
+            for(int d = 0; d < 3; d++) fc[d] /= nf;
+
+            for(int j = 0; j < nf; j++)
+            {
+                const double* a = &X[3*v[face[j]]];
+                const double* b = &X[3*v[face[(j+1)%nf]]];
+
+                const double u[3] = {a[0]-fc[0],a[1]-fc[1],a[2]-fc[2]};
+                const double w[3] = {b[0]-fc[0],b[1]-fc[1],b[2]-fc[2]};
+                const double S[3] = {u[1]*w[2]-u[2]*w[1],u[2]*w[0]-u[0]*w[2],u[0]*w[1]-u[1]*w[0]};
+
+                const double Vt = (S[0]*(fc[0]-c[0])+S[1]*(fc[1]-c[1])+S[2]*(fc[2]-c[2]))/6;
+
+                V += Vt;
+                for(int d = 0; d < 3; d++) xc[d] += Vt*(a[d]+b[d]+c[d]+fc[d])/4;
+            }
+        }
+    }
+
+    for(int d = 0; d < 3; d++)
+    {
+        xc[d] = (V != 0) ? xc[d]/V : c[d];
+    }
 }
 
-//
-void mesh_manager::compute_volumes()
+// Computes element volumes (areas in 2D) and centroids, volumes are signed so inverted elements stay visible
+bool mesh_manager::compute_volumes()
 {
+    if(valid_quantities & quantity_volumes) return true;
     const int N_elements = mesh.N_elements;
 
-    mesh.V_array = (double*)malloc(N_elements*sizeof(double));
+    if(check_if_allocated<double>(mesh.V_array) || check_if_allocated<double>(mesh.Element_centroids_array))
+    {
+        return fail("Volume arrays are already allocated");
+    }
+
+    mesh.V_array = (double*)mesh_malloc(N_elements*sizeof(double),out_of_core);
+    mesh.Element_centroids_array = (double*)mesh_malloc(3*N_elements*sizeof(double),out_of_core);
 
-    int k = 0;
+    #pragma omp parallel for schedule(static)
     for(int i = 0; i < N_elements; i++)
     {
-        const int n = element_type_to_props[mesh.Element_type_array[i]][0];
+        // Ghost elements have no volume, centroid is the ghost node
+        if(mesh.is_boundary_element(i))
+        {
+            const int ghost_node = mesh.Element_vertices_idx_array[mesh.Element_vertices_idx_offsets[i+1]-1];
+            mesh.V_array[i] = 0;
+            for(int d = 0; d < 3; d++) mesh.Element_centroids_array[3*i+d] = mesh.node_pos_array[3*ghost_node+d];
+            continue;
+        }
+
+        element_geometry(i,mesh.V_array[i],&mesh.Element_centroids_array[3*i]);
+    }
+
+    valid_quantities |= quantity_volumes;
+    return true;
+}
+
+// Inverse connectivity, element lists of every node are in ascending order
+bool mesh_manager::compute_node_elements()
+{
+    if(check_if_allocated<int32_t>(mesh.Node_elements_offsets) || check_if_allocated<int32_t>(mesh.Node_elements_idx))
+    {
+        return fail("Node element arrays are already allocated");
+    }
+
+    mesh.Node_elements_offsets = (int32_t*)mesh_malloc((mesh.N_nodes+1)*sizeof(int32_t),out_of_core);
+    std::fill(mesh.Node_elements_offsets,mesh.Node_elements_offsets+mesh.N_nodes+1,0);
+    mesh.Node_elements_idx = (int32_t*)mesh_malloc(mesh.N_element_vertices*sizeof(int32_t),out_of_core);
+
+    for(int j = 0; j < mesh.N_element_vertices; j++) mesh.Node_elements_offsets[mesh.Element_vertices_idx_array[j]+1]++;
+    for(int i = 0; i < mesh.N_nodes; i++) mesh.Node_elements_offsets[i+1] += mesh.Node_elements_offsets[i];
+
+    std::vector<int32_t> fill(mesh.Node_elements_offsets,mesh.Node_elements_offsets+mesh.N_nodes);
+    for(int i = 0; i < mesh.N_elements; i++)
+    {
+        for(int j = mesh.Element_vertices_idx_offsets[i]; j < mesh.Element_vertices_idx_offsets[i+1]; j++)
+        {
+            mesh.Node_elements_idx[fill[mesh.Element_vertices_idx_array[j]]++] = i;
+        }
+    }
+
+    valid_quantities |= quantity_node_elements;
+    return true;
+}
+
+// Area vector and centroid of face i from its vertices
+void mesh_manager::face_geometry(const int i, double* S, double* xc) const
+{
+    const double* X = mesh.node_pos_array;
+    const uint32_t* v = &mesh.Face_vertices_idx_array[mesh.Face_vertices_idx_offsets[i]];
+    const int n = mesh.Face_vertices_idx_offsets[i+1]-mesh.Face_vertices_idx_offsets[i];
+
+    for(int d = 0; d < 3; d++){S[d] = 0; xc[d] = 0;}
+    if(mesh.Dimension == 2)
+    {
+        // Edge a->b of counter clockwise owner, outward normal is (dy,-dx)
+        const double* a = &X[3*v[0]];
+        const double* b = &X[3*v[1]];
+
+        S[0] = b[1]-a[1];
+        S[1] = -(b[0]-a[0]);
+        for(int d = 0; d < 3; d++) xc[d] = 0.5*(a[d]+b[d]);
+    }
+    else
+    {
+        double fc[3] = {0,0,0};
+        for(int j = 0; j < n; j++)
+        {
+            for(int d = 0; d < 3; d++) fc[d] += X[3*v[j]+d];
+        }
+        for(int d = 0; d < 3; d++) fc[d] /= n;
 
+        // Triangle fan around vertex average
+        double A_sum = 0;
         for(int j = 0; j < n; j++)
         {
-            std::cout << mesh.Element_vertices_idx_array[k] << " ";
-            k++;
+            const double* a = &X[3*v[j]];
+            const double* b = &X[3*v[(j+1)%n]];
+
+            const double u[3] = {a[0]-fc[0],a[1]-fc[1],a[2]-fc[2]};
+            const double w[3] = {b[0]-fc[0],b[1]-fc[1],b[2]-fc[2]};
+            const double St[3] = {0.5*(u[1]*w[2]-u[2]*w[1]),0.5*(u[2]*w[0]-u[0]*w[2]),0.5*(u[0]*w[1]-u[1]*w[0])};
+            const double At = sqrt(St[0]*St[0]+St[1]*St[1]+St[2]*St[2]);
+
+            A_sum += At;
+            for(int d = 0; d < 3; d++)
+            {
+                S[d] += St[d];
+                xc[d] += At*(a[d]+b[d]+fc[d])/3;
+            }
         }
+        for(int d = 0; d < 3; d++) xc[d] = (A_sum > 0) ? xc[d]/A_sum : fc[d];
+    }
+}
+
+// Computes face area vectors, areas and centroids from face vertices
+bool mesh_manager::compute_face_geometry()
+{
+    if(valid_quantities & quantity_face_geometry) return true;
+    const int N_faces = mesh.N_faces;
+
+    if(check_if_allocated<double>(mesh.Face_normal_array) || check_if_allocated<double>(mesh.Face_area_array) ||
+       check_if_allocated<double>(mesh.Face_centroids_array))
+    {
+        return fail("Face geometry arrays are already allocated");
+    }
+
+    mesh.Face_normal_array = (double*)mesh_malloc(3*N_faces*sizeof(double),out_of_core);
+    mesh.Face_area_array = (double*)mesh_malloc(N_faces*sizeof(double),out_of_core);
+    mesh.Face_centroids_array = (double*)mesh_malloc(3*N_faces*sizeof(double),out_of_core);
+
+    #pragma omp parallel for schedule(static)
+    for(int i = 0; i < N_faces; i++)
+    {
+        face_geometry(i,&mesh.Face_normal_array[3*i],&mesh.Face_centroids_array[3*i]);
+
+        const double* S = &mesh.Face_normal_array[3*i];
+        mesh.Face_area_array[i] = sqrt(S[0]*S[0]+S[1]*S[1]+S[2]*S[2]);
     }
+
+    valid_quantities |= quantity_face_geometry;
+    return true;
 }
 
 // Adjust boundary elements from file (adds a node)
@@ -369,13 +1140,13 @@ msh_element mesh_manager::add_ghost_element(const msh_element& element, const in
     return ghost;
 }
 
-void mesh_manager::find_adjency_structure(idx_t** _xadj, idx_t** _adjncy, int n_common)
+bool mesh_manager::find_adjency_structure(idx_t** _xadj, idx_t** _adjncy, int n_common)
 {
     idx_t N_nodes = mesh.N_nodes;
     idx_t N_elements = mesh.N_elements;
 
     idx_t numFlag = 0;
-    idx_t nCommon = 2;
+    idx_t nCommon = n_common;
 
     // idx_t *xadj, *adjncy;
     idx_t *eptr, *eind;
@@ -385,10 +1156,10 @@ void mesh_manager::find_adjency_structure(idx_t** _xadj, idx_t** _adjncy, int n_
 
     auto output = METIS_MeshToDual(&N_elements,&N_nodes,eptr,eind,&nCommon,&numFlag,_xadj,_adjncy);
 
-    if(output == METIS_OK)
-    {
-        std::cout << "METIS ok\n";
-    }
+    if(output != METIS_OK) return fail("METIS dual graph construction failed");
+
+    mesh.out() << "METIS ok\n";
+    return true;
 }
 
 void mesh_manager::find_unique_faces(idx_t** _xadj, idx_t** _adjncy)
@@ -410,56 +1181,302 @@ void mesh_manager::find_unique_faces(idx_t** _xadj, idx_t** _adjncy)
 
 
     mesh.N_faces = uniquePairs.size();
-    mesh.Face_ON_idx = (uint32_t*)malloc(2*mesh.N_faces*sizeof(uint32_t));
+    mesh.Face_ON_idx = (uint32_t*)mesh_malloc(2*mesh.N_faces*sizeof(uint32_t),out_of_core);
 
     int index = 0;
     for (const auto& pair : uniquePairs) {
-        mesh.Face_ON_idx[index++] = pair.first;
-        mesh.Face_ON_idx[index++] = pair.second;
+        // Boundary faces are owned by the inner element, ghost is the neighbour
+        if(mesh.is_boundary_element(pair.first))
+        {
+            mesh.Face_ON_idx[index++] = pair.second;
+            mesh.Face_ON_idx[index++] = pair.first;
+        }
+        else
+        {
+            mesh.Face_ON_idx[index++] = pair.first;
+            mesh.Face_ON_idx[index++] = pair.second;
+        }
     }
 }
 
-void mesh_manager::find_face_nodes()
+// Finds vertices of each face as the owner element face contained in the neighbour element
+bool mesh_manager::find_face_nodes()
 {
-    int preallocate_size;
-    if(mesh.Dimension == 2) preallocate_size = 2;
-    else preallocate_size = 4;
+    const int N_faces = mesh.N_faces;
 
-    std::vector<int32_t> vec1;
-    std::vector<int32_t> vec2;
-    vec1.reserve(preallocate_size);
-    vec2.reserve(preallocate_size);
-    
-    int owner_idx, neighbour_idx; 
-    int32_t *owner_p, *neighbour_p;
-    for(int i = 0; i < mesh.N_faces; i++)
+    if(check_if_allocated<uint32_t>(mesh.Face_vertices_idx_array) || check_if_allocated<uint32_t>(mesh.Face_vertices_idx_offsets))
     {
-        owner_idx = mesh.Face_ON_idx[2*i];
-        neighbour_idx = mesh.Face_ON_idx[2*i+1];
+        return fail("Face vertex arrays are already allocated");
+    }
 
-        owner_p = &mesh.Element_vertices_idx_offsets[owner_idx];
-        neighbour_p = &mesh.Element_vertices_idx_offsets[neighbour_idx];
+    std::vector<int8_t> local_face(N_faces,-1);
+    mesh.Face_vertices_idx_offsets = (uint32_t*)mesh_malloc((N_faces+1)*sizeof(uint32_t),out_of_core);
+    int missing_face = -1;
 
-        
+    #pragma omp parallel for schedule(static)
+    for(int i = 0; i < N_faces; i++)
+    {
+        const int owner_idx = mesh.Face_ON_idx[2*i];
+        const int neighbour_idx = mesh.Face_ON_idx[2*i+1];
+
+        const int32_t* owner_p = &mesh.Element_vertices_idx_array[mesh.Element_vertices_idx_offsets[owner_idx]];
+        const int32_t* neighbour_begin = &mesh.Element_vertices_idx_array[mesh.Element_vertices_idx_offsets[neighbour_idx]];
+        const int32_t* neighbour_end = &mesh.Element_vertices_idx_array[mesh.Element_vertices_idx_offsets[neighbour_idx+1]];
+
+        auto const& faces = element_type_to_faces.at(mesh.Element_type_array[owner_idx]);
+        for(unsigned int f = 0; f < faces.size(); f++)
+        {
+            bool shared = true;
+            for(auto const j : faces[f])
+            {
+                if(std::find(neighbour_begin,neighbour_end,owner_p[j]) == neighbour_end){shared = false; break;}
+            }
+            if(shared){local_face[i] = f; break;}
+        }
+
+        if(local_face[i] < 0)
+        {
+            #pragma omp atomic write
+            missing_face = i;
+            continue;
+        }
+
+        mesh.Face_vertices_idx_offsets[i+1] = faces[local_face[i]].size();
+    }
+
+    if(missing_face >= 0)
+    {
+        return fail("Face " + std::to_string(missing_face) + " not found in owner element " + std::to_string(mesh.Face_ON_idx[2*missing_face]));
+    }
+
+    mesh.Face_vertices_idx_offsets[0] = 0;
+    for(int i = 0; i < N_faces; i++)
+    {
+        mesh.Face_vertices_idx_offsets[i+1] += mesh.Face_vertices_idx_offsets[i];
+    }
+
+    mesh.Face_vertices_idx_array = (uint32_t*)mesh_malloc(mesh.Face_vertices_idx_offsets[N_faces]*sizeof(uint32_t),out_of_core);
+
+    #pragma omp parallel for schedule(static)
+    for(int i = 0; i < N_faces; i++)
+    {
+        const int owner_idx = mesh.Face_ON_idx[2*i];
+        const int32_t* owner_p = &mesh.Element_vertices_idx_array[mesh.Element_vertices_idx_offsets[owner_idx]];
+
+        int k = mesh.Face_vertices_idx_offsets[i];
+        for(auto const j : element_type_to_faces.at(mesh.Element_type_array[owner_idx])[local_face[i]])
+        {
+            mesh.Face_vertices_idx_array[k++] = owner_p[j];
+        }
     }
+    return true;
 }
 
 // Calls metis for adjency structure WIP
-void mesh_manager::construct_internal_faces()
+bool mesh_manager::construct_internal_faces()
 {
+    if(valid_quantities & quantity_faces) return true;
+
+    // METIS needs the whole dual graph in memory
+    if(out_of_core.enabled)
+    {
+        external_construct_faces(mesh,out_of_core);
+        valid_quantities |= quantity_faces;
+        return true;
+    }
+
     int n_common;
 
     if(mesh.Dimension == 2) n_common = 2;
     else if (mesh.Dimension == 3) n_common = 3;
-    else exit(1);
+    else return fail("Faces need a 2D or 3D mesh");
 
     idx_t *xadj, *adjncy;
-    find_adjency_structure(&xadj,&adjncy,n_common);
+    if(!find_adjency_structure(&xadj,&adjncy,n_common)) return false;
     find_unique_faces(&xadj,&adjncy);
     
     free(xadj);
     free(adjncy);
 
-    find_face_nodes();
+    if(!find_face_nodes())
+    {
+        release_quantity(quantity_faces);
+        return false;
+    }
+
+    valid_quantities |= quantity_faces;
+    return true;
+}
+
+// Times kernel(element_idx) on a sample of each element type, costs are relative to the cheapest type
+// Default kernel is the element geometry (face fan decomposition), which scales with element faces and vertices
+partition_weights mesh_manager::calibrate_partition_weights(std::function<void(int)> kernel, int N_samples)
+{
+    if(!kernel)
+    {
+        kernel = [this](int i)
+        {
+            double V, xc[3];
+            element_geometry(i,V,xc);
+            asm volatile("" : : "g"(&V), "g"(xc) : "memory");
+        };
+    }
+
+    std::map<int,std::vector<int>> samples;
+    for(int i = 0; i < mesh.N_elements; i++)
+    {
+        if(mesh.is_boundary_element(i)) continue;
+        auto& list = samples[mesh.Element_type_array[i]];
+        if((int)list.size() < N_samples) list.push_back(i);
+    }
+
+    partition_weights weights;
+    double min_cost = std::numeric_limits<double>::max();
+    for(auto const& [type, list] : samples)
+    {
+        // Best of several repeats to filter noise
+        double best = std::numeric_limits<double>::max();
+        for(int r = 0; r < 5; r++)
+        {
+            auto start = std::chrono::steady_clock::now();
+            for(auto const i : list) kernel(i);
+            auto end = std::chrono::steady_clock::now();
+            best = std::min(best,std::chrono::duration<double>(end-start).count()/list.size());
+        }
+        weights.element_type_cost[type] = best;
+        min_cost = std::min(min_cost,best);
+    }
+
+    mesh.out() << "Calibrated element costs:\n";
+    for(auto& [type, cost] : weights.element_type_cost)
+    {
+        mesh.out() << "\ttype " << type << ":\t" << cost*1e9 << " ns, weight " << cost/min_cost << "\n";
+        cost /= min_cost;
+    }
+
+    return weights;
+}
+
+// Predicted load per partition relative to the mean, and communication (cut face cost) per partition
+void mesh_manager::print_partition_balance(const std::vector<double>& element_cost, const partition_weights& weights)
+{
+    const int N_parts = mesh.N_mesh_blocks;
+    std::vector<double> load(N_parts,0), comm(N_parts,0);
+
+    for(int i = 0; i < mesh.N_elements; i++) load[mesh.Element_partition_array[i]] += element_cost[i];
+    for(int i = 0; i < mesh.N_faces; i++)
+    {
+        const int po = mesh.Element_partition_array[mesh.Face_ON_idx[2*i]];
+        const int pn = mesh.Element_partition_array[mesh.Face_ON_idx[2*i+1]];
+        if(po == pn) continue;
+
+        const double c = weights.face_comm_cost.empty() ? 1 : weights.face_comm_cost[i];
+        comm[po] += c;
+        comm[pn] += c;
+    }
+
+    double total = 0, max_load = 0;
+    for(auto const l : load){total += l; max_load = std::max(max_load,l);}
+    const double mean = total/N_parts;
+
+    mesh.out() << "Partition\tload/mean\tcomm\n";
+    for(int p = 0; p < N_parts; p++)
+    {
+        mesh.out() << p << "\t\t" << load[p]/mean << "\t\t" << comm[p] << "\n";
+    }
+    mesh.out() << "Predicted load imbalance (max/mean):\t" << max_load/mean << "\n";
+}
+
+// Partitions dual graph of non ghost elements with METIS, ghosts get the partition of their inner element
+// Vertex weights come from element type costs, edge weights from face communication costs
+bool mesh_manager::partition_mesh(int N_parts, const partition_weights& weights)
+{
+    if(N_parts < 1) return fail("Number of partitions has to be positive");
+    if(!require(quantity_faces)) return false;
+
+    // Weights are checked before the old partition is dropped
+    if(!weights.face_comm_cost.empty() && (int)weights.face_comm_cost.size() != mesh.N_faces)
+    {
+        return fail("Face communication costs do not match number of faces");
+    }
+
+    mesh_free(mesh.Element_partition_array);
+    mesh.Element_partition_array = (int32_t*)mesh_malloc(mesh.N_elements*sizeof(int32_t),out_of_core);
+    mesh.N_mesh_blocks = N_parts;
+
+    // Compact dual graph without ghosts
+    std::vector<idx_t> real_idx(mesh.N_elements,-1);
+    idx_t N_real = 0;
+    for(int i = 0; i < mesh.N_elements; i++)
+    {
+        if(!mesh.is_boundary_element(i)) real_idx[i] = N_real++;
+    }
+
+    std::vector<idx_t> xadj(N_real+1,0);
+    for(int i = 0; i < mesh.N_faces; i++)
+    {
+        const int o = real_idx[mesh.Face_ON_idx[2*i]], n = real_idx[mesh.Face_ON_idx[2*i+1]];
+        if(n < 0) continue;
+        xadj[o+1]++;
+        xadj[n+1]++;
+    }
+    for(int i = 0; i < N_real; i++) xadj[i+1] += xadj[i];
+
+    // METIS takes integer weights, costs are scaled so the cheapest unit maps to 100
+    const bool use_comm_weights = !weights.face_comm_cost.empty();
+
+    std::vector<idx_t> adjncy(xadj[N_real]), adjwgt(use_comm_weights ? xadj[N_real] : 0);
+    std::vector<idx_t> fill(xadj.begin(),xadj.end()-1);
+    for(int i = 0; i < mesh.N_faces; i++)
+    {
+        const int o = real_idx[mesh.Face_ON_idx[2*i]], n = real_idx[mesh.Face_ON_idx[2*i+1]];
+        if(n < 0) continue;
+        if(use_comm_weights)
+        {
+            const idx_t w = std::max<idx_t>(1,lround(100*weights.face_comm_cost[i]));
+            adjwgt[fill[o]] = w;
+            adjwgt[fill[n]] = w;
+        }
+        adjncy[fill[o]++] = n;
+        adjncy[fill[n]++] = o;
+    }
+
+    std::vector<double> element_cost(mesh.N_elements,0);
+    std::vector<idx_t> vwgt(N_real);
+    for(int i = 0; i < mesh.N_elements; i++)
+    {
+        if(real_idx[i] < 0) continue;
+        auto it = weights.element_type_cost.find(mesh.Element_type_array[i]);
+        element_cost[i] = (it != weights.element_type_cost.end()) ? it->second : 1.0;
+        vwgt[real_idx[i]] = std::max<idx_t>(1,lround(100*element_cost[i]));
+    }
+
+    std::vector<idx_t> part(N_real,0);
+    if(N_parts > 1)
+    {
+        idx_t N_constraints = 1, N_partitions = N_parts, edgecut;
+        auto output = METIS_PartGraphKway(&N_real,&N_constraints,xadj.data(),adjncy.data(),vwgt.data(),NULL,
+                                          use_comm_weights ? adjwgt.data() : NULL,
+                                          &N_partitions,NULL,NULL,NULL,&edgecut,part.data());
+        if(output != METIS_OK)
+        {
+            release_quantity(quantity_partition);
+            return fail("METIS partitioning failed");
+        }
+        mesh.out() << "Partitioned into " << N_parts << " parts, edgecut: " << edgecut << "\n";
+    }
 
-}
\ No newline at end of file
+    for(int i = 0; i < mesh.N_elements; i++)
+    {
+        if(real_idx[i] >= 0) mesh.Element_partition_array[i] = part[real_idx[i]];
+    }
+    for(int i = 0; i < mesh.N_faces; i++)
+    {
+        const int o = mesh.Face_ON_idx[2*i], n = mesh.Face_ON_idx[2*i+1];
+        if(real_idx[n] < 0) mesh.Element_partition_array[n] = mesh.Element_partition_array[o];
+    }
+
+    valid_quantities |= quantity_partition;
+    print_partition_balance(element_cost,weights);
+    return true;
+}
@@ -3,13 +3,23 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <functional>
+#include <memory>
+#include <future>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 
 #include "mesh_reader.h"
 #include "mesh_reader_structs.h"
+#include "mesh_out_of_core.h"
+#include "mesh_spatial_hash.h"
+#include "mesh_profiler.h"
 
 #define MAX_CHUNK_SIZE 8;
 
-extern std::map<int, std::vector<int>> element_type_to_props;
+extern const std::map<int, std::vector<int>> element_type_to_props;
+extern const std::map<int, std::vector<std::vector<int>>> element_type_to_faces;
 
 //cache blocking
 //Has to contain only one type of elements
@@ -39,9 +49,72 @@ struct mesh_block
     std::vector<mesh_chunk> chunks;
 };
 
+// Mesh data tracked by the lazy pipeline, inputs come from reading, the rest is derived on first request
+enum mesh_quantity : uint32_t
+{
+    quantity_nodes          = 1 << 0,   // Node coordinates (input)
+    quantity_connectivity   = 1 << 1,   // Element types, vertices, physical idxs and ghosts (input)
+    quantity_faces          = 1 << 2,   // Face owner/neighbour pairs and face vertices
+    quantity_volumes        = 1 << 3,   // Element volumes and centroids
+    quantity_face_geometry  = 1 << 4,   // Face area vectors, areas and centroids
+    quantity_node_elements  = 1 << 5,   // Node -> element inverse connectivity
+    quantity_partition      = 1 << 6    // Element partitions
+};
+
+// Work estimates for partitioning
+struct partition_weights
+{
+    std::map<int,double> element_type_cost;     // Relative cost per element type (GMSH types), missing types cost 1
+    std::vector<double> face_comm_cost;         // Optional communication cost per face, empty for uniform faces
+};
+
+// Phases of a mesh load reported to progress callbacks
+enum class load_phase
+{
+    read_file,          // Bytes read from the msh file
+    parse_nodes,        // Nodes copied to mesh arrays
+    parse_elements,     // Elements (with ghosts) copied to mesh arrays
+    faces,              // Faces built
+    volumes,            // Element volumes and centroids
+    face_geometry,      // Face areas, normals and centroids
+    node_elements,      // Node -> element connectivity
+    partition           // Element partitions
+};
+
+// Called with (phase, done, total), runs on the loading thread
+typedef std::function<void(load_phase, size_t, size_t)> load_progress_callback;
+
+// State of a background load (mesh_manager::read_mesh_async)
+class mesh_load_handle
+{
+    private:
+    friend class mesh_manager;
+
+    std::atomic<bool> cancel_flag{false};
+    mutable std::mutex mutex;
+    mutable std::condition_variable changed;
+    uint32_t ready = 0;             // mesh_quantity bits that may be read
+    bool finished = false;
+    bool completed = false;
+    std::future<void> task;
+
+    void set_ready(uint32_t quantities);
+    void finish(bool ok);
+
+    public:
+    void cancel();                              // Cooperative, the load stops at the next check and frees the mesh
+    bool cancel_requested() const {return cancel_flag;}
+
+    bool wait();                                // Blocks until the load ends, true if it completed
+    bool wait_for(uint32_t quantities);         // Blocks until quantities are ready, false if the load ended without them
+    bool is_ready(uint32_t quantities) const;
+};
+
 //array of mesh blocks (whole mesh)
 struct mesh_struct
 {
+    std::ostream* log;          // Messages of this mesh and its manager, nullptr silences them
+
     int Dimension = 0;          // Mesh dimension
     int N_mesh_blocks = 1;      // Number of blocks in mesh
 
@@ -59,60 +132,156 @@ struct mesh_struct
     double* node_pos_array;         // Node coordinates
 
     double *V_array;                        // Element volume array
+    double *Element_centroids_array;        // Element centroid coordinates (ghost elements use ghost node)
     uint8_t *Element_type_array;            // Array of element types (GMSH types)  
     uint8_t *Phys_idx_array;                // Physical index of each element
     int32_t *Element_vertices_idx_array;    // Element vertices
     int32_t *Element_vertices_idx_offsets;  // Array of indices where element vertex data starts
     uint32_t *Boundary_idxs_array;           // Index array of boundary elements
 
-    uint32_t *Face_vertices_idx_array;       // 
-    uint32_t *Face_vertices_idx_offsets;     // 
-    uint32_t *Face_ON_idx;
+    uint32_t *Face_vertices_idx_array;       // Face vertices, ordered as in the owner element
+    uint32_t *Face_vertices_idx_offsets;     // Array of indices where face vertex data starts
+    uint32_t *Face_ON_idx;                   // Face owner/neighbour pairs, boundary faces are owned by the inner element
+
+    double *Face_normal_array;              // Face area vectors (|S| = face area), oriented owner -> neighbour
+    double *Face_area_array;                // Face areas
+    double *Face_centroids_array;           // Face centroid coordinates
+
+    int32_t *Node_elements_idx;             // Elements of each node (inverse connectivity)
+    int32_t *Node_elements_offsets;         // Array of indices where node element data starts
+
+    int32_t *Element_partition_array;       // Partition of each element, ghosts follow their inner element
+
+    std::vector<std::pair<int32_t,int32_t>> Periodic_face_pairs;    // Matched boundary faces (side a, side b), dropped with faces
+
+    // Partition local mesh data (mesh_decomposer::read_partition)
+    int Partition_idx = -1;                             // Index of this partition, -1 for a whole mesh
+    int N_owned_elements = 0;                           // Owned elements (with their ghosts) first, halo elements after
+    int N_halo_elements = 0;                            // Elements of neighbour partitions sharing a face with owned ones
+    std::vector<int32_t> Element_global_idx;            // Local -> global element index
+    std::vector<int32_t> Node_global_idx;               // Local -> global node index, sorted unless renumbered
+    std::vector<std::pair<int32_t,int32_t>> Element_global_to_local;    // (global, local) pairs sorted by global index
+    std::vector<int32_t> Neighbour_parts;               // Partitions sharing faces with this one
+    std::vector<int32_t> Halo_offsets;                  // Halo elements received from each neighbour part (relative to N_owned_elements)
+    std::vector<int32_t> Send_offsets;                  // Owned elements sent to each neighbour part
+    std::vector<int32_t> Send_elements;                 // Local owned elements sent to each neighbour part, grouped by Send_offsets
 
     std::vector<uint8_t> Element_types;         // Which elements are solved 2D=trigs/quads 3D=(tetra,hexa,prisms...)
     std::vector<uint8_t> Face_element_types;    // Which elements are faces 2D=lines 3D=(triangles,quads)
+    bool Face_type[256] = {};                   // Face_element_types as a lookup by element type
 
     std::vector<mesh_block> blocks;         // Mesh blocks
 
     // Func
+    // Boundary (ghost) elements are the ones with face element type
+    bool is_boundary_element(const int element_idx) const {return Face_type[Element_type_array[element_idx]];}
+    void set_dimension(int dimension);      // Dimension with its element and face types
     void free_data();
-    mesh_struct();
+    std::ostream& out() const;
+    mesh_struct(std::ostream* _log = &std::cout);
     ~mesh_struct();
 };
 
 class mesh_manager
 {
+    friend class mesh_refiner;
+
     private:
+    uint32_t valid_quantities = 0;          // Bit mask of mesh_quantity that are up to date
+
+    // Current load, progress hook and cancellation flag
+    std::shared_ptr<mesh_load_handle> active_load;
+    load_progress_callback load_progress;
+    const std::atomic<bool>* load_cancel = nullptr;
+
+    bool load_mesh(std::string file_path);
+    bool report(load_phase phase, size_t done, size_t total);
+    bool fail(const std::string& message);
+
     void print_info();
 
+    // Lazy pipeline
+    bool compute_quantity(mesh_quantity quantity);
+    void release_quantity(mesh_quantity quantity);
+
     // Basic
-    void mesh_dimension(const msh_data& data);
+    bool mesh_dimension(const msh_data& data);
 
     // Parsing
     void parse_mesh_boundary(const msh_data& data);
-    void parse_mesh_nodes(const msh_data& data);
-    void parse_mesh_elements(const msh_data& data);
+    bool parse_mesh_nodes(const msh_data& data);
+    bool parse_mesh_elements(const msh_data& data);
 
     // Boundary
     msh_element add_ghost_element(const msh_element& element, const int where);
 
     // Face construction and manipulation
-    void construct_internal_faces();
-    void find_adjency_structure(int32_t** _xadj, int32_t** _adjncy, int n_common);
+    bool construct_internal_faces();
+    bool find_adjency_structure(int32_t** _xadj, int32_t** _adjncy, int n_common);
     void find_unique_faces(int32_t** _xadj, int32_t** _adjncy);
-    void find_face_nodes();
+    bool find_face_nodes();
+    bool compute_face_geometry();
+    bool compute_node_elements();
+    bool compute_volumes();
+
+    // Geometry
+    void element_geometry(const int i, double& V, double* xc) const;
+    void face_geometry(const int i, double* S, double* xc) const;
+
+    // Profiling
+    void kernel_traffic(mesh_quantity quantity, double& bytes, double& flops) const;
 
     // Partitioning
-    void partition_mesh();
+    void print_partition_balance(const std::vector<double>& element_cost, const partition_weights& weights);
 
     public:
     mesh_struct mesh;
-    
-    //constructors
-    mesh_manager();
+    out_of_core_settings out_of_core;       // Set before read_mesh to keep large arrays in scratch files
+    std::string error;                      // Message of the last failed operation
+    kernel_profiler* profiler = nullptr;    // Set to record the derived quantity kernels (and node renumbering)
+
+    // Operations returning bool (or -1) report failures in error instead of exiting, modules built on the mesh
+    // (patterns, gradients, quality, ...) return false and write their messages to the mesh log
+    // Managers share no mutable state, separate managers can be used from separate threads
+    mesh_manager(std::ostream* log = &std::cout);
     ~mesh_manager();
 
-    void read_mesh(std::string file_path);
-    void compute_volumes();
+    bool read_mesh(std::string file_path);
+
+    // Loads the mesh and computes the requested quantities on a background thread
+    // Until the handle reports them ready, quantities must not be accessed (only one load per manager at a time)
+    std::shared_ptr<mesh_load_handle> read_mesh_async(std::string file_path,
+                                                      uint32_t quantities = quantity_faces | quantity_volumes | quantity_face_geometry,
+                                                      load_progress_callback progress = nullptr);
+
+    // Lazy access to derived data, computed on first request and cached
+    bool require(uint32_t quantities);
+    void modified(uint32_t quantities);
+    bool is_valid(mesh_quantity quantity) const;
+
+    // Locality ordering of nodes (first use by elements), keeps faces and drops node dependent data
+    void renumber_nodes();
+
+    // Merges coincident nodes (spatial hash), returns number of removed nodes (-1 for invalid tolerance)
+    int weld_nodes(double tolerance);
+
+    // Links boundary faces of two physical tags, transform maps side a onto side b, returns number of pairs
+    // (-1 for invalid tolerance or missing faces)
+    int match_periodic_faces(int tag_a, int tag_b, const periodic_transform& transform, double tolerance);
+
+    const uint32_t* faces();
+    const double* volumes();
+    const double* element_centroids();
+    const double* face_normals();
+    const double* face_areas();
+    const double* face_centroids();
+    const int32_t* node_elements_offsets();
+    const int32_t* node_elements();
+    const int32_t* partitions();
+
+    bool read_partition(std::string base_path, int part);
+    bool partition_mesh(int N_parts, const partition_weights& weights = partition_weights());
+    partition_weights calibrate_partition_weights(std::function<void(int)> kernel = nullptr, int N_samples = 10000);
+    bool write_partitions(std::string base_path, int N_parts, const partition_weights& weights = partition_weights());
     void export_mesh_VTK(std::string file_path);
 };
\ No newline at end of file
@@ -0,0 +1,174 @@
+#include "mesh_matrix_pattern.h"
+#include <algorithm>
+
+mesh_matrix_pattern::mesh_matrix_pattern(const mesh_struct& _mesh) : mesh(_mesh){}
+
+// Builds LDU order with a counting sort on lower address, CSR rows are then filled in column order without searching
+bool mesh_matrix_pattern::build(int block_size)
+{
+    if(mesh.Face_ON_idx == nullptr)
+    {
+        mesh.out() << "Matrix pattern needs internal faces\n";
+        return false;
+    }
+    if(block_size < 1)
+    {
+        mesh.out() << "Matrix pattern block size has to be positive\n";
+        return false;
+    }
+
+    Block_size = block_size;
+
+    // Rows
+    Element_row.assign(mesh.N_elements,-1);
+    Row_element.clear();
+    for(int i = 0; i < mesh.N_elements; i++)
+    {
+        if(mesh.is_boundary_element(i)) continue;
+        Element_row[i] = Row_element.size();
+        Row_element.push_back(i);
+    }
+    N_rows = Row_element.size();
+
+    // LDU faces bucketed by lower address
+    Owner_start.assign(N_rows+1,0);
+    Face_ldu.assign(mesh.N_faces,-1);
+    Face_ldu_sign.assign(mesh.N_faces,0);
+    for(int i = 0; i < mesh.N_faces; i++)
+    {
+        const int ro = Element_row[mesh.Face_ON_idx[2*i]], rn = Element_row[mesh.Face_ON_idx[2*i+1]];
+        if(rn < 0) continue;
+        Owner_start[std::min(ro,rn)+1]++;
+    }
+    for(int r = 0; r < N_rows; r++) Owner_start[r+1] += Owner_start[r];
+    N_internal_faces = Owner_start[N_rows];
+
+    Lower_addr.resize(N_internal_faces);
+    Upper_addr.resize(N_internal_faces);
+    Ldu_face.resize(N_internal_faces);
+
+    std::vector<int32_t> fill(Owner_start.begin(),Owner_start.end()-1);
+    for(int i = 0; i < mesh.N_faces; i++)
+    {
+        const int ro = Element_row[mesh.Face_ON_idx[2*i]], rn = Element_row[mesh.Face_ON_idx[2*i+1]];
+        if(rn < 0) continue;
+
+        const int k = fill[std::min(ro,rn)]++;
+        Lower_addr[k] = std::min(ro,rn);
+        Upper_addr[k] = std::max(ro,rn);
+        Ldu_face[k] = i;
+    }
+
+    // Sort upper addresses inside each bucket (a few faces per row)
+    #pragma omp parallel for schedule(static)
+    for(int r = 0; r < N_rows; r++)
+    {
+        for(int k = Owner_start[r]+1; k < Owner_start[r+1]; k++)
+        {
+            const int32_t upper = Upper_addr[k], face = Ldu_face[k];
+            int j = k-1;
+            while(j >= Owner_start[r] && Upper_addr[j] > upper)
+            {
+                Upper_addr[j+1] = Upper_addr[j];
+                Ldu_face[j+1] = Ldu_face[j];
+                j--;
+            }
+            Upper_addr[j+1] = upper;
+            Ldu_face[j+1] = face;
+        }
+    }
+
+    #pragma omp parallel for schedule(static)
+    for(int k = 0; k < N_internal_faces; k++)
+    {
+        const int i = Ldu_face[k];
+        Face_ldu[i] = k;
+        Face_ldu_sign[i] = (Element_row[mesh.Face_ON_idx[2*i]] == Lower_addr[k]) ? 1 : -1;
+    }
+
+    // Losort, stable bucket by upper address keeps lower addresses ascending
+    Losort_start.assign(N_rows+1,0);
+    for(int k = 0; k < N_internal_faces; k++) Losort_start[Upper_addr[k]+1]++;
+    for(int r = 0; r < N_rows; r++) Losort_start[r+1] += Losort_start[r];
+
+    Losort.resize(N_internal_faces);
+    fill.assign(Losort_start.begin(),Losort_start.end()-1);
+    for(int k = 0; k < N_internal_faces; k++) Losort[fill[Upper_addr[k]]++] = k;
+
+    // CSR rows: lower entries (losort order), diagonal, upper entries (LDU order)
+    Row_offsets.resize(N_rows+1);
+    Row_offsets[0] = 0;
+    for(int r = 0; r < N_rows; r++)
+    {
+        Row_offsets[r+1] = Row_offsets[r]+(Losort_start[r+1]-Losort_start[r])+1+(Owner_start[r+1]-Owner_start[r]);
+    }
+
+    Col_idx.resize(Row_offsets[N_rows]);
+    Diag_pos.resize(N_rows);
+    std::vector<int32_t> ldu_upper_pos(N_internal_faces), ldu_lower_pos(N_internal_faces);
+
+    #pragma omp parallel for schedule(static)
+    for(int r = 0; r < N_rows; r++)
+    {
+        int pos = Row_offsets[r];
+        for(int j = Losort_start[r]; j < Losort_start[r+1]; j++)
+        {
+            const int k = Losort[j];
+            Col_idx[pos] = Lower_addr[k];
+            ldu_lower_pos[k] = pos++;
+        }
+
+        Diag_pos[r] = pos;
+        Col_idx[pos++] = r;
+
+        for(int k = Owner_start[r]; k < Owner_start[r+1]; k++)
+        {
+            Col_idx[pos] = Upper_addr[k];
+            ldu_upper_pos[k] = pos++;
+        }
+    }
+
+    // Positions in mesh face orientation
+    Face_upper_pos.assign(mesh.N_faces,-1);
+    Face_lower_pos.assign(mesh.N_faces,-1);
+
+    #pragma omp parallel for schedule(static)
+    for(int k = 0; k < N_internal_faces; k++)
+    {
+        const int i = Ldu_face[k];
+        const bool owner_lower = Face_ldu_sign[i] > 0;
+        Face_upper_pos[i] = owner_lower ? ldu_upper_pos[k] : ldu_lower_pos[k];
+        Face_lower_pos[i] = owner_lower ? ldu_lower_pos[k] : ldu_upper_pos[k];
+    }
+
+    mesh.out() << "Matrix pattern:\t" << N_rows << " rows, " << Row_offsets[N_rows] << " nonzero blocks of size " << Block_size << "\n";
+    return true;
+}
+
+void mesh_matrix_pattern::expanded_csr(std::vector<int64_t>& row_offsets, std::vector<int32_t>& col_idx) const
+{
+    const int b = Block_size;
+
+    row_offsets.resize((int64_t)N_rows*b+1);
+    row_offsets[0] = 0;
+    for(int r = 0; r < N_rows; r++)
+    {
+        const int64_t row_length = (int64_t)(Row_offsets[r+1]-Row_offsets[r])*b;
+        for(int i = 0; i < b; i++) row_offsets[(int64_t)r*b+i+1] = row_offsets[(int64_t)r*b+i]+row_length;
+    }
+
+    col_idx.resize(row_offsets.back());
+
+    #pragma omp parallel for schedule(static)
+    for(int r = 0; r < N_rows; r++)
+    {
+        for(int i = 0; i < b; i++)
+        {
+            int64_t pos = row_offsets[(int64_t)r*b+i];
+            for(int j = Row_offsets[r]; j < Row_offsets[r+1]; j++)
+            {
+                for(int c = 0; c < b; c++) col_idx[pos++] = Col_idx[j]*b+c;
+            }
+        }
+    }
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+
+#include "mesh_manager.h"
+
+// Cell-cell matrix pattern of the face graph, rows are non ghost elements in mesh order
+// Boundary faces do not create entries, they contribute to the diagonal only
+class mesh_matrix_pattern
+{
+    private:
+    const mesh_struct& mesh;
+
+    public:
+    int N_rows = 0;
+    int N_internal_faces = 0;
+    int Block_size = 1;                     // Values per entry are Block_size^2, positions are in blocks
+
+    std::vector<int32_t> Element_row;       // Element -> row, -1 for ghosts
+    std::vector<int32_t> Row_element;       // Row -> element
+
+    // CSR, columns sorted in every row
+    std::vector<int32_t> Row_offsets;
+    std::vector<int32_t> Col_idx;
+    std::vector<int32_t> Diag_pos;          // Position of diagonal entry of each row
+
+    // Face -> entry positions, -1 for boundary faces
+    std::vector<int32_t> Face_upper_pos;    // Entry (row of owner, column of neighbour)
+    std::vector<int32_t> Face_lower_pos;    // Entry (row of neighbour, column of owner)
+
+    // LDU addressing, internal faces ordered upper triangular (lower address ascending, then upper)
+    std::vector<int32_t> Lower_addr;        // Smaller row of face
+    std::vector<int32_t> Upper_addr;        // Larger row of face
+    std::vector<int32_t> Ldu_face;          // LDU face -> mesh face
+    std::vector<int32_t> Face_ldu;          // Mesh face -> LDU face, -1 for boundary faces
+    std::vector<int8_t> Face_ldu_sign;      // +1 if mesh owner is the lower address, -1 otherwise
+    std::vector<int32_t> Owner_start;       // LDU faces of row r with lower address r: [Owner_start[r], Owner_start[r+1])
+    std::vector<int32_t> Losort;            // LDU faces sorted by upper address
+    std::vector<int32_t> Losort_start;      // Losort faces of row r with upper address r
+
+    mesh_matrix_pattern(const mesh_struct& _mesh);
+
+    bool build(int block_size = 1);       // False without faces or for block_size < 1
+
+    // Offset of the first value of the block at given position
+    inline int64_t value_offset(int32_t pos) const {return (int64_t)pos*Block_size*Block_size;}
+
+    // Scalar CSR with every block expanded to Block_size x Block_size entries
+    void expanded_csr(std::vector<int64_t>& row_offsets, std::vector<int32_t>& col_idx) const;
+};
@@ -0,0 +1,351 @@
+#include "mesh_median_dual.h"
+#include <algorithm>
+#include <parallel/algorithm>
+
+// Local edges of an element type and the local edge of every face side (face vertex j -> j+1)
+struct dual_element_edges
+{
+    std::vector<std::pair<int,int>> edges;
+    std::vector<std::vector<int>> face_edges;
+};
+
+// Built on first use, element_type_to_faces lives in another translation unit
+static const std::map<int, dual_element_edges>& element_edge_tables()
+{
+    static const std::map<int, dual_element_edges> tables = []
+    {
+        std::map<int, dual_element_edges> tables;
+        for(auto const& [type, faces] : element_type_to_faces)
+        {
+            if(type == 1) continue;     // Lines are only boundary faces
+
+            dual_element_edges& table = tables[type];
+            for(auto const& face : faces)
+            {
+                const int nf = face.size();
+                std::vector<int> sides;
+                for(int j = 0; j < (nf == 2 ? 1 : nf); j++)
+                {
+                    const std::pair<int,int> edge = std::minmax(face[j],face[(j+1)%nf]);
+                    auto it = std::find(table.edges.begin(),table.edges.end(),edge);
+                    sides.push_back(it-table.edges.begin());
+                    if(it == table.edges.end()) table.edges.push_back(edge);
+                }
+                table.face_edges.push_back(sides);
+            }
+        }
+        return tables;
+    }();
+    return tables;
+}
+
+// Sorted vertices of a face
+static dual_face_key face_key(const int32_t* v, int n)
+{
+    dual_face_key key = {-1,-1,-1,-1};
+    for(int j = 0; j < n; j++)
+    {
+        // Insertion sort, at most 4 vertices
+        int k = j;
+        for(; k > 0 && key[k-1] > v[j]; k--) key[k] = key[k-1];
+        key[k] = v[j];
+    }
+    return key;
+}
+
+mesh_median_dual::mesh_median_dual(const mesh_struct& _mesh) : mesh(_mesh){}
+
+// Sorted keys of ghost faces, boundary dual face slots follow the face vertex counts
+void mesh_median_dual::boundary_faces()
+{
+    const int N_boundary = mesh.N_boundary_elements;
+    const int32_t* offsets = mesh.Element_vertices_idx_offsets;
+
+    Boundary_face_offsets.resize(N_boundary+1);
+    Boundary_face_offsets[0] = 0;
+    for(int k = 0; k < N_boundary; k++)
+    {
+        const int g = mesh.Boundary_idxs_array[k];
+        Boundary_face_offsets[k+1] = Boundary_face_offsets[k]+offsets[g+1]-offsets[g]-1;
+    }
+
+    Boundary_nodes.assign(Boundary_face_offsets[N_boundary],-1);
+    Boundary_normal.assign(3*Boundary_face_offsets[N_boundary],0);
+    Boundary_matches.assign(N_boundary,0);
+    Boundary_node.assign(mesh.N_nodes,0);
+    Boundary_keys.resize(N_boundary);
+
+    #pragma omp parallel for schedule(static)
+    for(int k = 0; k < N_boundary; k++)
+    {
+        const int g = mesh.Boundary_idxs_array[k];
+        Boundary_keys[k] = {face_key(&mesh.Element_vertices_idx_array[offsets[g]],offsets[g+1]-offsets[g]-1),k};
+    }
+
+    for(int k = 0; k < N_boundary; k++)
+    {
+        for(auto const node : Boundary_keys[k].first) if(node >= 0) Boundary_node[node] = 1;
+    }
+
+    __gnu_parallel::sort(Boundary_keys.begin(),Boundary_keys.end());
+}
+
+// Ghost k whose face is the given element face, -1 if it is not a boundary face
+int mesh_median_dual::find_boundary_face(const int32_t* v, const std::vector<int>& face) const
+{
+    const int nf = face.size();
+
+    int32_t vertices[4];
+    for(int j = 0; j < nf; j++)
+    {
+        if(!Boundary_node[v[face[j]]]) return -1;
+        vertices[j] = v[face[j]];
+    }
+    const dual_face_key key = face_key(vertices,nf);
+
+    auto it = std::lower_bound(Boundary_keys.begin(),Boundary_keys.end(),std::make_pair(key,(int32_t)-1));
+    return (it != Boundary_keys.end() && it->first == key) ? it->second : -1;
+}
+
+// Dual face area vectors of element edges and dual volume parts of element vertices for elements of one type
+// 2D: segments (edge midpoint, element centroid), volumes from the triangle fan of element geometry
+// 3D: triangles (edge midpoint, face centroid, element centroid), volumes from the face fan tetrahedra,
+// each fan triangle is halved at the edge midpoint between its two vertices
+void mesh_median_dual::element_contributions(const std::vector<int32_t>& elements, int type, double* slot_normal, double* vertex_volume)
+{
+    const dual_element_edges& table = element_edge_tables().at(type);
+    const std::vector<std::vector<int>>& faces = element_type_to_faces.at(type);
+    const double* X = mesh.node_pos_array;
+    const int N_type_elements = elements.size();
+
+    #pragma omp parallel for schedule(static)
+    for(int l = 0; l < N_type_elements; l++)
+    {
+        const int i = elements[l];
+        const int32_t* v = &mesh.Element_vertices_idx_array[mesh.Element_vertices_idx_offsets[i]];
+        const int n = mesh.Element_vertices_idx_offsets[i+1]-mesh.Element_vertices_idx_offsets[i];
+        double* normal = &slot_normal[3*Element_edge_offsets[i]];
+        double* volume = &vertex_volume[mesh.Element_vertices_idx_offsets[i]];
+
+        double c[3] = {0,0,0};
+        for(int j = 0; j < n; j++)
+        {
+            for(int d = 0; d < 3; d++) c[d] += X[3*v[j]+d];
+        }
+        for(int d = 0; d < 3; d++) c[d] /= n;
+
+        for(unsigned int f = 0; f < faces.size(); f++)
+        {
+            const std::vector<int>& face = faces[f];
+            const int nf = face.size();
+            const int k = find_boundary_face(v,face);
+
+            // Matches are counted so that only the first element writes a face found twice
+            bool write_boundary = false;
+            if(k >= 0)
+            {
+                int matches;
+                #pragma omp atomic capture
+                matches = Boundary_matches[k]++;
+                write_boundary = matches == 0;
+            }
+
+            if(mesh.Dimension == 2)
+            {
+                // Edge a->b of counter clockwise element
+                const double* a = &X[3*v[face[0]]];
+                const double* b = &X[3*v[face[1]]];
+                const double A = 0.5*((a[0]-c[0])*(b[1]-c[1])-(a[1]-c[1])*(b[0]-c[0]));
+
+                volume[face[0]] += 0.5*A;
+                volume[face[1]] += 0.5*A;
+
+                const double t[2] = {c[0]-0.5*(a[0]+b[0]),c[1]-0.5*(a[1]+b[1])};
+                const double sign = (v[face[0]] < v[face[1]]) ? 1 : -1;
+                const int e = table.face_edges[f][0];
+
+                normal[3*e] += sign*t[1];
+                normal[3*e+1] -= sign*t[0];
+
+                if(write_boundary)
+                {
+                    const int base = Boundary_face_offsets[k];
+                    for(int j = 0; j < 2; j++)
+                    {
+                        Boundary_nodes[base+j] = v[face[j]];
+                        Boundary_normal[3*(base+j)] = 0.5*(b[1]-a[1]);
+                        Boundary_normal[3*(base+j)+1] = -0.5*(b[0]-a[0]);
+                    }
+                }
+                continue;
+            }
+
+            double fc[3] = {0,0,0};
+            for(int j = 0; j < nf; j++)
+            {
+                for(int d = 0; d < 3; d++) fc[d] += X[3*v[face[j]]+d];
+            }
+            for(int d = 0; d < 3; d++) fc[d] /= nf;
+
+            double St[4][3];        // Fan triangle area vectors
+            for(int j = 0; j < nf; j++)
+            {
+                const double* a = &X[3*v[face[j]]];
+                const double* b = &X[3*v[face[(j+1)%nf]]];
+
+                const double u[3] = {a[0]-fc[0],a[1]-fc[1],a[2]-fc[2]};
+                const double w[3] = {b[0]-fc[0],b[1]-fc[1],b[2]-fc[2]};
+                const double S[3] = {u[1]*w[2]-u[2]*w[1],u[2]*w[0]-u[0]*w[2],u[0]*w[1]-u[1]*w[0]};
+                const double Vt = (S[0]*(fc[0]-c[0])+S[1]*(fc[1]-c[1])+S[2]*(fc[2]-c[2]))/6;
+
+                volume[face[j]] += 0.5*Vt;
+                volume[face[(j+1)%nf]] += 0.5*Vt;
+                for(int d = 0; d < 3; d++) St[j][d] = 0.5*S[d];
+
+                // Dual triangle (m, fc, c), oriented a->b for an outward face
+                const double m[3] = {0.5*(a[0]+b[0]),0.5*(a[1]+b[1]),0.5*(a[2]+b[2])};
+                const double p[3] = {c[0]-m[0],c[1]-m[1],c[2]-m[2]};
+                const double q[3] = {fc[0]-m[0],fc[1]-m[1],fc[2]-m[2]};
+                const double sign = (v[face[j]] < v[face[(j+1)%nf]]) ? 0.5 : -0.5;
+                const int e = table.face_edges[f][j];
+
+                normal[3*e] += sign*(p[1]*q[2]-p[2]*q[1]);
+                normal[3*e+1] += sign*(p[2]*q[0]-p[0]*q[2]);
+                normal[3*e+2] += sign*(p[0]*q[1]-p[1]*q[0]);
+            }
+
+            // Vertex j gets the halves of its two fan triangles
+            if(write_boundary)
+            {
+                const int base = Boundary_face_offsets[k];
+                for(int j = 0; j < nf; j++)
+                {
+                    Boundary_nodes[base+j] = v[face[j]];
+                    for(int d = 0; d < 3; d++) Boundary_normal[3*(base+j)+d] = 0.5*(St[(j+nf-1)%nf][d]+St[j][d]);
+                }
+            }
+        }
+    }
+}
+
+// Element edges become dual edges through a sort of their node pairs, contributions are then summed
+// per dual edge (element edge order) and per node (element vertex order)
+bool mesh_median_dual::build()
+{
+    const auto& tables = element_edge_tables();
+    const int N_elements = mesh.N_elements;
+    const int32_t* offsets = mesh.Element_vertices_idx_offsets;
+    const int32_t* vertices = mesh.Element_vertices_idx_array;
+
+    // Element edge slots, elements grouped by type in mesh order
+    std::map<int,std::vector<int32_t>> type_elements;
+    Element_edge_offsets.assign(N_elements+1,0);
+    for(int i = 0; i < N_elements; i++)
+    {
+        if(mesh.is_boundary_element(i)) continue;
+
+        const int type = mesh.Element_type_array[i];
+        if(!tables.count(type))
+        {
+            mesh.out() << "Median dual: unsupported element type " << type << "\n";
+            return false;
+        }
+        Element_edge_offsets[i+1] = tables.at(type).edges.size();
+        type_elements[type].push_back(i);
+    }
+    for(int i = 0; i < N_elements; i++) Element_edge_offsets[i+1] += Element_edge_offsets[i];
+    const int N_slots = Element_edge_offsets[N_elements];
+
+    // (node pair, slot), equal pairs are one dual edge with slots ascending
+    std::vector<std::pair<uint64_t,int32_t>> slot_keys(N_slots);
+    for(auto const& [type, elements] : type_elements)
+    {
+        const std::vector<std::pair<int,int>>& edges = tables.at(type).edges;
+        const int N_type_elements = elements.size();
+
+        #pragma omp parallel for schedule(static)
+        for(int l = 0; l < N_type_elements; l++)
+        {
+            const int i = elements[l];
+            const int32_t* v = &vertices[offsets[i]];
+            for(unsigned int e = 0; e < edges.size(); e++)
+            {
+                const uint64_t a = std::min(v[edges[e].first],v[edges[e].second]);
+                const uint64_t b = std::max(v[edges[e].first],v[edges[e].second]);
+                slot_keys[Element_edge_offsets[i]+e] = {a << 32 | b,Element_edge_offsets[i]+e};
+            }
+        }
+    }
+    __gnu_parallel::sort(slot_keys.begin(),slot_keys.end());
+
+    Element_edges.resize(N_slots);
+    std::vector<int32_t> edge_start;
+    for(int s = 0; s < N_slots; s++)
+    {
+        if(s == 0 || slot_keys[s].first != slot_keys[s-1].first) edge_start.push_back(s);
+        Element_edges[slot_keys[s].second] = edge_start.size()-1;
+    }
+    N_edges = edge_start.size();
+    edge_start.push_back(N_slots);
+
+    Edge_nodes.resize(2*N_edges);
+
+    #pragma omp parallel for schedule(static)
+    for(int e = 0; e < N_edges; e++)
+    {
+        const uint64_t key = slot_keys[edge_start[e]].first;
+        Edge_nodes[2*e] = key >> 32;
+        Edge_nodes[2*e+1] = key & 0xffffffff;
+    }
+
+    // Element pass, every element writes only its own slots and vertices
+    boundary_faces();
+    std::vector<double> slot_normal(3*N_slots,0), vertex_volume(mesh.N_element_vertices,0);
+    for(auto const& [type, elements] : type_elements) element_contributions(elements,type,slot_normal.data(),vertex_volume.data());
+
+    const int N_unmatched = std::count_if(Boundary_matches.begin(),Boundary_matches.end(),[](int32_t m){return m != 1;});
+
+    Boundary_keys.clear();
+    Boundary_node.clear();
+    Boundary_matches.clear();
+
+    if(N_unmatched > 0)
+    {
+        mesh.out() << "Median dual: " << N_unmatched << " boundary faces are not the face of exactly one element\n";
+        return false;
+    }
+
+    // Fixed order sums
+    Edge_normal.resize(3*N_edges);
+
+    #pragma omp parallel for schedule(static)
+    for(int e = 0; e < N_edges; e++)
+    {
+        double S[3] = {0,0,0};
+        for(int s = edge_start[e]; s < edge_start[e+1]; s++)
+        {
+            for(int d = 0; d < 3; d++) S[d] += slot_normal[3*slot_keys[s].second+d];
+        }
+        for(int d = 0; d < 3; d++) Edge_normal[3*e+d] = S[d];
+    }
+
+    std::vector<int32_t> node_offsets(mesh.N_nodes+1,0), node_vertices(mesh.N_element_vertices);
+    for(int j = 0; j < mesh.N_element_vertices; j++) node_offsets[vertices[j]+1]++;
+    for(int k = 0; k < mesh.N_nodes; k++) node_offsets[k+1] += node_offsets[k];
+
+    std::vector<int32_t> fill(node_offsets.begin(),node_offsets.end()-1);
+    for(int j = 0; j < mesh.N_element_vertices; j++) node_vertices[fill[vertices[j]]++] = j;
+
+    Node_volume.resize(mesh.N_nodes);
+
+    #pragma omp parallel for schedule(static)
+    for(int k = 0; k < mesh.N_nodes; k++)
+    {
+        double V = 0;
+        for(int j = node_offsets[k]; j < node_offsets[k+1]; j++) V += vertex_volume[node_vertices[j]];
+        Node_volume[k] = V;
+    }
+
+    mesh.out() << "Median dual:\t" << N_edges << " edges, " << Boundary_face_offsets[mesh.N_boundary_elements] << " boundary dual faces\n";
+    return true;
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include <vector>
+#include <array>
+#include <cstdint>
+
+#include "mesh_manager.h"
+
+typedef std::array<int32_t,4> dual_face_key;      // Sorted face vertices, unused entries -1
+
+// Median-dual control volumes of mesh nodes, built from element connectivity only (no face graph)
+// Inside each element the dual face of edge (a,b) is made of triangles (edge midpoint, face centroid,
+// element centroid) of the two element faces sharing the edge, centroids are vertex averages as in element geometry
+// Contributions are written per element edge / element vertex and summed in a fixed order,
+// results do not depend on the number of threads
+class mesh_median_dual
+{
+    private:
+    const mesh_struct& mesh;
+
+    // Build scratch
+    std::vector<std::pair<dual_face_key,int32_t>> Boundary_keys;   // (key, ghost k) of boundary faces, sorted
+    std::vector<uint8_t> Boundary_node;                             // Nodes of boundary faces, only their element faces are looked up
+    std::vector<int32_t> Boundary_matches;                          // Elements found for each boundary face, 1 if the mesh is closed
+
+    void boundary_faces();
+    int find_boundary_face(const int32_t* v, const std::vector<int>& face) const;
+    void element_contributions(const std::vector<int32_t>& elements, int type, double* slot_normal, double* vertex_volume);
+
+    public:
+    int N_edges = 0;
+
+    // Dual edges, node pairs (a < b) in ascending order
+    std::vector<int32_t> Edge_nodes;
+    std::vector<double> Edge_normal;            // Dual face area vector, oriented a -> b
+
+    // Element edges, local edge order of the element type
+    std::vector<int32_t> Element_edge_offsets;  // Where edges of each element start (none for ghosts)
+    std::vector<int32_t> Element_edges;         // Dual edge of each element edge
+
+    std::vector<double> Node_volume;            // Dual volume (area in 2D) of every node, 0 for ghost and unused nodes
+
+    // Boundary dual faces, one per vertex of each boundary face (ghost element k in Boundary_idxs_array order)
+    std::vector<int32_t> Boundary_face_offsets; // Where dual faces of boundary face k start
+    std::vector<int32_t> Boundary_nodes;        // Node of each boundary dual face, outward vertex order of the face
+    std::vector<double> Boundary_normal;        // Outward area vector
+
+    mesh_median_dual(const mesh_struct& _mesh);
+
+    // False if boundary faces do not match element faces (the dual is then not closed)
+    bool build();
+};
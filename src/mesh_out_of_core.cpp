@@ -0,0 +1,289 @@
+#include "mesh_out_of_core.h"
+#include "mesh_manager.h"
+
+#include <map>
+#include <mutex>
+#include <unistd.h>
+#include <sys/mman.h>
+
+// Mapped arrays and their lengths, shared by all meshes
+static std::map<void*,size_t> mapped_arrays;
+static std::mutex mapped_arrays_mutex;
+
+void* mesh_malloc(size_t bytes, const out_of_core_settings& ooc)
+{
+    if(!ooc.enabled || bytes < OOC_MIN_MAPPED_BYTES) return malloc(bytes);
+
+    // Scratch file problems fall back to (zeroed) heap memory instead of stopping the process
+    std::string path = ooc.scratch_dir+"/mesh_scratch_XXXXXX";
+    const int fd = mkstemp(path.data());
+    if(fd < 0) return calloc(bytes,1);
+    unlink(path.c_str());
+
+    if(ftruncate(fd,bytes) != 0)
+    {
+        close(fd);
+        return calloc(bytes,1);
+    }
+
+    void* p = mmap(nullptr,bytes,PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+    close(fd);
+    if(p == MAP_FAILED) return calloc(bytes,1);
+
+    std::lock_guard<std::mutex> lock(mapped_arrays_mutex);
+    mapped_arrays[p] = bytes;
+    return p;
+}
+
+void mesh_free(void* p)
+{
+    if(p == nullptr) return;
+
+    {
+        std::lock_guard<std::mutex> lock(mapped_arrays_mutex);
+        auto it = mapped_arrays.find(p);
+        if(it != mapped_arrays.end())
+        {
+            munmap(p,it->second);
+            mapped_arrays.erase(it);
+            return;
+        }
+    }
+    free(p);
+}
+
+void mesh_advise_sequential(void* p, size_t bytes)
+{
+    std::lock_guard<std::mutex> lock(mapped_arrays_mutex);
+    if(mapped_arrays.count(p)) madvise(p,bytes,MADV_SEQUENTIAL);
+}
+
+// One element face, key holds the sorted face vertices padded with UINT32_MAX
+struct face_record
+{
+    uint32_t key[4];
+    int32_t element;
+    int32_t local_face;
+};
+
+// Face between elements lo < hi, owner is lo unless lo is a ghost
+struct face_pair_record
+{
+    uint32_t lo, hi;
+    int32_t owner_local_face;
+    int32_t owner_is_lo;
+};
+
+void external_construct_faces(mesh_struct& mesh, const out_of_core_settings& ooc)
+{
+    const int32_t* offsets = mesh.Element_vertices_idx_offsets;
+    const int32_t* vertices = mesh.Element_vertices_idx_array;
+
+    // Element faces, ghosts contribute their face without the ghost node
+    size_t N_records = 0;
+    for(int i = 0; i < mesh.N_elements; i++)
+    {
+        N_records += mesh.is_boundary_element(i) ? 1 : element_type_to_faces.at(mesh.Element_type_array[i]).size();
+    }
+
+    scratch_array<face_record> records(N_records,ooc);
+    mesh_advise_sequential(records.data,N_records*sizeof(face_record));
+
+    size_t k = 0;
+    for(int i = 0; i < mesh.N_elements; i++)
+    {
+        auto emit = [&](const int32_t* v, int N_v, int local_face)
+        {
+            face_record& r = records[k++];
+            for(int j = 0; j < 4; j++) r.key[j] = (j < N_v) ? v[j] : UINT32_MAX;
+            std::sort(r.key,r.key+N_v);
+            r.element = i;
+            r.local_face = local_face;
+        };
+
+        if(mesh.is_boundary_element(i))
+        {
+            emit(&vertices[offsets[i]],offsets[i+1]-offsets[i]-1,0);
+            continue;
+        }
+
+        auto const& faces = element_type_to_faces.at(mesh.Element_type_array[i]);
+        for(unsigned int f = 0; f < faces.size(); f++)
+        {
+            int32_t v[4];
+            for(unsigned int j = 0; j < faces[f].size(); j++) v[j] = vertices[offsets[i]+faces[f][j]];
+            emit(v,faces[f].size(),f);
+        }
+    }
+
+    external_sort(records.data,N_records,[](const face_record& a, const face_record& b)
+    {
+        return std::lexicographical_compare(a.key,a.key+4,b.key,b.key+4);
+    },ooc);
+
+    // Matching keys are faces
+    size_t N_faces = 0;
+    for(size_t r = 0; r+1 < N_records; r++)
+    {
+        if(std::equal(records[r].key,records[r].key+4,records[r+1].key)){N_faces++; r++;}
+    }
+
+    scratch_array<face_pair_record> pairs(N_faces,ooc);
+    size_t f = 0;
+    for(size_t r = 0; r+1 < N_records; r++)
+    {
+        if(!std::equal(records[r].key,records[r].key+4,records[r+1].key)) continue;
+
+        const face_record& a = (records[r].element < records[r+1].element) ? records[r] : records[r+1];
+        const face_record& b = (records[r].element < records[r+1].element) ? records[r+1] : records[r];
+        const bool owner_is_lo = !mesh.is_boundary_element(a.element);
+
+        pairs[f++] = face_pair_record{(uint32_t)a.element,(uint32_t)b.element,owner_is_lo ? a.local_face : b.local_face,owner_is_lo};
+        r++;
+    }
+
+    // Same face order as the dual graph construction (pairs ascending)
+    external_sort(pairs.data,N_faces,[](const face_pair_record& a, const face_pair_record& b)
+    {
+        return (a.lo < b.lo) || (a.lo == b.lo && a.hi < b.hi);
+    },ooc);
+
+    mesh.N_faces = N_faces;
+    mesh.Face_ON_idx = (uint32_t*)mesh_malloc(2*N_faces*sizeof(uint32_t),ooc);
+    mesh.Face_vertices_idx_offsets = (uint32_t*)mesh_malloc((N_faces+1)*sizeof(uint32_t),ooc);
+
+    mesh.Face_vertices_idx_offsets[0] = 0;
+    for(size_t i = 0; i < N_faces; i++)
+    {
+        const uint32_t owner = pairs[i].owner_is_lo ? pairs[i].lo : pairs[i].hi;
+        mesh.Face_ON_idx[2*i] = owner;
+        mesh.Face_ON_idx[2*i+1] = pairs[i].owner_is_lo ? pairs[i].hi : pairs[i].lo;
+        mesh.Face_vertices_idx_offsets[i+1] = mesh.Face_vertices_idx_offsets[i]+
+                                              element_type_to_faces.at(mesh.Element_type_array[owner])[pairs[i].owner_local_face].size();
+    }
+
+    mesh.Face_vertices_idx_array = (uint32_t*)mesh_malloc(mesh.Face_vertices_idx_offsets[N_faces]*sizeof(uint32_t),ooc);
+
+    #pragma omp parallel for schedule(static)
+    for(size_t i = 0; i < N_faces; i++)
+    {
+        const uint32_t owner = mesh.Face_ON_idx[2*i];
+        uint32_t j = mesh.Face_vertices_idx_offsets[i];
+
+        for(auto const v : element_type_to_faces.at(mesh.Element_type_array[owner])[pairs[i].owner_local_face])
+        {
+            mesh.Face_vertices_idx_array[j++] = vertices[offsets[owner]+v];
+        }
+    }
+}
+
+// Use of a node at a vertex slot, key orders first use (real element slots) before everything else
+struct node_slot_record
+{
+    uint32_t node;
+    uint64_t key;
+    uint64_t slot;      // Element vertex slot, face vertex slots follow, UINT64_MAX for the per node entry
+};
+
+struct node_key_record
+{
+    uint64_t key;
+    uint32_t node;
+    uint32_t new_idx;
+};
+
+struct slot_record
+{
+    uint64_t slot;
+    uint32_t new_idx;
+};
+
+struct node_pos_record
+{
+    uint32_t new_idx;
+    double x[3];
+};
+
+void external_renumber_nodes(mesh_struct& mesh, bool renumber_faces, const out_of_core_settings& ooc)
+{
+    const uint64_t N_element_slots = mesh.N_element_vertices;
+    const uint64_t N_face_slots = renumber_faces ? mesh.Face_vertices_idx_offsets[mesh.N_faces] : 0;
+    const uint64_t N_slots = N_element_slots+N_face_slots;
+    const uint64_t unused = N_element_slots;   // Keys of nodes after all first uses, in old order
+
+    // Every slot and one entry per node (nodes without elements)
+    scratch_array<node_slot_record> uses(N_slots+mesh.N_nodes,ooc);
+    size_t k = 0;
+    for(int i = 0; i < mesh.N_elements; i++)
+    {
+        const bool ghost = mesh.is_boundary_element(i);
+        for(int j = mesh.Element_vertices_idx_offsets[i]; j < mesh.Element_vertices_idx_offsets[i+1]; j++)
+        {
+            const uint32_t node = mesh.Element_vertices_idx_array[j];
+            uses[k++] = node_slot_record{node,ghost ? unused+node : (uint64_t)j,(uint64_t)j};
+        }
+    }
+    for(uint64_t j = 0; j < N_face_slots; j++)
+    {
+        const uint32_t node = mesh.Face_vertices_idx_array[j];
+        uses[k++] = node_slot_record{node,unused+node,N_element_slots+j};
+    }
+    for(int node = 0; node < mesh.N_nodes; node++)
+    {
+        uses[k++] = node_slot_record{(uint32_t)node,unused+node,UINT64_MAX};
+    }
+
+    external_sort(uses.data,uses.N,[](const node_slot_record& a, const node_slot_record& b)
+    {
+        return (a.node < b.node) || (a.node == b.node && a.key < b.key);
+    },ooc);
+
+    // First use of each node, rank of first use is the new index
+    scratch_array<node_key_record> first_use(mesh.N_nodes,ooc);
+    k = 0;
+    for(size_t u = 0; u < uses.N; u++)
+    {
+        if(u == 0 || uses[u].node != uses[u-1].node) first_use[k++] = node_key_record{uses[u].key,uses[u].node,0};
+    }
+
+    external_sort(first_use.data,first_use.N,[](const node_key_record& a, const node_key_record& b){return a.key < b.key;},ooc);
+    for(int i = 0; i < mesh.N_nodes; i++) first_use[i].new_idx = i;
+    external_sort(first_use.data,first_use.N,[](const node_key_record& a, const node_key_record& b){return a.node < b.node;},ooc);
+
+    // Node coordinates in new order
+    {
+        scratch_array<node_pos_record> positions(mesh.N_nodes,ooc);
+        for(int i = 0; i < mesh.N_nodes; i++)
+        {
+            positions[i].new_idx = first_use[i].new_idx;
+            for(int d = 0; d < 3; d++) positions[i].x[d] = mesh.node_pos_array[3*i+d];
+        }
+
+        external_sort(positions.data,positions.N,[](const node_pos_record& a, const node_pos_record& b){return a.new_idx < b.new_idx;},ooc);
+
+        for(int i = 0; i < mesh.N_nodes; i++)
+        {
+            for(int d = 0; d < 3; d++) mesh.node_pos_array[3*i+d] = positions[i].x[d];
+        }
+    }
+
+    if(!mesh.Node_global_idx.empty())
+    {
+        std::vector<int32_t> global_idx(mesh.N_nodes);
+        for(int i = 0; i < mesh.N_nodes; i++) global_idx[first_use[i].new_idx] = mesh.Node_global_idx[i];
+        mesh.Node_global_idx = global_idx;
+    }
+
+    // New indices of all slots, written back in slot order
+    scratch_array<slot_record> slots(N_slots,ooc);
+    k = 0;
+    for(size_t u = 0; u < uses.N; u++)
+    {
+        if(uses[u].slot != UINT64_MAX) slots[k++] = slot_record{uses[u].slot,first_use[uses[u].node].new_idx};
+    }
+
+    external_sort(slots.data,slots.N,[](const slot_record& a, const slot_record& b){return a.slot < b.slot;},ooc);
+
+    for(uint64_t j = 0; j < N_element_slots; j++) mesh.Element_vertices_idx_array[j] = slots[j].new_idx;
+    for(uint64_t j = 0; j < N_face_slots; j++) mesh.Face_vertices_idx_array[j] = slots[N_element_slots+j].new_idx;
+}
@@ -0,0 +1,89 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <queue>
+
+#define OOC_MIN_MAPPED_BYTES (1 << 20)  // Smaller arrays always stay on the heap
+
+struct mesh_struct;
+
+// Out of core mode, large arrays live in memory mapped scratch files and sorts run in RAM budget sized passes
+struct out_of_core_settings
+{
+    bool enabled = false;
+    size_t ram_budget = (size_t)1 << 30;    // Bytes of records sorted in memory at once
+    std::string scratch_dir = "temp/";      // Scratch files are unlinked right after creation
+};
+
+// Mesh array allocation, mapped to a scratch file for large arrays in out of core mode, memory is zeroed when mapped
+void* mesh_malloc(size_t bytes, const out_of_core_settings& ooc);
+void mesh_free(void* p);    // Works for both mapped and malloc'd arrays
+
+// Advises sequential access of a mapped range (no-op for heap arrays)
+void mesh_advise_sequential(void* p, size_t bytes);
+
+// Owning record buffer for sort passes
+template<typename T>
+class scratch_array
+{
+    public:
+    T* data = nullptr;
+    size_t N = 0;
+
+    scratch_array(size_t _N, const out_of_core_settings& ooc) : data((T*)mesh_malloc(std::max(_N,(size_t)1)*sizeof(T),ooc)), N(_N){}
+    ~scratch_array(){mesh_free(data);}
+    scratch_array(const scratch_array&) = delete;
+    scratch_array& operator=(const scratch_array&) = delete;
+
+    T& operator[](size_t i){return data[i];}
+    const T& operator[](size_t i) const {return data[i];}
+};
+
+// Sorts runs of ram_budget bytes in memory, then merges them through a scratch buffer with sequential reads and writes
+template<typename T, typename C>
+void external_sort(T* data, size_t N, C less, const out_of_core_settings& ooc)
+{
+    const size_t run = std::max(ooc.ram_budget/sizeof(T),(size_t)1024);
+
+    if(!ooc.enabled || N <= run)
+    {
+        std::sort(data,data+N,less);
+        return;
+    }
+
+    mesh_advise_sequential(data,N*sizeof(T));
+
+    const size_t N_runs = (N+run-1)/run;
+    for(size_t r = 0; r < N_runs; r++) std::sort(data+r*run,data+std::min(N,(r+1)*run),less);
+
+    // K-way merge, heap holds the current head of each run
+    std::vector<size_t> head(N_runs), end(N_runs);
+    for(size_t r = 0; r < N_runs; r++){head[r] = r*run; end[r] = std::min(N,(r+1)*run);}
+
+    auto greater = [&](size_t a, size_t b){return less(data[head[b]],data[head[a]]);};
+    std::priority_queue<size_t,std::vector<size_t>,decltype(greater)> heads(greater);
+    for(size_t r = 0; r < N_runs; r++) heads.push(r);
+
+    scratch_array<T> merged(N,ooc);
+    mesh_advise_sequential(merged.data,N*sizeof(T));
+
+    for(size_t i = 0; i < N; i++)
+    {
+        const size_t r = heads.top();
+        heads.pop();
+
+        merged[i] = data[head[r]++];
+        if(head[r] < end[r]) heads.push(r);
+    }
+
+    std::memcpy(data,merged.data,N*sizeof(T));
+}
+
+// Face construction by sorting element face keys, replaces the METIS dual graph in out of core mode
+void external_construct_faces(mesh_struct& mesh, const out_of_core_settings& ooc);
+
+// First use node ordering (same result as mesh_manager::renumber_nodes) with sort passes instead of random access
+void external_renumber_nodes(mesh_struct& mesh, bool renumber_faces, const out_of_core_settings& ooc);
@@ -0,0 +1,311 @@
+#include "mesh_profiler.h"
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <algorithm>
+#include <cstring>
+#include <omp.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#define N_COUNTERS 4
+#define CACHE_LINE 64
+
+#ifdef __linux__
+static const uint64_t counter_configs[N_COUNTERS] = {PERF_COUNT_HW_CPU_CYCLES,
+                                                     PERF_COUNT_HW_INSTRUCTIONS,
+                                                     PERF_COUNT_HW_CACHE_REFERENCES,
+                                                     PERF_COUNT_HW_CACHE_MISSES};
+
+// User space counter of the calling thread, counting from now on, joins the group of group_fd (-1 opens a leader)
+static int open_counter(uint64_t config, int group_fd)
+{
+    perf_event_attr attr;
+    std::memset(&attr,0,sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    return syscall(SYS_perf_event_open,&attr,0,-1,group_fd,0);
+}
+#endif
+
+kernel_profiler::kernel_profiler()
+{
+    open_counters();
+}
+
+kernel_profiler::~kernel_profiler()
+{
+#ifdef __linux__
+    for(auto& fds : thread_fds)
+    {
+        for(auto fd : fds) if(fd >= 0) close(fd);
+    }
+#endif
+}
+
+// Every thread of the OpenMP team opens its own group, the first counter that opens leads it
+// A counter is kept only if all threads have it, groups are reopened until they all hold the same counters
+void kernel_profiler::open_counters()
+{
+#ifdef __linux__
+    std::vector<int> wanted;
+    for(int c = 0; c < N_COUNTERS; c++) wanted.push_back(c);
+
+    while(!wanted.empty())
+    {
+        #pragma omp parallel
+        {
+            #pragma omp single
+            thread_fds.assign(omp_get_num_threads(),std::vector<int>(N_COUNTERS,-1));
+
+            std::vector<int>& fds = thread_fds[omp_get_thread_num()];
+            int leader = -1;
+            for(auto c : wanted)
+            {
+                fds[c] = open_counter(counter_configs[c],leader);
+                if(leader < 0) leader = fds[c];
+            }
+        }
+
+        std::vector<int> common;
+        for(auto c : wanted)
+        {
+            bool everywhere = true;
+            for(auto& fds : thread_fds) everywhere = everywhere && fds[c] >= 0;
+            if(everywhere) common.push_back(c);
+        }
+        if(common.size() == wanted.size()) break;
+
+        for(auto& fds : thread_fds)
+        {
+            for(auto& fd : fds)
+            {
+                if(fd >= 0) close(fd);
+                fd = -1;
+            }
+        }
+        wanted = common;
+    }
+
+    group_counters = wanted;
+    N_counters = group_counters.size();
+#endif
+}
+
+// Totals over threads, each group is read at once so all its counters cover the same scheduled time
+// Values are scaled by enabled/running time when the kernel multiplexed the groups
+void kernel_profiler::read(int64_t* values) const
+{
+    for(int c = 0; c < N_COUNTERS; c++) values[c] = -1;
+    if(N_counters == 0) return;
+
+#ifdef __linux__
+    for(auto c : group_counters) values[c] = 0;
+
+    for(auto& fds : thread_fds)
+    {
+        uint64_t data[3+N_COUNTERS];      // number of counters, time enabled, time running, values in group order
+        const ssize_t size = (3+N_counters)*sizeof(uint64_t);
+        if(::read(fds[group_counters[0]],data,size) != size || data[0] != (uint64_t)N_counters)
+        {
+            for(auto c : group_counters) values[c] = -1;
+            continue;
+        }
+
+        for(int j = 0; j < N_counters; j++)
+        {
+            const int c = group_counters[j];
+            if(values[c] < 0) continue;
+
+            values[c] += (data[2] > 0 && data[2] < data[1]) ? (int64_t)((double)data[3+j]*data[1]/data[2]) : (int64_t)data[3+j];
+        }
+    }
+#endif
+}
+
+void kernel_profiler::add(const std::string& name, double seconds, double bytes, double flops, const int64_t* counter_delta)
+{
+    auto it = record_idx.find(name);
+    if(it == record_idx.end())
+    {
+        it = record_idx.emplace(name,records.size()).first;
+        records.emplace_back();
+        records.back().name = name;
+    }
+
+    kernel_record& record = records[it->second];
+    record.N_calls++;
+    record.seconds += seconds;
+    record.bytes += bytes;
+    record.flops += flops;
+
+    int64_t* totals[N_COUNTERS] = {&record.cycles,&record.instructions,&record.cache_references,&record.cache_misses};
+    for(int c = 0; c < N_COUNTERS; c++)
+    {
+        if(counter_delta[c] < 0 || *totals[c] < 0) *totals[c] = -1;
+        else *totals[c] += counter_delta[c];
+    }
+}
+
+void kernel_profiler::reset()
+{
+    records.clear();
+    record_idx.clear();
+}
+
+// Best of several runs of a parallel triad (STREAM convention, write allocation not counted)
+// and of independent multiply-add chains that the compiler can vectorize
+void kernel_profiler::measure_peaks(size_t bytes)
+{
+    const int64_t n = bytes/(3*sizeof(double));
+    std::unique_ptr<double[]> a(new double[n]), b(new double[n]), c(new double[n]);
+
+    // First touch by the threads that stream the data
+    #pragma omp parallel for schedule(static)
+    for(int64_t i = 0; i < n; i++){a[i] = 0; b[i] = 1; c[i] = 2;}
+
+    peak_bandwidth = 0;
+    for(int r = 0; r < 5; r++)
+    {
+        const double start = omp_get_wtime();
+
+        #pragma omp parallel for schedule(static)
+        for(int64_t i = 0; i < n; i++) a[i] = b[i]+3.0*c[i];
+
+        peak_bandwidth = std::max(peak_bandwidth,3*sizeof(double)*n/(omp_get_wtime()-start));
+    }
+
+    const int N_chains = 32, N_iterations = 1 << 22;
+    double sink = 0;
+    int N_threads = 1;
+
+    peak_flops = 0;
+    for(int r = 0; r < 3; r++)
+    {
+        const double start = omp_get_wtime();
+
+        #pragma omp parallel reduction(+:sink)
+        {
+            #pragma omp single
+            N_threads = omp_get_num_threads();
+
+            double x[N_chains];
+            for(int k = 0; k < N_chains; k++) x[k] = 1+k*1e-3;
+
+            for(int it = 0; it < N_iterations; it++)
+            {
+                for(int k = 0; k < N_chains; k++) x[k] = x[k]*0.999999+1e-6;
+            }
+            for(int k = 0; k < N_chains; k++) sink += x[k];
+        }
+
+        peak_flops = std::max(peak_flops,2.0*N_chains*N_iterations*N_threads/(omp_get_wtime()-start));
+    }
+
+    // Keeps the chains from being optimized away
+    if(sink == 0 && a[0] == 0) peak_flops = 0;
+}
+
+// Bandwidth and arithmetic intensity of each kernel against the bandwidth and compute ceilings
+// A kernel is memory bound when its intensity is below the ridge point peak_flops/peak_bandwidth
+void kernel_profiler::report(std::ostream& out) const
+{
+    const double ridge = (peak_bandwidth > 0) ? peak_flops/peak_bandwidth : 0;
+
+    out << "Kernel profile, " << counted_threads() << " counted threads";
+    if(!counters_available()) out << ", hardware counters not available";
+    out << "\n";
+    if(peak_bandwidth > 0) out << "Ceilings:\t" << peak_bandwidth*1e-9 << " GB/s, " << peak_flops*1e-9 << " GFlop/s, ridge " << ridge << " flop/B\n";
+
+    const std::ios::fmtflags flags = out.flags();
+    const std::streamsize precision = out.precision();
+    out << std::fixed << std::setprecision(2);
+
+    out << std::left << std::setw(20) << "kernel" << std::right
+        << std::setw(7) << "calls" << std::setw(11) << "time [ms]" << std::setw(9) << "GB/s"
+        << std::setw(9) << "flop/B" << std::setw(10) << "GFlop/s" << std::setw(7) << "IPC"
+        << std::setw(8) << "miss %" << std::setw(10) << "LLC GB/s" << std::setw(9) << "bound" << std::setw(8) << "% roof" << "\n";
+
+    for(auto const& k : records)
+    {
+        const double bandwidth = (k.seconds > 0) ? k.bytes/k.seconds : 0;
+        const double intensity = (k.bytes > 0) ? k.flops/k.bytes : 0;
+        const double flop_rate = (k.seconds > 0) ? k.flops/k.seconds : 0;
+
+        out << std::left << std::setw(20) << k.name << std::right
+            << std::setw(7) << k.N_calls << std::setw(11) << k.seconds*1e3 << std::setw(9) << bandwidth*1e-9;
+
+        if(k.flops > 0) out << std::setw(9) << intensity << std::setw(10) << flop_rate*1e-9;
+        else out << std::setw(9) << "-" << std::setw(10) << "-";
+
+        if(k.cycles > 0 && k.instructions >= 0) out << std::setw(7) << (double)k.instructions/k.cycles;
+        else out << std::setw(7) << "-";
+
+        if(k.cache_references > 0 && k.cache_misses >= 0) out << std::setw(8) << 100.0*k.cache_misses/k.cache_references;
+        else out << std::setw(8) << "-";
+
+        if(k.cache_misses >= 0 && k.seconds > 0) out << std::setw(10) << (double)k.cache_misses*CACHE_LINE/k.seconds*1e-9;
+        else out << std::setw(10) << "-";
+
+        // Kernels without a flop estimate are placed against the bandwidth ceiling only
+        if(peak_bandwidth > 0)
+        {
+            const bool memory_bound = k.flops == 0 || intensity < ridge;
+            const double fraction = memory_bound ? bandwidth/peak_bandwidth : flop_rate/peak_flops;
+            out << std::setw(9) << (memory_bound ? "memory" : "compute") << std::setw(8) << 100*fraction;
+        }
+        else out << std::setw(9) << "-" << std::setw(8) << "-";
+
+        out << "\n";
+    }
+
+    out.flags(flags);
+    out.precision(precision);
+}
+
+bool kernel_profiler::write_csv(const std::string& file_path) const
+{
+    std::ofstream stream(file_path);
+    if(!stream) return false;
+
+    stream << "kernel,calls,seconds,bytes,flops,cycles,instructions,cache_references,cache_misses,peak_bandwidth,peak_flops\n";
+    stream << std::setprecision(10);
+    for(auto const& k : records)
+    {
+        stream << k.name << "," << k.N_calls << "," << k.seconds << "," << k.bytes << "," << k.flops << ","
+               << k.cycles << "," << k.instructions << "," << k.cache_references << "," << k.cache_misses << ","
+               << peak_bandwidth << "," << peak_flops << "\n";
+    }
+
+    return (bool)stream;
+}
+
+kernel_scope::kernel_scope(kernel_profiler* _profiler, const std::string& _name, double _bytes, double _flops)
+                          : profiler(_profiler), name(_name), bytes(_bytes), flops(_flops)
+{
+    if(!profiler) return;
+
+    profiler->read(counters);
+    start = omp_get_wtime();
+}
+
+kernel_scope::~kernel_scope()
+{
+    if(!profiler) return;
+
+    const double seconds = omp_get_wtime()-start;
+    int64_t end[N_COUNTERS];
+    profiler->read(end);
+
+    for(int c = 0; c < N_COUNTERS; c++) end[c] = (end[c] >= 0 && counters[c] >= 0) ? end[c]-counters[c] : -1;
+    profiler->add(name,seconds,bytes,flops,end);
+}
@@ -0,0 +1,95 @@
+#pragma once
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <cstdint>
+
+// Accumulated measurements of one named kernel
+struct kernel_record
+{
+    std::string name;
+    int N_calls = 0;
+    double seconds = 0;
+    double bytes = 0;               // Compulsory traffic derived from array sizes
+    double flops = 0;               // Estimated floating point operations, 0 if not given
+
+    // Hardware counters summed over OpenMP threads, -1 if not available
+    int64_t cycles = 0;
+    int64_t instructions = 0;
+    int64_t cache_references = 0;
+    int64_t cache_misses = 0;       // Last level cache misses (64 B lines)
+};
+
+// Counters of named kernels read through perf_event_open, one counter group per OpenMP thread
+// Counters of a group are scheduled together, so ratios (IPC, miss rate) are taken over the same intervals
+// Groups are opened on the calling thread and on the threads of its OpenMP team, so kernels
+// must run on the thread that created the profiler with at most the team size seen at creation
+// Without perf events (paranoid setting, container, non Linux) only times and bytes are recorded
+class kernel_profiler
+{
+    private:
+    std::vector<std::vector<int>> thread_fds;       // Counter fds of each OpenMP thread, -1 for dropped counters
+    std::vector<int> group_counters;                // Counters in group order (leader first), same for all threads
+    int N_counters = 0;
+
+    std::vector<kernel_record> records;             // In order of first use
+    std::map<std::string,int> record_idx;
+
+    double peak_bandwidth = 0;      // B/s
+    double peak_flops = 0;          // flop/s
+
+    void open_counters();
+
+    public:
+    kernel_profiler();
+    ~kernel_profiler();
+    kernel_profiler(const kernel_profiler&) = delete;
+    kernel_profiler& operator=(const kernel_profiler&) = delete;
+
+    bool counters_available() const {return N_counters > 0;}
+    int counted_threads() const {return thread_fds.size();}
+
+    // Current counter totals {cycles, instructions, cache references, cache misses}, -1 if not available
+    void read(int64_t* values) const;
+    void add(const std::string& name, double seconds, double bytes, double flops, const int64_t* counter_delta);
+
+    // Roofline ceilings, measured (triad bandwidth, independent multiply-add chains) or given
+    void measure_peaks(size_t bytes = 3*(size_t(64) << 20));
+    void set_peaks(double bandwidth, double flops){peak_bandwidth = bandwidth; peak_flops = flops;}
+
+    // Runs kernel() once as a named kernel
+    template<typename F>
+    void run(const std::string& name, double bytes, double flops, F&& kernel);
+
+    const std::vector<kernel_record>& kernels() const {return records;}
+    void reset();
+
+    void report(std::ostream& out = std::cout) const;       // Roofline table
+    bool write_csv(const std::string& file_path) const;
+};
+
+// Measures the enclosing scope as one call of a named kernel, does nothing without a profiler
+// Scopes may nest, each one reports its own total
+class kernel_scope
+{
+    private:
+    kernel_profiler* profiler;
+    std::string name;
+    double bytes, flops;
+    double start;
+    int64_t counters[4];        // Totals at scope entry
+
+    public:
+    kernel_scope(kernel_profiler* _profiler, const std::string& _name, double _bytes = 0, double _flops = 0);
+    ~kernel_scope();
+
+    void traffic(double _bytes, double _flops = 0){bytes = _bytes; flops = _flops;}     // Once sizes are known (e.g. outputs)
+};
+
+template<typename F>
+void kernel_profiler::run(const std::string& name, double bytes, double flops, F&& kernel)
+{
+    kernel_scope scope(this,name,bytes,flops);
+    kernel();
+}
@@ -0,0 +1,196 @@
+#include "mesh_quality.h"
+#include <algorithm>
+#include <numeric>
+#include <math.h>
+#include <omp.h>
+
+mesh_quality::mesh_quality(const mesh_struct& _mesh) : mesh(_mesh){}
+
+quality_histogram mesh_quality::make_histogram(const std::string& name, const std::vector<double>& values, double min, double max, int N_bins) const
+{
+    quality_histogram histogram;
+    histogram.name = name;
+    histogram.min = min;
+    histogram.max = max;
+    histogram.counts.assign(N_bins,0);
+
+    const int N = values.size();
+    const double scale = N_bins/(max-min);
+
+    #pragma omp parallel
+    {
+        std::vector<int64_t> local(N_bins,0);
+
+        #pragma omp for schedule(static) nowait
+        for(int i = 0; i < N; i++)
+        {
+            // Clamped before the cast, huge and non finite values (degenerate elements) go to the last bin
+            const double x = (values[i]-min)*scale;
+            const int bin = (x < N_bins-1) ? (int)std::max(x,0.0) : N_bins-1;
+            local[bin]++;
+        }
+
+        #pragma omp critical
+        for(int b = 0; b < N_bins; b++) histogram.counts[b] += local[b];
+    }
+
+    return histogram;
+}
+
+// Computes all metrics, face metrics in one pass over the face arrays and element metrics in one pass over elements
+bool mesh_quality::compute(int N_bins)
+{
+    if(mesh.V_array == nullptr || mesh.Face_normal_array == nullptr)
+    {
+        mesh.out() << "Quality analysis needs volumes and face geometry\n";
+        return false;
+    }
+
+    const int N_faces = mesh.N_faces;
+    const int N_elements = mesh.N_elements;
+
+    const uint32_t* ON = mesh.Face_ON_idx;
+    const double* S = mesh.Face_normal_array;
+    const double* xf = mesh.Face_centroids_array;
+    const double* xc = mesh.Element_centroids_array;
+    const double* V = mesh.V_array;
+
+    Face_non_orthogonality.resize(N_faces);
+    Face_skewness.resize(N_faces);
+    Face_volume_ratio.resize(N_faces);
+
+    double* non_orthogonality = Face_non_orthogonality.data();
+    double* skewness = Face_skewness.data();
+    double* volume_ratio = Face_volume_ratio.data();
+
+    #pragma omp parallel for simd schedule(static)
+    for(int i = 0; i < N_faces; i++)
+    {
+        const int o = ON[2*i], n = ON[2*i+1];
+
+        const double dx = xc[3*n]-xc[3*o], dy = xc[3*n+1]-xc[3*o+1], dz = xc[3*n+2]-xc[3*o+2];
+        const double Sx = S[3*i], Sy = S[3*i+1], Sz = S[3*i+2];
+
+        const double d = sqrt(dx*dx+dy*dy+dz*dz);
+        const double A = sqrt(Sx*Sx+Sy*Sy+Sz*Sz);
+        const double dS = dx*Sx+dy*Sy+dz*Sz;
+
+        const double cos_angle = std::min(1.0,std::max(-1.0,dS/(d*A+1e-300)));
+        non_orthogonality[i] = acos(cos_angle)*180.0/M_PI;
+
+        // Intersection of centroid line with face plane
+        const double t = (Sx*(xf[3*i]-xc[3*o])+Sy*(xf[3*i+1]-xc[3*o+1])+Sz*(xf[3*i+2]-xc[3*o+2]))/(dS+1e-300);
+        const double ex = xc[3*o]+t*dx-xf[3*i], ey = xc[3*o+1]+t*dy-xf[3*i+1], ez = xc[3*o+2]+t*dz-xf[3*i+2];
+        skewness[i] = sqrt(ex*ex+ey*ey+ez*ez)/(d+1e-300);
+
+        // Ghosts have zero volume, zero or inverted elements get the largest ratio so they are listed as worst
+        if(mesh.is_boundary_element(n)) volume_ratio[i] = 1.0;
+        else if(V[o] <= 0 || V[n] <= 0) volume_ratio[i] = std::numeric_limits<double>::max();
+        else volume_ratio[i] = std::max(V[o],V[n])/std::min(V[o],V[n]);
+    }
+
+    Element_aspect_ratio.assign(N_elements,0);
+    std::vector<std::vector<int32_t>> thread_invalid(omp_get_max_threads());
+
+    // Typical volume for the zero volume test
+    double V_sum = 0;
+    #pragma omp parallel for schedule(static) reduction(+:V_sum)
+    for(int i = 0; i < N_elements; i++) V_sum += fabs(V[i]);
+    const double V_eps = 1e-12*V_sum/std::max(1,N_elements-mesh.N_boundary_elements);
+
+    #pragma omp parallel
+    {
+        auto& invalid = thread_invalid[omp_get_thread_num()];
+
+        #pragma omp for schedule(static)
+        for(int i = 0; i < N_elements; i++)
+        {
+            if(mesh.is_boundary_element(i)) continue;
+            if(V[i] <= V_eps) invalid.push_back(i);
+
+            const int32_t* v = &mesh.Element_vertices_idx_array[mesh.Element_vertices_idx_offsets[i]];
+            double d_min = std::numeric_limits<double>::max(), d_max = 0;
+
+            for(auto const& face : element_type_to_faces.at(mesh.Element_type_array[i]))
+            {
+                double fc[3] = {0,0,0};
+                for(auto const j : face)
+                {
+                    for(int d = 0; d < 3; d++) fc[d] += mesh.node_pos_array[3*v[j]+d];
+                }
+
+                double d2 = 0;
+                for(int d = 0; d < 3; d++)
+                {
+                    const double r = fc[d]/face.size()-xc[3*i+d];
+                    d2 += r*r;
+                }
+                d_min = std::min(d_min,d2);
+                d_max = std::max(d_max,d2);
+            }
+
+            Element_aspect_ratio[i] = (d_min > 0) ? sqrt(d_max/d_min) : std::numeric_limits<double>::max();
+        }
+    }
+
+    Invalid_elements.clear();
+    for(auto const& invalid : thread_invalid)
+    {
+        Invalid_elements.insert(Invalid_elements.end(),invalid.begin(),invalid.end());
+    }
+    std::sort(Invalid_elements.begin(),Invalid_elements.end());
+
+    std::vector<double> aspect_ratio;
+    aspect_ratio.reserve(N_elements-mesh.N_boundary_elements);
+    for(int i = 0; i < N_elements; i++)
+    {
+        if(!mesh.is_boundary_element(i)) aspect_ratio.push_back(Element_aspect_ratio[i]);
+    }
+
+    histograms.clear();
+    histograms.push_back(make_histogram("Non-orthogonality [deg]",Face_non_orthogonality,0,90,N_bins));
+    histograms.push_back(make_histogram("Skewness",Face_skewness,0,1,N_bins));
+    histograms.push_back(make_histogram("Volume ratio",Face_volume_ratio,1,11,N_bins));
+    histograms.push_back(make_histogram("Aspect ratio",aspect_ratio,1,11,N_bins));
+    return true;
+}
+
+// Indices of N largest values, largest first
+std::vector<int32_t> mesh_quality::worst(const std::vector<double>& metric, int N) const
+{
+    std::vector<int32_t> idx(metric.size());
+    std::iota(idx.begin(),idx.end(),0);
+
+    N = std::min<int>(N,idx.size());
+    std::partial_sort(idx.begin(),idx.begin()+N,idx.end(),[&metric](int32_t a, int32_t b){return metric[a] > metric[b];});
+    idx.resize(N);
+    return idx;
+}
+
+void mesh_quality::print_report(int N_worst) const
+{
+    for(auto const& histogram : histograms)
+    {
+        mesh.out() << histogram.name << "\n";
+        const int N_bins = histogram.counts.size();
+        const double dx = (histogram.max-histogram.min)/N_bins;
+        for(int b = 0; b < N_bins; b++)
+        {
+            mesh.out() << "\t" << histogram.min+b*dx << " - " << histogram.min+(b+1)*dx << ((b == N_bins-1) ? "+" : "") << ":\t" << histogram.counts[b] << "\n";
+        }
+    }
+
+    auto print_worst = [&](const std::string& name, const std::vector<double>& metric)
+    {
+        mesh.out() << "Worst " << name << ":";
+        for(auto const i : worst(metric,N_worst)) mesh.out() << " " << i << " (" << metric[i] << ")";
+        mesh.out() << "\n";
+    };
+
+    print_worst("non-orthogonality faces",Face_non_orthogonality);
+    print_worst("skewness faces",Face_skewness);
+    print_worst("volume ratio faces",Face_volume_ratio);
+    print_worst("aspect ratio elements",Element_aspect_ratio);
+
+    mesh.out() << "Negative or zero volume elements:\t" << Invalid_elements.size() << "\n";
+}
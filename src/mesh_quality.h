@@ -0,0 +1,38 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <cstdint>
+
+#include "mesh_manager.h"
+
+// Uniform bins over [min,max], values outside are counted in the first/last bin
+struct quality_histogram
+{
+    std::string name;
+    double min, max;
+    std::vector<int64_t> counts;
+};
+
+// Face and element quality metrics computed from volumes, face area vectors and centroids
+class mesh_quality
+{
+    private:
+    const mesh_struct& mesh;
+
+    quality_histogram make_histogram(const std::string& name, const std::vector<double>& values, double min, double max, int N_bins) const;
+
+    public:
+    std::vector<double> Face_non_orthogonality;     // Angle between face area vector and owner -> neighbour centroid vector [deg]
+    std::vector<double> Face_skewness;              // Distance of face centroid to the centroid line intersection / centroid distance
+    std::vector<double> Face_volume_ratio;          // Larger / smaller volume of face elements (1 for boundary faces, max double next to zero or negative volumes)
+    std::vector<double> Element_aspect_ratio;       // Largest / smallest centroid to face centroid distance (0 for ghosts, max double if degenerate)
+
+    std::vector<int32_t> Invalid_elements;          // Non ghost elements with negative or zero volume
+    std::vector<quality_histogram> histograms;
+
+    mesh_quality(const mesh_struct& _mesh);
+
+    bool compute(int N_bins = 10);        // False without volumes and face geometry
+    std::vector<int32_t> worst(const std::vector<double>& metric, int N) const;
+    void print_report(int N_worst = 5) const;
+};
@@ -6,9 +6,11 @@
 #include <map>
 #include <string>
 #include <iostream>
+#include <charconv>
+#include <cstring>
 
 // Convert msh element type to elements number of faces
-std::map<int,int> msh_Nfaces = {{2,3},  // Triangle
+const std::map<int,int> msh_Nfaces = {{2,3},  // Triangle
                             {3,4},      // Quadrangle
                             {4,4},      // Tetrahedron
                             {5,6},      // Hexahedron
@@ -27,6 +29,57 @@ enum msh_elements
     point = 15
 };
 
+// Number of nodes of first order msh element types
+static const std::map<int,int> msh_Nnodes = {{1,2},{2,3},{3,4},{4,4},{5,8},{6,6},{7,5},{15,1}};
+
+static inline const char* skip_space(const char* p, const char* end)
+{
+    while(p < end && (unsigned char)*p <= ' ') p++;
+    return p;
+}
+
+// Parses the next whitespace separated number in place, false if there is none
+template<typename T>
+static inline bool next_number(const char*& p, const char* end, T& value)
+{
+    p = skip_space(p,end);
+
+    auto result = std::from_chars(p,end,value);
+    if(result.ec != std::errc()) return false;
+    p = result.ptr;
+    return true;
+}
+
+static inline std::string next_line(const char*& p, const char* end)
+{
+    const char* start = p;
+    while(p < end && *p != '\n') p++;
+
+    std::string line(start,p);
+    if(!line.empty() && line.back() == '\r') line.pop_back();
+    if(p < end) p++;
+    return line;
+}
+
+// Binary block read, the file is checked to match the host byte order
+template<typename T>
+static inline bool read_binary(const char*& p, const char* end, T* values, size_t n)
+{
+    if((size_t)(end-p) < n*sizeof(T)) return false;
+    std::memcpy(values,p,n*sizeof(T));
+    p += n*sizeof(T);
+    return true;
+}
+
+// Moves past the closing line of a section, binary data may contain '$'
+static void skip_section(const char*& p, const char* end, const std::string& name)
+{
+    const std::string closing = "$End" + name;
+    p = std::search(p,end,closing.begin(),closing.end());
+    p = std::min(p+closing.size(),end);
+    next_line(p,end);
+}
+
 std::vector<std::string> mesh_reader::split(std::string line, std::string delimiter)
 {
     auto output = std::vector<std::string>();
@@ -47,45 +100,28 @@ physical_domain mesh_reader::read_domain(std::string line)
     auto list = split(line," ");
 
     physical_domain output;
-    output.idx = std::stoi(list[1]);
-    output.name = list[2];
-    output.type = std::stoi(list[0]);
+    output.idx = std::stoi(list.at(1));
+    output.name = list.at(2);
+    output.type = std::stoi(list.at(0));
 
     return output;
 }
 
-msh_node mesh_reader::read_node_line(std::string line)
+// Records the error of a failed read, always false
+bool mesh_reader::fail(const std::string& message)
 {
-    auto list = split(line," ");
-
-    msh_node node;
-    node.idx = std::stoi(list[0])-1;
-    node.x = std::stod(list[1]);
-    node.y = std::stod(list[2]); 
-    node.z = std::stod(list[3]);
-    return node;
+    if(error.empty()) error = message;
+    return false;
 }
 
-msh_element mesh_reader::read_element_line(std::string line)
+// Messages go to log, a per thread sink discards them when log is nullptr
+std::ostream& mesh_reader::out() const
 {
-    auto list = split(line," ");
-
-    msh_element element;
-    element.idx = stoi(list[0])-1;
-    element.element_type = stoi(list[1]);
-    element.physical_idx = stoi(list[3]);
-
-    int n_points = list.size()-5;
-    element.node_idxs.resize(n_points);
-    for(int i = 0; i < n_points; i++)
-    {
-        element.node_idxs[i] = stoi(list[5+i])-1;
-    }
-
-    return element;
+    static thread_local std::ostream null_stream(nullptr);
+    return log ? *log : null_stream;
 }
 
-void mesh_reader::count_elements(msh_data& data)
+bool mesh_reader::count_elements(msh_data& data)
 {
     for(auto const& element : data.msh_elements)
     {
@@ -119,10 +155,10 @@ void mesh_reader::count_elements(msh_data& data)
             break;
 
         default:
-            std::cout << "Element type " + std::to_string(type) + " unknown, exiting...\n";
-            exit(1);
+            return fail("Element type " + std::to_string(type) + " unknown");
         }
     }
+    return true;
 }
 
 void mesh_reader::remove_elements(msh_data& data, std::vector<int> type_to_remove)
@@ -137,100 +173,275 @@ void mesh_reader::remove_elements(msh_data& data, std::vector<int> type_to_remov
     }
 
     const unsigned int Final_size = data.msh_elements.size();
-    std::cout << "Removed " + std::to_string(Initial_size-Final_size) + " elements with types: ";
+    out() << "Removed " + std::to_string(Initial_size-Final_size) + " elements with types: ";
     for(auto const& type : type_to_remove)
     {
-        std::cout << std::to_string(type) << " ";
+        out() << std::to_string(type) << " ";
+    }
+    out() << "\n";
+}
+
+// Legacy msh 2.2 nodes, "tag x y z" lines or packed (int, 3 doubles) records
+bool mesh_reader::read_msh_nodes(const char*& p, const char* end, bool binary, msh_data& data)
+{
+    if(!next_number(p,end,data.N_nodes) || data.N_nodes < 0) return fail("Corrupted msh node section");
+    data.msh_nodes.resize(data.N_nodes);
+    next_line(p,end);
+
+    std::vector<int> tags(data.N_nodes);
+    for(int i = 0; i < data.N_nodes; i++)
+    {
+        if(!keep_reading(p-file_begin)) return false;
+
+        double x[3];
+        const bool ok = binary ? read_binary(p,end,&tags[i],1) && read_binary(p,end,x,3)
+                               : next_number(p,end,tags[i]) && next_number(p,end,x[0]) && next_number(p,end,x[1]) && next_number(p,end,x[2]);
+        if(!ok) return fail("Corrupted msh node " + std::to_string(i+1));
+
+        data.msh_nodes[i].idx = i;
+        data.msh_nodes[i].x = x[0];
+        data.msh_nodes[i].y = x[1];
+        data.msh_nodes[i].z = x[2];
+    }
+
+    // Node tags of 2.2 files may be sparse, elements are renumbered in read_msh
+    node_tags.swap(tags);
+    return true;
+}
+
+// Legacy msh 2.2 elements, ASCII lines or binary blocks of one element type, first tag is the physical group
+bool mesh_reader::read_msh_elements(const char*& p, const char* end, bool binary, msh_data& data)
+{
+    if(!next_number(p,end,data.N_elements) || data.N_elements < 0) return fail("Corrupted msh element section");
+    data.msh_elements.resize(data.N_elements);
+    next_line(p,end);
+
+    int header[3] = {0,0,0};        // Binary block: type, number of elements, number of tags
+    int N_block = 0;
+    std::vector<int> values;
+
+    for(int i = 0; i < data.N_elements; i++)
+    {
+        if(!keep_reading(p-file_begin)) return false;
+
+        int number, type, N_tags;
+        bool ok = true;
+        if(binary)
+        {
+            if(N_block == 0)
+            {
+                ok = read_binary(p,end,header,3);
+                N_block = header[1];
+            }
+            N_block--;
+            type = header[0];
+            N_tags = header[2];
+        }
+        else ok = next_number(p,end,number) && next_number(p,end,type) && next_number(p,end,N_tags);
+
+        auto it = msh_Nnodes.find(type);
+        if(!ok || N_tags < 0) return fail("Corrupted msh element " + std::to_string(i+1));
+        if(it == msh_Nnodes.end()) return fail("Element type " + std::to_string(type) + " unknown");
+
+        // Binary records still hold the element number first
+        const int N_values = N_tags+it->second+binary;
+        values.resize(N_values);
+        if(binary) ok = read_binary(p,end,values.data(),N_values);
+        else for(auto& value : values) ok = ok && next_number(p,end,value);
+        if(!ok) return fail("Corrupted msh element " + std::to_string(i+1));
+
+        const int* tags = &values[binary];
+        msh_element& element = data.msh_elements[i];
+        element.idx = i;
+        element.element_type = type;
+        element.N_faces = msh_Nfaces.count(type) ? msh_Nfaces.at(type) : 0;
+        element.physical_idx = N_tags > 0 ? tags[0] : 0;
+        element.node_idxs.assign(tags+N_tags,tags+N_tags+it->second);
     }
-    std::cout << "\n";
+    return true;
 }
 
-msh_data mesh_reader::read_msh(std::string file_path)
+// Reads msh 2.2 (ASCII or binary), the file is loaded with one read and parsed in place
+msh_data mesh_reader::read_msh(std::string file_path, std::vector<int> ignored_types)
 {
     std::ifstream stream;
-    stream.open(file_path);
+    stream.open(file_path,std::ios::binary);
 
     msh_data mesh;
+    cancelled = false;
+    lines_read = 0;
+    error.clear();
+    node_tags.clear();
 
     //check if file opened
-    if(!stream){std::cout << "File not found\n";}
+    if(!stream){fail("File " + file_path + " not found"); return mesh;}
 
-    //read file
-    std::string buffer;
-    while(getline(stream,buffer))
+    stream.seekg(0,std::ios::end);
+    file_size = (size_t)stream.tellg();
+    stream.seekg(0,std::ios::beg);
+
+    std::vector<char> file(file_size);
+    stream.read(file.data(),file_size);
+
+    file_begin = file.data();
+    const char* p = file.data();
+    const char* end = p+file_size;
+    bool binary = false;
+
+    while(p < end)
     {
-        //read version
-        if(buffer == "$MeshFormat")
+        const std::string buffer = next_line(p,end);
+        if(buffer.empty() || buffer[0] != '$') continue;
+        const std::string section = buffer.substr(1);
+
+        // Read version
+        if(section == "MeshFormat")
         {
-            getline(stream,buffer);
-            if(buffer != supported_version)
+            const std::string version = next_line(p,end);
+            if(version.compare(0,3,"2.2") != 0 || split(version," ").size() != 3 || split(version," ")[2] != "8")
             {
-                std::cout << "msh version " + buffer + " not supported\n";
+                fail("msh version " + version + " not supported");
                 break;
             }
-            else
+            out() << "msh version " + version + " ok\n";
+
+            binary = split(version," ")[1] == "1";
+            int one = 1;
+            if(binary && (!read_binary(p,end,&one,1) || one != 1))
             {
-                std::cout << "msh version " + buffer + " ok\n";
-                getline(stream,buffer);
+                fail("Binary msh file has foreign byte order");
+                break;
             }
+            skip_section(p,end,section);
         }
 
-        //read physicalnames
-        if(buffer == "$PhysicalNames")
+        // Read physical names
+        else if(section == "PhysicalNames")
         {
-            getline(stream,buffer);
-            mesh.N_physicals = std::stoi(buffer);
+            mesh.N_physicals = std::stoi(next_line(p,end));
             mesh.physical_domains.resize(mesh.N_physicals);
 
-            for(int i = 0; i < mesh.N_physicals; i++)
-            {
-                getline(stream,buffer);
-                mesh.physical_domains[i] = read_domain(buffer);
-            }
-            getline(stream,buffer);
+            for(int i = 0; i < mesh.N_physicals; i++) mesh.physical_domains[i] = read_domain(next_line(p,end));
+            skip_section(p,end,section);
         }
 
-        //read nodes
-        if(buffer == "$Nodes")
+        // Read mesh nodes
+        else if(section == "Nodes")
         {
-            getline(stream,buffer);
-            mesh.N_nodes = std::stoi(buffer);
-            mesh.msh_nodes.resize(mesh.N_nodes);
-
-            for(int i = 0; i < mesh.N_nodes; i++)
-            {
-                getline(stream,buffer);
-                mesh.msh_nodes[i] = read_node_line(buffer);
-            }
+            if(!read_msh_nodes(p,end,binary,mesh)) break;
+            skip_section(p,end,section);
         }
 
-        //read elements
-        if(buffer == "$Elements")
+        // Read mesh elements
+        else if(section == "Elements")
         {
-            getline(stream,buffer);
-            mesh.N_elements = std::stoi(buffer);
-            mesh.msh_elements.resize(mesh.N_elements);
+            if(!read_msh_elements(p,end,binary,mesh)) break;
+            skip_section(p,end,section);
+        }
+
+        else skip_section(p,end,section);
+    }
+
+    file_begin = nullptr;
+    std::vector<char>().swap(file);
+    if(cancelled || !error.empty()) return mesh;
 
-            for(int i = 0; i < mesh.N_elements; i++)
+    // Node tags to node positions
+    bool dense = true;
+    int max_tag = 0;
+    for(int i = 0; i < (int)node_tags.size(); i++)
+    {
+        dense = dense && node_tags[i] == i+1;
+        max_tag = std::max(max_tag,node_tags[i]);
+    }
+
+    std::vector<int> tag_to_idx(dense ? 0 : max_tag+1,-1);
+    for(int i = 0; i < (int)node_tags.size() && !dense; i++) tag_to_idx[node_tags[i]] = i;
+
+    for(auto& element : mesh.msh_elements)
+    {
+        for(auto& node : element.node_idxs)
+        {
+            node = dense ? node-1 : ((node >= 0 && node <= max_tag) ? tag_to_idx[node] : -1);
+            if(node < 0 || node >= mesh.N_nodes)
             {
-                getline(stream,buffer);
-                mesh.msh_elements[i] = read_element_line(buffer);
+                fail("Element " + std::to_string(element.idx+1) + " references a missing node");
+                return mesh;
             }
         }
     }
+    std::vector<int>().swap(node_tags);
+
+    if(on_progress) on_progress(file_size,file_size);
+
+    remove_elements(mesh,ignored_types);
+    if(!count_elements(mesh)) return msh_data();
 
     return mesh;
 }
 
+// Picks the reader from the $MeshFormat version line
+msh_data mesh_reader::read_file(std::string file_path, std::vector<int> ignored_types)
+{
+    error.clear();
+
+    std::ifstream stream;
+    stream.open(file_path);
+
+    //check if file opened
+    if(!stream){fail("File " + file_path + " not found"); return msh_data();}
+
+    std::string buffer;
+    while(getline(stream,buffer) && buffer.compare(0,11,"$MeshFormat") != 0);
+    getline(stream,buffer);
+    stream.close();
+
+    // Physical names (both versions) and the 4.1 sections are converted with std::sto* and checked indexing, malformed files throw
+    try
+    {
+        if(buffer.compare(0,2,"2.") == 0) return read_msh(file_path,ignored_types);
+        return read_msh4(file_path,ignored_types);
+    }
+    catch(const std::exception&)
+    {
+        fail("Corrupted msh file " + file_path);
+        return msh_data();
+    }
+}
+
+// Reports progress every 64k data lines, false once reading was cancelled
+bool mesh_reader::keep_reading(std::ifstream& stream)
+{
+    if(!on_progress || (++lines_read & 0xffff) || cancelled) return !cancelled;
+
+    cancelled = !on_progress((size_t)stream.tellg(),file_size);
+    return !cancelled;
+}
+
+bool mesh_reader::keep_reading(size_t position)
+{
+    if(!on_progress || (++lines_read & 0xffff) || cancelled) return !cancelled;
+
+    cancelled = !on_progress(position,file_size);
+    return !cancelled;
+}
+
 msh_data mesh_reader::read_msh4(std::string file_path, std::vector<int> ignored_types)
 {
     std::ifstream stream;
     stream.open(file_path);
 
     msh_data mesh;
+    cancelled = false;
+    lines_read = 0;
+    error.clear();
 
     //check if file opened
-    if(!stream){std::cout << "File not found\n";}
+    if(!stream){fail("File " + file_path + " not found"); return mesh;}
+
+    stream.seekg(0,std::ios::end);
+    file_size = stream ? (size_t)stream.tellg() : 0;
+    stream.seekg(0,std::ios::beg);
 
     std::string buffer;
     std::vector<std::string> line;
@@ -242,12 +453,12 @@ msh_data mesh_reader::read_msh4(std::string file_path, std::vector<int> ignored_
             getline(stream,buffer);
             if(buffer != supported_version)
             {
-                std::cout << "msh version " + buffer + " not supported\n";
-                break;
+                fail("msh version " + buffer + " not supported");
+                return mesh;
             }
             else
             {
-                std::cout << "msh version " + buffer + " ok\n";
+                out() << "msh version " + buffer + " ok\n";
                 getline(stream,buffer);
             }
         }
@@ -293,26 +504,26 @@ msh_data mesh_reader::read_msh4(std::string file_path, std::vector<int> ignored_
 
                     if(dim == 0)
                     {
-                        mesh.msh_entities.entity_vector[global_idx].idx = std::stoi(line[0]);
+                        mesh.msh_entities.entity_vector[global_idx].idx = std::stoi(line.at(0));
                         mesh.msh_entities.entity_vector[global_idx].dim = 0;
                     }
                     else if (dim == 1)
                     {
-                        mesh.msh_entities.entity_vector[global_idx].idx = std::stoi(line[0]);
+                        mesh.msh_entities.entity_vector[global_idx].idx = std::stoi(line.at(0));
                         mesh.msh_entities.entity_vector[global_idx].dim = 1;
-                        mesh.msh_entities.entity_vector[global_idx].phys_tag = std::stoi(line[8]);
+                        mesh.msh_entities.entity_vector[global_idx].phys_tag = std::stoi(line.at(8));
                     }
                     else if (dim == 2)
                     {
-                        mesh.msh_entities.entity_vector[global_idx].idx = std::stoi(line[0]);
+                        mesh.msh_entities.entity_vector[global_idx].idx = std::stoi(line.at(0));
                         mesh.msh_entities.entity_vector[global_idx].dim = 2;
-                        mesh.msh_entities.entity_vector[global_idx].phys_tag = std::stoi(line[8]);
+                        mesh.msh_entities.entity_vector[global_idx].phys_tag = std::stoi(line.at(8));
                     }
                     else if (dim == 3)
                     {
-                        mesh.msh_entities.entity_vector[global_idx].idx = std::stoi(line[0]);
+                        mesh.msh_entities.entity_vector[global_idx].idx = std::stoi(line.at(0));
                         mesh.msh_entities.entity_vector[global_idx].dim = 3;
-                        mesh.msh_entities.entity_vector[global_idx].phys_tag = std::stoi(line[8]);
+                        mesh.msh_entities.entity_vector[global_idx].phys_tag = std::stoi(line.at(8));
                     }
 
                     global_idx++;
@@ -327,42 +538,47 @@ msh_data mesh_reader::read_msh4(std::string file_path, std::vector<int> ignored_
             getline(stream,buffer);
             line = split(buffer," ");
 
-            mesh.N_nodes = std::stoi(line[1]);
+            mesh.N_nodes = std::stoi(line.at(1));
             mesh.msh_nodes.resize(mesh.N_nodes);
 
             int N_nodes_read = 0;
             std::vector<int> idx_vector;
-            while(N_nodes_read < mesh.N_nodes)
+            while(N_nodes_read < mesh.N_nodes && stream)
             {
                 getline(stream,buffer);
                 line = split(buffer," ");
 
-                int N_nodes_to_read = std::stoi(line[3]);
+                int N_nodes_to_read = std::stoi(line.at(3));
 
                 idx_vector.clear();
                 idx_vector.reserve(N_nodes_to_read);
 
                 for(int i = 0; i < N_nodes_to_read; i++)
                 {
+                    if(!keep_reading(stream)) return mesh;
+
                     getline(stream,buffer);
                     line = split(buffer," ");
 
-                    idx_vector.push_back(std::stoi(line[0])-1);
+                    idx_vector.push_back(std::stoi(line.at(0))-1);
                 }
 
                 for(auto idx : idx_vector)
                 {
+                    if(!keep_reading(stream)) return mesh;
+
                     getline(stream,buffer);
                     line = split(buffer," ");
 
-                    mesh.msh_nodes[idx].idx = idx;
-                    mesh.msh_nodes[idx].x = std::stod(line[0]);
-                    mesh.msh_nodes[idx].y = std::stod(line[1]);
-                    mesh.msh_nodes[idx].z = std::stod(line[2]);
+                    mesh.msh_nodes.at(idx).idx = idx;
+                    mesh.msh_nodes.at(idx).x = std::stod(line.at(0));
+                    mesh.msh_nodes.at(idx).y = std::stod(line.at(1));
+                    mesh.msh_nodes.at(idx).z = std::stod(line.at(2));
                 }
 
                 N_nodes_read += N_nodes_to_read;
             }
+            if(!stream){fail("Unexpected end of msh file"); return mesh;}
         }
 
         // Read mesh elements
@@ -371,23 +587,23 @@ msh_data mesh_reader::read_msh4(std::string file_path, std::vector<int> ignored_
             getline(stream,buffer);
             line = split(buffer," ");
 
-            mesh.N_elements = std::stoi(line[1]);
+            mesh.N_elements = std::stoi(line.at(1));
             mesh.msh_elements.resize(mesh.N_elements);
 
             int N_elements_read = 0;
             std::vector<int> idx_vector;
             idx_vector.reserve(4);
 
-            while(N_elements_read < mesh.N_elements)
+            while(N_elements_read < mesh.N_elements && stream)
             {
                 getline(stream,buffer);
                 line = split(buffer," ");
 
-                int N_elements_to_read = std::stoi(line[3]);
-                int element_type =  std::stoi(line[2]);
+                int N_elements_to_read = std::stoi(line.at(3));
+                int element_type =  std::stoi(line.at(2));
 
-                int entity_tag = std::stoi(line[1])-1;
-                int entity_dim = std::stoi(line[0]);
+                int entity_tag = std::stoi(line.at(1))-1;
+                int entity_dim = std::stoi(line.at(0));
 
                 int entity_idx = 0;
                 for(int i = 0; i < entity_dim; i++)
@@ -398,33 +614,38 @@ msh_data mesh_reader::read_msh4(std::string file_path, std::vector<int> ignored_
 
                 for(int i = 0; i < N_elements_to_read; i++)
                 {
+                    if(!keep_reading(stream)) return mesh;
+
                     getline(stream,buffer);
                     line = split(buffer," ");
 
                     idx_vector.clear();
 
-                    int idx = std::stoi(line[0])-1;
+                    int idx = std::stoi(line.at(0))-1;
                     int n_vertices = line.size()-2;
 
                     for(int k = 0; k < n_vertices; k++)
                     {
-                        idx_vector.push_back(std::stoi(line[k+1])-1);
+                        idx_vector.push_back(std::stoi(line.at(k+1))-1);
                     }
                     
-                    mesh.msh_elements[idx].idx = idx;
-                    mesh.msh_elements[idx].element_type = element_type;
-                    mesh.msh_elements[idx].N_faces = msh_Nfaces[element_type];
-                    mesh.msh_elements[idx].physical_idx = mesh.msh_entities.entity_vector[entity_idx].phys_tag;
-                    mesh.msh_elements[idx].node_idxs = idx_vector;
+                    mesh.msh_elements.at(idx).idx = idx;
+                    mesh.msh_elements.at(idx).element_type = element_type;
+                    mesh.msh_elements.at(idx).N_faces = msh_Nfaces.count(element_type) ? msh_Nfaces.at(element_type) : 0;
+                    mesh.msh_elements.at(idx).physical_idx = mesh.msh_entities.entity_vector.at(entity_idx).phys_tag;
+                    mesh.msh_elements.at(idx).node_idxs = idx_vector;
                 }
 
                 N_elements_read += N_elements_to_read;
             }
+            if(!stream){fail("Unexpected end of msh file"); return mesh;}
         }
     }
 
+    if(on_progress) on_progress(file_size,file_size);
+
     remove_elements(mesh,ignored_types);
-    count_elements(mesh);
+    if(!count_elements(mesh)) return msh_data();
 
     return mesh;
 }
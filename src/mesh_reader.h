@@ -2,10 +2,12 @@
 #include <vector>
 #include <string>
 #include <map>
+#include <functional>
+#include <iostream>
 #include "mesh_reader_structs.h"
 
 // Convert msh element type to elements number of faces
-extern std::map<int,int> msh_Nfaces;
+extern const std::map<int,int> msh_Nfaces;
 
 class mesh_reader
 {
@@ -15,13 +17,33 @@ class mesh_reader
     physical_domain read_domain(std::string line);
     entity read_entity(std::string line);
 
-    msh_node read_node_line(std::string line);
-    msh_element read_element_line(std::string line);
+    bool read_msh_nodes(const char*& p, const char* end, bool binary, msh_data& data);
+    bool read_msh_elements(const char*& p, const char* end, bool binary, msh_data& data);
 
-    void count_elements(msh_data& data);
+    bool fail(const std::string& message);
+    std::ostream& out() const;
+
+    bool count_elements(msh_data& data);
     void remove_elements(msh_data& data, std::vector<int> type_to_remove);
 
+    const char* file_begin = nullptr;   // In memory file of read_msh
+    std::vector<int> node_tags;         // Node tags of read_msh in file order
+
+    size_t file_size = 0;
+    size_t lines_read = 0;
+    bool keep_reading(std::ifstream& stream);
+    bool keep_reading(size_t position);
+
     public:
-    msh_data read_msh(std::string file_path);
+    // Optional progress hook (bytes read, file size), returning false stops reading
+    std::function<bool(size_t, size_t)> on_progress;
+    bool cancelled = false;     // Reading was stopped by on_progress
+    std::string error;          // Why the last read failed, empty on success
+    std::ostream* log = &std::cout;     // Messages, nullptr silences them
+
+    // Picks the reader from the $MeshFormat version (4.1 or legacy 2.2)
+    msh_data read_file(std::string file_path, std::vector<int> ignored_types = std::vector<int>{});
+
+    msh_data read_msh(std::string file_path, std::vector<int> ignored_types = std::vector<int>{});
     msh_data read_msh4(std::string file_path, std::vector<int> ignored_types = std::vector<int>{});
 };
\ No newline at end of file
@@ -45,8 +45,8 @@ struct entities
 //Holds data for whole mesh for return and next operations
 struct msh_data
 {
-    int N_nodes, N_physicals;   // Number of nodes and physical domains (line surface and volume)
-    int N_elements;             // Number of all elements
+    int N_nodes=0, N_physicals=0;   // Number of nodes and physical domains (line surface and volume)
+    int N_elements=0;           // Number of all elements
 
     // Number of all domain elements
     int N_points=0;                                           // 0D elements
@@ -0,0 +1,710 @@
+#include "mesh_refinement.h"
+#include <algorithm>
+#include <cstring>
+
+// Sorted face vertices padded with -1
+static std::array<int32_t,4> face_key(const int32_t* v, int n)
+{
+    std::array<int32_t,4> key = {-1,-1,-1,-1};
+    for(int j = 0; j < std::min(n,4); j++)
+    {
+        // Insertion sort, at most 4 vertices
+        int k = j;
+        for(; k > 0 && key[k-1] > v[j]; k--) key[k] = key[k-1];
+        key[k] = v[j];
+    }
+    return key;
+}
+
+static uint64_t edge_key(int32_t a, int32_t b)
+{
+    return ((uint64_t)std::min(a,b) << 32) | (uint32_t)std::max(a,b);
+}
+
+// Reallocates a mesh array keeping its first N_old values
+template<typename T>
+static void grow(T*& p, size_t N_old, size_t N_new, const out_of_core_settings& ooc)
+{
+    T* q = (T*)mesh_malloc(std::max(N_new,(size_t)1)*sizeof(T),ooc);
+    if(p != nullptr) std::memcpy(q,p,std::min(N_old,N_new)*sizeof(T));
+    mesh_free(p);
+    p = q;
+}
+
+static void count_element(mesh_struct& mesh, uint8_t type)
+{
+    switch(type)
+    {
+        case 1: mesh.N_lines++; break;
+        case 2: mesh.N_triangles++; break;
+        case 3: mesh.N_quads++; break;
+        case 4: mesh.N_tetrahedra++; break;
+        case 5: mesh.N_hexahedra++; break;
+        default: break;
+    }
+}
+
+// Signed volume of tetrahedron
+static double tet_volume(const double* a, const double* b, const double* c, const double* d)
+{
+    const double u[3] = {b[0]-a[0],b[1]-a[1],b[2]-a[2]};
+    const double v[3] = {c[0]-a[0],c[1]-a[1],c[2]-a[2]};
+    const double w[3] = {d[0]-a[0],d[1]-a[1],d[2]-a[2]};
+    return (u[0]*(v[1]*w[2]-v[2]*w[1])-u[1]*(v[0]*w[2]-v[2]*w[0])+u[2]*(v[0]*w[1]-v[1]*w[0]))/6;
+}
+
+mesh_refiner::mesh_refiner(mesh_manager& _manager) : manager(_manager), mesh(_manager.mesh){}
+
+const double* mesh_refiner::node(int32_t k) const
+{
+    return (k < N_real_nodes) ? &mesh.node_pos_array[3*k] : &new_node_pos[3*(k-N_real_nodes)];
+}
+
+int32_t mesh_refiner::add_node(const double* x)
+{
+    for(int d = 0; d < 3; d++) new_node_pos.push_back(x[d]);
+    return N_real_nodes+new_node_pos.size()/3-1;
+}
+
+int32_t mesh_refiner::edge_midpoint(int32_t a, int32_t b)
+{
+    const uint64_t key = edge_key(a,b);
+    auto it = Edge_midpoint.find(key);
+    if(it != Edge_midpoint.end()) return it->second;
+
+    double x[3];
+    for(int d = 0; d < 3; d++) x[d] = 0.5*(node(a)[d]+node(b)[d]);
+
+    const int32_t k = add_node(x);
+    Edge_midpoint[key] = k;
+    return k;
+}
+
+int32_t mesh_refiner::face_center(const int32_t* corners)
+{
+    const std::array<int32_t,4> key = face_key(corners,4);
+    auto it = Face_center.find(key);
+    if(it != Face_center.end()) return it->second;
+
+    double x[3] = {0,0,0};
+    for(int j = 0; j < 4; j++)
+    {
+        for(int d = 0; d < 3; d++) x[d] += 0.25*node(corners[j])[d];
+    }
+
+    const int32_t k = add_node(x);
+    Face_center[key] = k;
+    return k;
+}
+
+// Midpoints and face centers left by earlier passes lie on faces of unrefined elements split by a finer neighbour
+// A midpoint is the new node next to both corners of an element edge on the sub faces, a face center is next to none
+// and is shared by the sub faces of the four corners of its face
+void mesh_refiner::hanging_nodes(const std::vector<int32_t>& cell_faces_offsets, const std::vector<int32_t>& cell_faces)
+{
+    Edge_midpoint.clear();
+    Face_center.clear();
+
+    for(int i = 0; i < mesh.N_elements; i++)
+    {
+        auto faces = element_type_to_faces.find(mesh.Element_type_array[i]);
+        if(mesh.is_boundary_element(i) || faces == element_type_to_faces.end()) continue;
+        if(cell_faces_offsets[i+1]-cell_faces_offsets[i] == (int)faces->second.size()) continue;
+
+        const int32_t* v = &mesh.Element_vertices_idx_array[mesh.Element_vertices_idx_offsets[i]];
+        const int32_t* v_end = &mesh.Element_vertices_idx_array[mesh.Element_vertices_idx_offsets[i+1]];
+        auto is_corner = [&](int32_t k){return std::find(v,v_end,k) != v_end;};
+
+        std::map<int32_t,std::vector<int32_t>> next_corners, face_corners;
+        for(int j = cell_faces_offsets[i]; j < cell_faces_offsets[i+1]; j++)
+        {
+            const uint32_t* fv = &mesh.Face_vertices_idx_array[mesh.Face_vertices_idx_offsets[cell_faces[j]]];
+            const int n = mesh.Face_vertices_idx_offsets[cell_faces[j]+1]-mesh.Face_vertices_idx_offsets[cell_faces[j]];
+
+            int32_t corner = -1;
+            for(int k = 0; k < n; k++)
+            {
+                if(is_corner(fv[k])) corner = fv[k];
+            }
+
+            for(int k = 0; k < n; k++)
+            {
+                if(is_corner(fv[k])) continue;
+
+                auto& next = next_corners[fv[k]];
+                for(auto const u : {fv[(k+1)%n],fv[(k+n-1)%n]})
+                {
+                    if(is_corner(u)) next.push_back(u);
+                }
+                if(corner >= 0) face_corners[fv[k]].push_back(corner);
+            }
+        }
+
+        for(auto& [k, next] : next_corners)
+        {
+            std::sort(next.begin(),next.end());
+            next.erase(std::unique(next.begin(),next.end()),next.end());
+            if(next.size() == 2) Edge_midpoint[edge_key(next[0],next[1])] = k;
+
+            std::vector<int32_t>& corners = face_corners[k];
+            std::sort(corners.begin(),corners.end());
+            corners.erase(std::unique(corners.begin(),corners.end()),corners.end());
+            if(next.empty() && corners.size() == 4) Face_center[face_key(corners.data(),4)] = k;
+        }
+    }
+}
+
+// Red refinement templates, children keep the parent vertex ordering (and orientation)
+void mesh_refiner::children_vertices(int i, std::vector<std::vector<int32_t>>& children)
+{
+    const int32_t* v = &mesh.Element_vertices_idx_array[mesh.Element_vertices_idx_offsets[i]];
+    const uint8_t type = mesh.Element_type_array[i];
+    children.clear();
+
+    if(type == 2)
+    {
+        const int32_t m01 = edge_midpoint(v[0],v[1]), m12 = edge_midpoint(v[1],v[2]), m20 = edge_midpoint(v[2],v[0]);
+        children = {{v[0],m01,m20},{m01,v[1],m12},{m20,m12,v[2]},{m01,m12,m20}};
+    }
+    else if(type == 3)
+    {
+        int32_t L[3][3];
+        L[0][0] = v[0]; L[2][0] = v[1]; L[2][2] = v[2]; L[0][2] = v[3];
+        L[1][0] = edge_midpoint(v[0],v[1]);
+        L[2][1] = edge_midpoint(v[1],v[2]);
+        L[1][2] = edge_midpoint(v[2],v[3]);
+        L[0][1] = edge_midpoint(v[3],v[0]);
+        L[1][1] = face_center(v);
+
+        for(int a = 0; a < 2; a++)
+        for(int b = 0; b < 2; b++) children.push_back({L[a][b],L[a+1][b],L[a+1][b+1],L[a][b+1]});
+    }
+    else if(type == 5)
+    {
+        // 3x3x3 lattice, a point averages the corners matching its 0/2 coordinates
+        static const int corner[2][2] = {{0,3},{1,2}};
+        int32_t L[3][3][3];
+
+        for(int a = 0; a < 3; a++)
+        for(int b = 0; b < 3; b++)
+        for(int c = 0; c < 3; c++)
+        {
+            std::vector<int32_t> corners;
+            for(int ca = 0; ca < 2; ca++)
+            for(int cb = 0; cb < 2; cb++)
+            for(int cc = 0; cc < 2; cc++)
+            {
+                if((a != 1 && a != 2*ca) || (b != 1 && b != 2*cb) || (c != 1 && c != 2*cc)) continue;
+                corners.push_back(v[corner[ca][cb]+4*cc]);
+            }
+
+            if(corners.size() == 1) L[a][b][c] = corners[0];
+            else if(corners.size() == 2) L[a][b][c] = edge_midpoint(corners[0],corners[1]);
+            else if(corners.size() == 4) L[a][b][c] = face_center(corners.data());
+            else
+            {
+                double x[3] = {0,0,0};
+                for(auto const k : corners)
+                {
+                    for(int d = 0; d < 3; d++) x[d] += 0.125*node(k)[d];
+                }
+                L[a][b][c] = add_node(x);
+            }
+        }
+
+        for(int a = 0; a < 2; a++)
+        for(int b = 0; b < 2; b++)
+        for(int c = 0; c < 2; c++)
+        {
+            children.push_back({L[a][b][c],L[a+1][b][c],L[a+1][b+1][c],L[a][b+1][c],
+                                L[a][b][c+1],L[a+1][b][c+1],L[a+1][b+1][c+1],L[a][b+1][c+1]});
+        }
+    }
+    else if(type == 4)
+    {
+        int32_t m[4][4];
+        for(int a = 0; a < 4; a++)
+        for(int b = a+1; b < 4; b++) m[a][b] = m[b][a] = edge_midpoint(v[a],v[b]);
+
+        children = {{v[0],m[0][1],m[0][2],m[0][3]},{m[0][1],v[1],m[1][2],m[1][3]},
+                    {m[0][2],m[1][2],v[2],m[2][3]},{m[0][3],m[1][3],m[2][3],v[3]}};
+
+        // Inner octahedron split along its shortest diagonal, equator listed as a cycle
+        const int32_t diagonals[3][6] = {{m[0][1],m[2][3],m[0][2],m[0][3],m[1][3],m[1][2]},
+                                         {m[0][2],m[1][3],m[0][1],m[0][3],m[2][3],m[1][2]},
+                                         {m[0][3],m[1][2],m[0][1],m[0][2],m[2][3],m[1][3]}};
+        int best = 0;
+        double best_length = 1e300;
+        for(int k = 0; k < 3; k++)
+        {
+            const double* a = node(diagonals[k][0]);
+            const double* b = node(diagonals[k][1]);
+            const double length = (a[0]-b[0])*(a[0]-b[0])+(a[1]-b[1])*(a[1]-b[1])+(a[2]-b[2])*(a[2]-b[2]);
+            if(length < best_length){best_length = length; best = k;}
+        }
+
+        const int32_t* D = diagonals[best];
+        for(int k = 0; k < 4; k++) children.push_back({D[0],D[1],D[2+k],D[2+(k+1)%4]});
+
+        // Same orientation as the parent
+        const double parent_volume = tet_volume(node(v[0]),node(v[1]),node(v[2]),node(v[3]));
+        for(auto& child : children)
+        {
+            if(tet_volume(node(child[0]),node(child[1]),node(child[2]),node(child[3]))*parent_volume < 0) std::swap(child[1],child[2]);
+        }
+    }
+    // Other types are rejected by refine() before anything is changed
+}
+
+int mesh_refiner::refine(std::vector<uint8_t> marked)
+{
+    if(!manager.require(quantity_faces)) return -1;
+    const bool update_volumes = manager.is_valid(quantity_volumes);
+    const bool update_face_geometry = manager.is_valid(quantity_face_geometry);
+    const out_of_core_settings& ooc = manager.out_of_core;
+
+    const int N_elements = mesh.N_elements;
+    const int N_faces = mesh.N_faces;
+    if(Element_level.size() != (size_t)N_elements) Element_level.assign(N_elements,0);
+    marked.resize(N_elements,0);
+
+    // Element -> face table
+    std::vector<int32_t> cell_faces_offsets(N_elements+1,0), cell_faces(2*N_faces);
+    for(int f = 0; f < 2*N_faces; f++) cell_faces_offsets[mesh.Face_ON_idx[f]+1]++;
+    for(int i = 0; i < N_elements; i++) cell_faces_offsets[i+1] += cell_faces_offsets[i];
+    {
+        std::vector<int32_t> fill(cell_faces_offsets.begin(),cell_faces_offsets.end()-1);
+        for(int f = 0; f < 2*N_faces; f++) cell_faces[fill[mesh.Face_ON_idx[f]]++] = f/2;
+    }
+
+    hanging_nodes(cell_faces_offsets,cell_faces);
+
+    auto other_side = [&](int f, int i){return (int)mesh.Face_ON_idx[2*f] == i ? mesh.Face_ON_idx[2*f+1] : mesh.Face_ON_idx[2*f];};
+
+    // 2:1 balance, coarser face neighbours of refined elements are refined too
+    std::vector<int32_t> work;
+    for(int i = 0; i < N_elements; i++)
+    {
+        if(marked[i] && mesh.is_boundary_element(i)) marked[i] = 0;
+        if(marked[i]) work.push_back(i);
+    }
+    while(!work.empty())
+    {
+        const int P = work.back();
+        work.pop_back();
+
+        for(int j = cell_faces_offsets[P]; j < cell_faces_offsets[P+1]; j++)
+        {
+            const int Q = other_side(cell_faces[j],P);
+            if(mesh.is_boundary_element(Q) || marked[Q] || Element_level[Q] >= Element_level[P]) continue;
+            marked[Q] = 1;
+            work.push_back(Q);
+        }
+    }
+
+    std::vector<int32_t> marked_list, marked_pos(N_elements,-1);
+    for(int i = 0; i < N_elements; i++)
+    {
+        if(!marked[i]) continue;
+        marked_pos[i] = marked_list.size();
+        marked_list.push_back(i);
+    }
+    if(marked_list.empty()) return 0;
+
+    // Marks spread to neighbours of any type, unsupported ones are rejected before the mesh is touched
+    for(auto const P : marked_list)
+    {
+        const int type = mesh.Element_type_array[P];
+        if(type < 2 || type > 5)
+        {
+            manager.fail("Refinement of element type " + std::to_string(type) + " (element " + std::to_string(P) + ") is not supported");
+            return -1;
+        }
+    }
+
+    N_real_nodes = mesh.N_nodes-mesh.N_boundary_elements;
+    new_node_pos.clear();
+
+    // Elements appended after the existing ones (first child and first sub ghost reuse the parent slot)
+    std::vector<uint8_t> added_type, added_phys, added_level;
+    std::vector<int32_t> added_vertices, added_count;
+    auto append_element = [&](uint8_t type, uint8_t phys, uint8_t level, const std::vector<int32_t>& v)
+    {
+        added_type.push_back(type);
+        added_phys.push_back(phys);
+        added_level.push_back(level);
+        added_count.push_back(v.size());
+        added_vertices.insert(added_vertices.end(),v.begin(),v.end());
+        return N_elements+(int)added_type.size()-1;
+    };
+    // Elements reusing a slot, written once all faces are known to be balanced
+    std::vector<std::pair<int32_t,std::vector<int32_t>>> overwritten;
+    auto overwrite_element = [&](int i, const std::vector<int32_t>& v){overwritten.push_back({i,v});};
+
+    struct new_face
+    {
+        int32_t owner, neighbour;
+        std::vector<int32_t> vertices;
+    };
+    std::vector<new_face> added_faces;
+    std::vector<int32_t> changed_elements;
+
+    // Children, faces between siblings and sub faces on each parent face
+    std::vector<std::vector<std::vector<face_item>>> parent_subfaces(marked_list.size());
+    std::vector<std::vector<std::array<int32_t,4>>> parent_face_keys(marked_list.size());
+    std::vector<std::vector<int32_t>> children;
+
+    for(unsigned int p = 0; p < marked_list.size(); p++)
+    {
+        const int P = marked_list[p];
+        const uint8_t type = mesh.Element_type_array[P];
+        const std::vector<int32_t> pv(&mesh.Element_vertices_idx_array[mesh.Element_vertices_idx_offsets[P]],
+                                      &mesh.Element_vertices_idx_array[mesh.Element_vertices_idx_offsets[P+1]]);
+        auto const& faces = element_type_to_faces.at(type);
+
+        children_vertices(P,children);
+
+        std::vector<int32_t> child_idx(children.size());
+        child_idx[0] = P;
+        overwrite_element(P,children[0]);
+        for(unsigned int c = 1; c < children.size(); c++)
+        {
+            child_idx[c] = append_element(type,mesh.Phys_idx_array[P],Element_level[P]+1,children[c]);
+        }
+        changed_elements.insert(changed_elements.end(),child_idx.begin(),child_idx.end());
+
+        // Child faces seen twice are between siblings
+        std::map<std::array<int32_t,4>,face_item> single;
+        for(unsigned int c = 0; c < children.size(); c++)
+        {
+            for(auto const& face : faces)
+            {
+                std::vector<int32_t> fv;
+                for(auto const j : face) fv.push_back(children[c][j]);
+
+                const std::array<int32_t,4> key = face_key(fv.data(),fv.size());
+                auto it = single.find(key);
+                if(it == single.end())
+                {
+                    single[key] = face_item{child_idx[c],fv};
+                    continue;
+                }
+
+                added_faces.push_back(new_face{it->second.element,child_idx[c],it->second.vertices});
+                single.erase(it);
+            }
+        }
+
+        // Remaining child faces lie on parent faces, a sub face belongs to the face whose corners, edge midpoints and center contain it
+        parent_subfaces[p].resize(faces.size());
+        parent_face_keys[p].resize(faces.size());
+        for(unsigned int F = 0; F < faces.size(); F++)
+        {
+            const int n = faces[F].size();
+            std::vector<int32_t> corners, on_face;
+            for(auto const j : faces[F]) corners.push_back(pv[j]);
+
+            on_face = corners;
+            for(int j = 0; j < n; j++) on_face.push_back(edge_midpoint(corners[j],corners[(j+1)%n]));
+            if(n == 4) on_face.push_back(face_center(corners.data()));
+
+            parent_face_keys[p][F] = face_key(corners.data(),n);
+            for(auto const& [key, item] : single)
+            {
+                bool contained = true;
+                for(auto const k : item.vertices) contained = contained && std::find(on_face.begin(),on_face.end(),k) != on_face.end();
+                if(contained) parent_subfaces[p][F].push_back(item);
+            }
+        }
+    }
+
+    // Items covering an old face from the side of element X
+    auto face_side = [&](int f, int X, std::vector<face_item>& items) -> bool
+    {
+        const uint32_t* fv = &mesh.Face_vertices_idx_array[mesh.Face_vertices_idx_offsets[f]];
+        const int n = mesh.Face_vertices_idx_offsets[f+1]-mesh.Face_vertices_idx_offsets[f];
+        std::vector<int32_t> vertices(fv,fv+n);
+        const std::array<int32_t,4> key = face_key(vertices.data(),n);
+
+        items.clear();
+        if(!marked[X])
+        {
+            if((int)mesh.Face_ON_idx[2*f] != X) std::reverse(vertices.begin(),vertices.end());
+            items.push_back(face_item{X,vertices});
+            return true;
+        }
+
+        const int p = marked_pos[X];
+        for(unsigned int F = 0; F < parent_face_keys[p].size(); F++)
+        {
+            if(parent_face_keys[p][F] == key){items = parent_subfaces[p][F]; return true;}
+        }
+        for(auto const& subfaces : parent_subfaces[p])
+        {
+            for(auto const& item : subfaces)
+            {
+                if(face_key(item.vertices.data(),item.vertices.size()) == key){items.push_back(item); return true;}
+            }
+        }
+
+        return false;
+    };
+
+    // Old faces of refined elements are replaced, ghosts on refined faces are split
+    std::vector<uint8_t> keep_face(N_faces,1);
+    std::vector<int32_t> boundary_k(N_elements,-1);
+    for(int k = 0; k < mesh.N_boundary_elements; k++) boundary_k[mesh.Boundary_idxs_array[k]] = k;
+
+    std::vector<int32_t> added_boundary;
+    std::vector<std::pair<int32_t,std::array<double,3>>> ghost_position;
+    std::vector<face_item> So, Sn;
+
+    for(auto const P : marked_list)
+    {
+        for(int j = cell_faces_offsets[P]; j < cell_faces_offsets[P+1]; j++)
+        {
+            const int f = cell_faces[j];
+            if(!keep_face[f]) continue;
+            keep_face[f] = 0;
+
+            const int o = mesh.Face_ON_idx[2*f], n = mesh.Face_ON_idx[2*f+1];
+            if(!face_side(f,o,So) || !face_side(f,n,Sn))
+            {
+                // Nodes of this pass are dropped, the mesh is still unchanged
+                new_node_pos.clear();
+
+                manager.fail("Face " + std::to_string(f) + " of a refined element is not balanced (2:1)");
+                return -1;
+            }
+
+            if(So.size() > 1 && Sn.size() > 1)
+            {
+                for(auto const& a : So)
+                {
+                    const std::array<int32_t,4> key = face_key(a.vertices.data(),a.vertices.size());
+                    auto b = std::find_if(Sn.begin(),Sn.end(),[&](const face_item& item){return face_key(item.vertices.data(),item.vertices.size()) == key;});
+                    added_faces.push_back(new_face{a.element,b->element,a.vertices});
+                }
+            }
+            else if(So.size() > 1 && mesh.is_boundary_element(n))
+            {
+                const int k = boundary_k[n];
+                for(unsigned int s = 0; s < So.size(); s++)
+                {
+                    std::array<double,3> x = {0,0,0};
+                    for(auto const v : So[s].vertices)
+                    {
+                        for(int d = 0; d < 3; d++) x[d] += node(v)[d]/So[s].vertices.size();
+                    }
+
+                    std::vector<int32_t> gv = So[s].vertices;
+                    gv.push_back(-1);   // Ghost node, set once ghost nodes are placed
+
+                    int g = n;
+                    if(s == 0)
+                    {
+                        overwrite_element(n,gv);
+                        ghost_position.push_back({k,x});
+                    }
+                    else
+                    {
+                        g = append_element(mesh.Element_type_array[n],mesh.Phys_idx_array[n],0,gv);
+                        ghost_position.push_back({mesh.N_boundary_elements+(int)added_boundary.size(),x});
+                        added_boundary.push_back(g);
+                    }
+                    changed_elements.push_back(g);
+                    added_faces.push_back(new_face{So[s].element,g,So[s].vertices});
+                }
+            }
+            else if(So.size() > 1)
+            {
+                for(auto const& a : So) added_faces.push_back(new_face{a.element,Sn[0].element,a.vertices});
+            }
+            else if(Sn.size() > 1)
+            {
+                for(auto const& b : Sn) added_faces.push_back(new_face{b.element,So[0].element,b.vertices});
+            }
+            else
+            {
+                added_faces.push_back(new_face{So[0].element,Sn[0].element,So[0].vertices});
+            }
+        }
+    }
+
+    for(auto const& [i, v] : overwritten) std::copy(v.begin(),v.end(),&mesh.Element_vertices_idx_array[mesh.Element_vertices_idx_offsets[i]]);
+    for(auto const P : marked_list) Element_level[P]++;
+
+    // Nodes: old real nodes, new real nodes, then ghost node of boundary element k at N_nodes-1-k
+    const int N_old_nodes = mesh.N_nodes;
+    const int N_added_real = new_node_pos.size()/3;
+    const int N_boundary = mesh.N_boundary_elements+added_boundary.size();
+    const int N_nodes = N_real_nodes+N_added_real+N_boundary;
+
+    double* node_pos = (double*)mesh_malloc(3*N_nodes*sizeof(double),ooc);
+    std::memcpy(node_pos,mesh.node_pos_array,3*N_real_nodes*sizeof(double));
+    std::memcpy(&node_pos[3*N_real_nodes],new_node_pos.data(),new_node_pos.size()*sizeof(double));
+    for(int k = 0; k < mesh.N_boundary_elements; k++)
+    {
+        for(int d = 0; d < 3; d++) node_pos[3*(N_nodes-1-k)+d] = mesh.node_pos_array[3*(N_old_nodes-1-k)+d];
+    }
+    for(auto const& [k, x] : ghost_position)
+    {
+        for(int d = 0; d < 3; d++) node_pos[3*(N_nodes-1-k)+d] = x[d];
+    }
+    mesh_free(mesh.node_pos_array);
+    mesh.node_pos_array = node_pos;
+    N_real_nodes = mesh.N_nodes = N_nodes;
+    new_node_pos.clear();
+
+    // Elements
+    const int N_added = added_type.size();
+    const int N_new_elements = N_elements+N_added;
+    const int N_new_element_vertices = mesh.N_element_vertices+added_vertices.size();
+
+    grow(mesh.Element_type_array,N_elements,N_new_elements,ooc);
+    grow(mesh.Phys_idx_array,N_elements,N_new_elements,ooc);
+    grow(mesh.Element_vertices_idx_offsets,N_elements+1,N_new_elements+1,ooc);
+    grow(mesh.Element_vertices_idx_array,mesh.N_element_vertices,N_new_element_vertices,ooc);
+    grow(mesh.Boundary_idxs_array,mesh.N_boundary_elements,N_boundary,ooc);
+
+    std::copy(added_type.begin(),added_type.end(),&mesh.Element_type_array[N_elements]);
+    std::copy(added_phys.begin(),added_phys.end(),&mesh.Phys_idx_array[N_elements]);
+    std::copy(added_vertices.begin(),added_vertices.end(),&mesh.Element_vertices_idx_array[mesh.N_element_vertices]);
+    std::copy(added_boundary.begin(),added_boundary.end(),&mesh.Boundary_idxs_array[mesh.N_boundary_elements]);
+    for(int i = 0; i < N_added; i++)
+    {
+        mesh.Element_vertices_idx_offsets[N_elements+i+1] = mesh.Element_vertices_idx_offsets[N_elements+i]+added_count[i];
+    }
+    Element_level.insert(Element_level.end(),added_level.begin(),added_level.end());
+
+    for(int i = 0; i < N_added; i++) count_element(mesh,added_type[i]);
+    mesh.N_elements = N_new_elements;
+    mesh.N_element_vertices = N_new_element_vertices;
+    mesh.N_boundary_elements = N_boundary;
+
+    for(int k = 0; k < N_boundary; k++)
+    {
+        mesh.Element_vertices_idx_array[mesh.Element_vertices_idx_offsets[mesh.Boundary_idxs_array[k]+1]-1] = N_nodes-1-k;
+    }
+
+    // Faces: kept faces in their old order, then new faces
+    std::vector<int32_t> new_face_idx(N_faces,-1);
+    int N_kept = 0, N_kept_vertices = 0;
+    for(int f = 0; f < N_faces; f++)
+    {
+        if(!keep_face[f]) continue;
+        new_face_idx[f] = N_kept++;
+        N_kept_vertices += mesh.Face_vertices_idx_offsets[f+1]-mesh.Face_vertices_idx_offsets[f];
+    }
+
+    const int N_new_faces = N_kept+added_faces.size();
+    int N_face_vertices = N_kept_vertices;
+    for(auto const& face : added_faces) N_face_vertices += face.vertices.size();
+
+    uint32_t* face_on = (uint32_t*)mesh_malloc(2*N_new_faces*sizeof(uint32_t),ooc);
+    uint32_t* face_offsets = (uint32_t*)mesh_malloc((N_new_faces+1)*sizeof(uint32_t),ooc);
+    uint32_t* face_vertices = (uint32_t*)mesh_malloc(N_face_vertices*sizeof(uint32_t),ooc);
+
+    face_offsets[0] = 0;
+    for(int f = 0; f < N_faces; f++)
+    {
+        if(!keep_face[f]) continue;
+
+        const int i = new_face_idx[f];
+        const int n = mesh.Face_vertices_idx_offsets[f+1]-mesh.Face_vertices_idx_offsets[f];
+        face_on[2*i] = mesh.Face_ON_idx[2*f];
+        face_on[2*i+1] = mesh.Face_ON_idx[2*f+1];
+        face_offsets[i+1] = face_offsets[i]+n;
+        std::memcpy(&face_vertices[face_offsets[i]],&mesh.Face_vertices_idx_array[mesh.Face_vertices_idx_offsets[f]],n*sizeof(uint32_t));
+    }
+    for(unsigned int a = 0; a < added_faces.size(); a++)
+    {
+        const int i = N_kept+a;
+        face_on[2*i] = added_faces[a].owner;
+        face_on[2*i+1] = added_faces[a].neighbour;
+        face_offsets[i+1] = face_offsets[i]+added_faces[a].vertices.size();
+        std::copy(added_faces[a].vertices.begin(),added_faces[a].vertices.end(),&face_vertices[face_offsets[i]]);
+    }
+
+    mesh_free(mesh.Face_ON_idx);
+    mesh_free(mesh.Face_vertices_idx_offsets);
+    mesh_free(mesh.Face_vertices_idx_array);
+    mesh.Face_ON_idx = face_on;
+    mesh.Face_vertices_idx_offsets = face_offsets;
+    mesh.Face_vertices_idx_array = face_vertices;
+    mesh.N_faces = N_new_faces;
+
+    // Periodic links of refined faces are dropped
+    std::vector<std::pair<int32_t,int32_t>> periodic;
+    for(auto const& [a, b] : mesh.Periodic_face_pairs)
+    {
+        if(new_face_idx[a] >= 0 && new_face_idx[b] >= 0) periodic.push_back({new_face_idx[a],new_face_idx[b]});
+    }
+    mesh.Periodic_face_pairs = periodic;
+
+    // Geometry of new faces and changed elements only
+    if(update_face_geometry)
+    {
+        double* normal = (double*)mesh_malloc(3*N_new_faces*sizeof(double),ooc);
+        double* area = (double*)mesh_malloc(N_new_faces*sizeof(double),ooc);
+        double* centroids = (double*)mesh_malloc(3*N_new_faces*sizeof(double),ooc);
+
+        #pragma omp parallel for schedule(static)
+        for(int f = 0; f < N_faces; f++)
+        {
+            const int i = new_face_idx[f];
+            if(i < 0) continue;
+
+            area[i] = mesh.Face_area_array[f];
+            for(int d = 0; d < 3; d++)
+            {
+                normal[3*i+d] = mesh.Face_normal_array[3*f+d];
+                centroids[3*i+d] = mesh.Face_centroids_array[3*f+d];
+            }
+        }
+
+        mesh_free(mesh.Face_normal_array);
+        mesh_free(mesh.Face_area_array);
+        mesh_free(mesh.Face_centroids_array);
+        mesh.Face_normal_array = normal;
+        mesh.Face_area_array = area;
+        mesh.Face_centroids_array = centroids;
+
+        #pragma omp parallel for schedule(static)
+        for(int i = N_kept; i < N_new_faces; i++)
+        {
+            manager.face_geometry(i,&normal[3*i],&centroids[3*i]);
+            area[i] = sqrt(normal[3*i]*normal[3*i]+normal[3*i+1]*normal[3*i+1]+normal[3*i+2]*normal[3*i+2]);
+        }
+    }
+
+    if(update_volumes)
+    {
+        grow(mesh.V_array,N_elements,N_new_elements,ooc);
+        grow(mesh.Element_centroids_array,3*N_elements,3*N_new_elements,ooc);
+
+        #pragma omp parallel for schedule(static)
+        for(unsigned int j = 0; j < changed_elements.size(); j++)
+        {
+            const int i = changed_elements[j];
+            if(mesh.is_boundary_element(i))
+            {
+                const int ghost_node = mesh.Element_vertices_idx_array[mesh.Element_vertices_idx_offsets[i+1]-1];
+                mesh.V_array[i] = 0;
+                for(int d = 0; d < 3; d++) mesh.Element_centroids_array[3*i+d] = mesh.node_pos_array[3*ghost_node+d];
+                continue;
+            }
+            manager.element_geometry(i,mesh.V_array[i],&mesh.Element_centroids_array[3*i]);
+        }
+    }
+
+    // Ghost nodes moved, everything else derived from nodes and connectivity is rebuilt on request
+    if(!update_volumes) manager.release_quantity(quantity_volumes);
+    manager.release_quantity(quantity_node_elements);
+    manager.release_quantity(quantity_partition);
+
+    mesh.out() << "Refined " << marked_list.size() << " elements:\t" << N_elements << " -> " << N_new_elements << " elements, "
+              << N_faces << " -> " << N_new_faces << " faces\n";
+
+    return marked_list.size();
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include <vector>
+#include <array>
+#include <map>
+#include <unordered_map>
+#include <cstdint>
+
+#include "mesh_manager.h"
+
+// Red (isotropic) refinement of marked triangles, quads, tetrahedra and hexahedra
+// Neighbours of refined cells keep their vertices, shared faces are split into hanging sub faces (2:1 balance is enforced)
+// Faces, volumes, face geometry and ghosts are updated only around refined cells, the rest is copied
+class mesh_refiner
+{
+    private:
+    mesh_manager& manager;
+    mesh_struct& mesh;
+
+    // Hanging nodes of the mesh (recovered at the start of every pass) and nodes created by the pass,
+    // neighbours refined later reuse them; node ids may change between passes (renumbering, welding)
+    std::unordered_map<uint64_t,int32_t> Edge_midpoint;         // (lower << 32 | upper) -> midpoint node
+    std::map<std::array<int32_t,4>,int32_t> Face_center;        // Sorted quad corners -> center node
+
+    // Nodes added in the current pass (real nodes, appended after the existing real nodes)
+    int N_real_nodes = 0;
+    std::vector<double> new_node_pos;
+
+    // Sub face of a refined element on one of its parent faces, or an unrefined side of a face
+    struct face_item
+    {
+        int32_t element;
+        std::vector<int32_t> vertices;      // Oriented outwards from element
+    };
+
+    const double* node(int32_t k) const;
+    int32_t add_node(const double* x);
+    int32_t edge_midpoint(int32_t a, int32_t b);
+    int32_t face_center(const int32_t* corners);
+
+    void hanging_nodes(const std::vector<int32_t>& cell_faces_offsets, const std::vector<int32_t>& cell_faces);
+    void children_vertices(int i, std::vector<std::vector<int32_t>>& children);
+
+    public:
+    std::vector<uint8_t> Element_level;     // Refinement level of each element (0 for the input mesh)
+
+    mesh_refiner(mesh_manager& _manager);
+
+    // Marked elements (nonzero) are refined once, marks spread to coarser neighbours, returns number of refined elements
+    // Returns -1 with manager.error set (mesh unchanged) for unsupported element types or unbalanced faces
+    int refine(std::vector<uint8_t> marked);
+};
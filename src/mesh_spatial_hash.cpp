@@ -0,0 +1,56 @@
+#include "mesh_spatial_hash.h"
+#include <algorithm>
+
+void spatial_hash::build(const double* _points, int N_points, double cell_size)
+{
+    points = _points;
+    inv_cell_size = 1.0/cell_size;
+
+    uint64_t N_buckets = 1;
+    while(N_buckets < 2*(uint64_t)std::max(N_points,1)) N_buckets <<= 1;
+    mask = N_buckets-1;
+
+    std::vector<uint32_t> point_bucket(N_points);
+
+    #pragma omp parallel for schedule(static)
+    for(int i = 0; i < N_points; i++)
+    {
+        const double* p = &points[3*i];
+        point_bucket[i] = bucket(cell(p[0]),cell(p[1]),cell(p[2]));
+    }
+
+    // Counting sort by bucket
+    Bucket_offsets.assign(N_buckets+1,0);
+    for(int i = 0; i < N_points; i++) Bucket_offsets[point_bucket[i]+1]++;
+    for(uint64_t b = 0; b < N_buckets; b++) Bucket_offsets[b+1] += Bucket_offsets[b];
+
+    Point_idx.resize(N_points);
+    std::vector<int32_t> fill(Bucket_offsets.begin(),Bucket_offsets.end()-1);
+    for(int i = 0; i < N_points; i++) Point_idx[fill[point_bucket[i]]++] = i;
+}
+
+periodic_transform periodic_transform::translation(double dx, double dy, double dz)
+{
+    periodic_transform T;
+    T.t[0] = dx;
+    T.t[1] = dy;
+    T.t[2] = dz;
+    return T;
+}
+
+// Rodrigues rotation by angle (radians) around axis through origin
+periodic_transform periodic_transform::rotation(const double* axis, double angle, const double* origin)
+{
+    const double n = std::sqrt(axis[0]*axis[0]+axis[1]*axis[1]+axis[2]*axis[2]);
+    const double x = axis[0]/n, y = axis[1]/n, z = axis[2]/n;
+    const double c = std::cos(angle), s = std::sin(angle), C = 1-c;
+
+    periodic_transform T;
+    const double R[9] = {c+x*x*C,   x*y*C-z*s, x*z*C+y*s,
+                         y*x*C+z*s, c+y*y*C,   y*z*C-x*s,
+                         z*x*C-y*s, z*y*C+x*s, c+z*z*C};
+
+    for(int k = 0; k < 9; k++) T.R[k] = R[k];
+    for(int d = 0; d < 3; d++) T.t[d] = origin[d]-(R[3*d]*origin[0]+R[3*d+1]*origin[1]+R[3*d+2]*origin[2]);
+    return T;
+}
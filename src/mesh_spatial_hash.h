@@ -0,0 +1,72 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <cmath>
+
+// Uniform grid hashed into a power of two bucket table, points of a bucket are stored contiguously (CSR)
+class spatial_hash
+{
+    private:
+    const double* points = nullptr;     // 3 coordinates per point
+    double inv_cell_size = 1;
+    uint64_t mask = 0;
+
+    inline int64_t cell(double x) const {return (int64_t)std::floor(x*inv_cell_size);}
+    inline uint64_t bucket(int64_t ix, int64_t iy, int64_t iz) const
+    {
+        return ((uint64_t)ix*73856093ull ^ (uint64_t)iy*19349663ull ^ (uint64_t)iz*83492791ull) & mask;
+    }
+
+    public:
+    std::vector<int32_t> Bucket_offsets;
+    std::vector<int32_t> Point_idx;     // Points ordered by bucket, ascending inside a bucket
+
+    // Points must outlive the hash, queries are exact for distances up to cell_size
+    void build(const double* _points, int N_points, double cell_size);
+
+    // Calls f(point) for every point within distance tol of p (tol <= cell_size)
+    template<typename F>
+    void find_within(const double* p, double tol, F f) const
+    {
+        if(points == nullptr) return;
+
+        // tol <= cell_size spans at most 3 cells per axis
+        const double tol2 = tol*tol;
+        uint64_t visited[27];
+        int N_visited = 0;
+
+        for(int64_t ix = cell(p[0]-tol); ix <= cell(p[0]+tol); ix++)
+        for(int64_t iy = cell(p[1]-tol); iy <= cell(p[1]+tol); iy++)
+        for(int64_t iz = cell(p[2]-tol); iz <= cell(p[2]+tol); iz++)
+        {
+            // Distinct cells may share a bucket
+            const uint64_t b = bucket(ix,iy,iz);
+            bool seen = false;
+            for(int k = 0; k < N_visited; k++) seen |= (visited[k] == b);
+            if(seen) continue;
+            if(N_visited < 27) visited[N_visited++] = b;
+
+            for(int k = Bucket_offsets[b]; k < Bucket_offsets[b+1]; k++)
+            {
+                const double* q = &points[3*Point_idx[k]];
+                const double dx = q[0]-p[0], dy = q[1]-p[1], dz = q[2]-p[2];
+                if(dx*dx+dy*dy+dz*dz <= tol2) f(Point_idx[k]);
+            }
+        }
+    }
+};
+
+// Rigid map of one periodic side onto the other, y = R*x+t
+struct periodic_transform
+{
+    double R[9] = {1,0,0,0,1,0,0,0,1};
+    double t[3] = {0,0,0};
+
+    static periodic_transform translation(double dx, double dy, double dz);
+    static periodic_transform rotation(const double* axis, double angle, const double* origin);
+
+    inline void apply(const double* x, double* y) const
+    {
+        for(int d = 0; d < 3; d++) y[d] = R[3*d]*x[0]+R[3*d+1]*x[1]+R[3*d+2]*x[2]+t[d];
+    }
+};
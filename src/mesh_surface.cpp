@@ -0,0 +1,294 @@
+#include "mesh_surface.h"
+#include <fstream>
+#include <algorithm>
+#include <parallel/algorithm>
+#include <cstring>
+#include <cmath>
+#include <omp.h>
+
+#define N_TAGS 256      // Phys_idx_array is uint8_t
+
+mesh_surface::mesh_surface(const mesh_struct& _mesh) : mesh(_mesh){}
+
+// Counting sort of ghost elements by tag (per thread counts keep it stable), then compaction of their nodes
+void mesh_surface::extract()
+{
+    const int N_boundary = mesh.N_boundary_elements;
+    const uint32_t* boundary = mesh.Boundary_idxs_array;
+    const int32_t* offsets = mesh.Element_vertices_idx_offsets;
+
+    Face_element.resize(N_boundary);
+    Face_type.resize(N_boundary);
+    Face_vertices_offsets.resize(N_boundary+1);
+    std::vector<int32_t> tag_offsets(N_TAGS+1,0);
+    std::vector<int32_t> counts(omp_get_max_threads()*N_TAGS,0);
+
+    #pragma omp parallel
+    {
+        const int t = omp_get_thread_num(), T = omp_get_num_threads();
+        const int begin = (int64_t)N_boundary*t/T, end = (int64_t)N_boundary*(t+1)/T;
+        int32_t* local = &counts[t*N_TAGS];
+
+        for(int k = begin; k < end; k++) local[mesh.Phys_idx_array[boundary[k]]]++;
+
+        #pragma omp barrier
+        #pragma omp single
+        {
+            int32_t sum = 0;
+            for(int tag = 0; tag < N_TAGS; tag++)
+            {
+                tag_offsets[tag] = sum;
+                for(int s = 0; s < T; s++)
+                {
+                    const int32_t n = counts[s*N_TAGS+tag];
+                    counts[s*N_TAGS+tag] = sum;
+                    sum += n;
+                }
+            }
+            tag_offsets[N_TAGS] = sum;
+        }
+
+        for(int k = begin; k < end; k++)
+        {
+            const int g = boundary[k];
+            const int f = local[mesh.Phys_idx_array[g]]++;
+            Face_element[f] = g;
+            Face_type[f] = mesh.Element_type_array[g];
+        }
+    }
+
+    Patch_tags.clear();
+    Patch_offsets.clear();
+    for(int tag = 0; tag < N_TAGS; tag++)
+    {
+        if(tag_offsets[tag+1] == tag_offsets[tag]) continue;
+        Patch_tags.push_back(tag);
+        Patch_offsets.push_back(tag_offsets[tag]);
+    }
+    Patch_offsets.push_back(N_boundary);
+
+    // Ghost elements hold the face vertices followed by the ghost node
+    Face_vertices_offsets[0] = 0;
+    for(int f = 0; f < N_boundary; f++)
+    {
+        const int g = Face_element[f];
+        Face_vertices_offsets[f+1] = Face_vertices_offsets[f]+offsets[g+1]-offsets[g]-1;
+    }
+
+    Face_vertices.resize(Face_vertices_offsets[N_boundary]);
+
+    #pragma omp parallel for schedule(static)
+    for(int f = 0; f < N_boundary; f++)
+    {
+        const int32_t* v = &mesh.Element_vertices_idx_array[offsets[Face_element[f]]];
+        std::copy(v,v+Face_vertices_offsets[f+1]-Face_vertices_offsets[f],&Face_vertices[Face_vertices_offsets[f]]);
+    }
+
+    // Only surface nodes are touched, sorted unique ids instead of a marker over all mesh nodes
+    Node_idx = Face_vertices;
+    __gnu_parallel::sort(Node_idx.begin(),Node_idx.end());
+    Node_idx.erase(std::unique(Node_idx.begin(),Node_idx.end()),Node_idx.end());
+
+    const int N_face_vertices = Face_vertices.size();
+
+    #pragma omp parallel for schedule(static)
+    for(int j = 0; j < N_face_vertices; j++)
+    {
+        Face_vertices[j] = std::lower_bound(Node_idx.begin(),Node_idx.end(),Face_vertices[j])-Node_idx.begin();
+    }
+
+    mesh.out() << "Surface:\t" << N_boundary << " faces, " << Node_idx.size() << " nodes, " << Patch_tags.size() << " patches\n";
+}
+
+// Surface nodes and face vertices of one patch renumbered to them, or the whole surface
+void mesh_surface::patch_mesh(int patch, std::vector<int32_t>& nodes, std::vector<int32_t>& vertices) const
+{
+    if(patch < 0)
+    {
+        nodes = Node_idx;
+        vertices = Face_vertices;
+        return;
+    }
+
+    vertices.assign(Face_vertices.begin()+Face_vertices_offsets[Patch_offsets[patch]],
+                    Face_vertices.begin()+Face_vertices_offsets[Patch_offsets[patch+1]]);
+
+    std::vector<int32_t> local(vertices);
+    __gnu_parallel::sort(local.begin(),local.end());
+    local.erase(std::unique(local.begin(),local.end()),local.end());
+
+    const int N_vertices = vertices.size();
+
+    #pragma omp parallel for schedule(static)
+    for(int j = 0; j < N_vertices; j++)
+    {
+        vertices[j] = std::lower_bound(local.begin(),local.end(),vertices[j])-local.begin();
+    }
+
+    nodes.resize(local.size());
+    for(unsigned int k = 0; k < local.size(); k++) nodes[k] = Node_idx[local[k]];
+}
+
+template<typename T>
+static void append_array(std::vector<char>& buffer, const std::vector<T>& data)
+{
+    const uint64_t bytes = data.size()*sizeof(T);
+    const size_t start = buffer.size();
+    buffer.resize(start+sizeof(uint64_t)+bytes);
+    std::memcpy(&buffer[start],&bytes,sizeof(uint64_t));
+    std::memcpy(&buffer[start+sizeof(uint64_t)],data.data(),bytes);
+}
+
+bool mesh_surface::write_vtu(const std::string& file_path, int patch) const
+{
+    static const std::map<int,uint8_t> vtk_type = {{1,3},{2,5},{3,9}};     // Line, triangle, quad
+
+    std::vector<int32_t> nodes, connectivity;
+    patch_mesh(patch,nodes,connectivity);
+
+    const int face_begin = patch < 0 ? 0 : Patch_offsets[patch];
+    const int face_end = patch < 0 ? Face_element.size() : Patch_offsets[patch+1];
+    const int N_nodes = nodes.size(), N_faces = face_end-face_begin;
+
+    std::vector<double> points(3*N_nodes);
+    std::vector<int32_t> cell_offsets(N_faces), tags(N_faces), elements(N_faces);
+    std::vector<uint8_t> types(N_faces);
+
+    #pragma omp parallel for schedule(static)
+    for(int k = 0; k < N_nodes; k++)
+    {
+        for(int d = 0; d < 3; d++) points[3*k+d] = mesh.node_pos_array[3*nodes[k]+d];
+    }
+
+    #pragma omp parallel for schedule(static)
+    for(int i = 0; i < N_faces; i++)
+    {
+        const int f = face_begin+i;
+        cell_offsets[i] = Face_vertices_offsets[f+1]-Face_vertices_offsets[face_begin];
+        types[i] = vtk_type.at(Face_type[f]);
+        tags[i] = mesh.Phys_idx_array[Face_element[f]];
+        elements[i] = Face_element[f];
+    }
+
+    // Appended raw data, each array is preceded by its byte count
+    std::vector<char> data;
+    std::vector<size_t> array_offsets;
+    array_offsets.push_back(data.size()); append_array(data,points);
+    array_offsets.push_back(data.size()); append_array(data,connectivity);
+    array_offsets.push_back(data.size()); append_array(data,cell_offsets);
+    array_offsets.push_back(data.size()); append_array(data,types);
+    array_offsets.push_back(data.size()); append_array(data,tags);
+    array_offsets.push_back(data.size()); append_array(data,elements);
+
+    const uint16_t one = 1;
+    const bool little_endian = *(const uint8_t*)&one == 1;
+
+    std::ofstream stream(file_path,std::ios::binary);
+    if(!stream)
+    {
+        mesh.out() << "Cannot open " << file_path << "\n";
+        return false;
+    }
+
+    stream << "<?xml version=\"1.0\"?>\n"
+           << "<VTKFile type=\"UnstructuredGrid\" version=\"1.0\" byte_order=\"" << (little_endian ? "LittleEndian" : "BigEndian") << "\" header_type=\"UInt64\">\n"
+           << "<UnstructuredGrid>\n"
+           << "<Piece NumberOfPoints=\"" << N_nodes << "\" NumberOfCells=\"" << N_faces << "\">\n"
+           << "<Points>\n"
+           << "<DataArray type=\"Float64\" NumberOfComponents=\"3\" format=\"appended\" offset=\"" << array_offsets[0] << "\"/>\n"
+           << "</Points>\n"
+           << "<Cells>\n"
+           << "<DataArray type=\"Int32\" Name=\"connectivity\" format=\"appended\" offset=\"" << array_offsets[1] << "\"/>\n"
+           << "<DataArray type=\"Int32\" Name=\"offsets\" format=\"appended\" offset=\"" << array_offsets[2] << "\"/>\n"
+           << "<DataArray type=\"UInt8\" Name=\"types\" format=\"appended\" offset=\"" << array_offsets[3] << "\"/>\n"
+           << "</Cells>\n"
+           << "<CellData Scalars=\"tag\">\n"
+           << "<DataArray type=\"Int32\" Name=\"tag\" format=\"appended\" offset=\"" << array_offsets[4] << "\"/>\n"
+           << "<DataArray type=\"Int32\" Name=\"element\" format=\"appended\" offset=\"" << array_offsets[5] << "\"/>\n"
+           << "</CellData>\n"
+           << "</Piece>\n"
+           << "</UnstructuredGrid>\n"
+           << "<AppendedData encoding=\"raw\">\n_";
+    stream.write(data.data(),data.size());
+    stream << "\n</AppendedData>\n</VTKFile>\n";
+
+    return (bool)stream;
+}
+
+bool mesh_surface::write_stl(const std::string& file_path, int patch) const
+{
+    if(mesh.Dimension != 3)
+    {
+        mesh.out() << "STL export needs a 3D mesh surface\n";
+        return false;
+    }
+
+    const int face_begin = patch < 0 ? 0 : Patch_offsets[patch];
+    const int face_end = patch < 0 ? Face_element.size() : Patch_offsets[patch+1];
+    const int N_faces = face_end-face_begin;
+
+    // Triangles of each face (quads give two), 50 byte records
+    std::vector<int64_t> triangle_offsets(N_faces+1,0);
+    for(int i = 0; i < N_faces; i++) triangle_offsets[i+1] = triangle_offsets[i]+(Face_type[face_begin+i] == 3 ? 2 : 1);
+    const int64_t N_triangles = triangle_offsets[N_faces];
+
+    std::vector<char> data(84+50*N_triangles,0);
+    const char header[] = "Mesh_manager boundary surface";
+    std::memcpy(data.data(),header,sizeof(header));
+    const uint32_t N = N_triangles;
+    std::memcpy(&data[80],&N,sizeof(uint32_t));
+
+    #pragma omp parallel for schedule(static)
+    for(int i = 0; i < N_faces; i++)
+    {
+        const int f = face_begin+i;
+        const int32_t* v = &Face_vertices[Face_vertices_offsets[f]];
+        const uint16_t tag = mesh.Phys_idx_array[Face_element[f]];
+
+        for(int t = 0; t < triangle_offsets[i+1]-triangle_offsets[i]; t++)
+        {
+            const int32_t corners[3] = {v[0],v[1+t],v[2+t]};
+            const double* x[3];
+            for(int c = 0; c < 3; c++) x[c] = &mesh.node_pos_array[3*Node_idx[corners[c]]];
+
+            const double a[3] = {x[1][0]-x[0][0],x[1][1]-x[0][1],x[1][2]-x[0][2]};
+            const double b[3] = {x[2][0]-x[0][0],x[2][1]-x[0][1],x[2][2]-x[0][2]};
+            double n[3] = {a[1]*b[2]-a[2]*b[1],a[2]*b[0]-a[0]*b[2],a[0]*b[1]-a[1]*b[0]};
+            const double length = std::sqrt(n[0]*n[0]+n[1]*n[1]+n[2]*n[2]);
+
+            float record[12];
+            for(int d = 0; d < 3; d++) record[d] = length > 0 ? n[d]/length : 0;
+            for(int c = 0; c < 3; c++)
+            {
+                for(int d = 0; d < 3; d++) record[3+3*c+d] = x[c][d];
+            }
+
+            char* p = &data[84+50*(triangle_offsets[i]+t)];
+            std::memcpy(p,record,sizeof(record));
+            std::memcpy(p+48,&tag,sizeof(uint16_t));
+        }
+    }
+
+    std::ofstream stream(file_path,std::ios::binary);
+    if(!stream)
+    {
+        mesh.out() << "Cannot open " << file_path << "\n";
+        return false;
+    }
+    stream.write(data.data(),data.size());
+
+    return (bool)stream;
+}
+
+bool mesh_surface::write_patches(const std::string& base_path, const std::string& format) const
+{
+    for(unsigned int p = 0; p < Patch_tags.size(); p++)
+    {
+        const std::string path = base_path + "_" + std::to_string(Patch_tags[p]) + "." + format;
+        const bool ok = (format == "stl") ? write_stl(path,p) : write_vtu(path,p);
+        if(!ok) return false;
+    }
+
+    mesh.out() << "Written " << Patch_tags.size() << " surface patches to " << base_path << "_*." << format << "\n";
+    return true;
+}
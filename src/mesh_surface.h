@@ -0,0 +1,36 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <cstdint>
+
+#include "mesh_manager.h"
+
+// Boundary surface of a mesh built from its ghost elements (Boundary_idxs_array) only
+// Faces are grouped into patches by physical tag and keep the vertex order of the msh boundary elements
+class mesh_surface
+{
+    private:
+    const mesh_struct& mesh;
+
+    void patch_mesh(int patch, std::vector<int32_t>& nodes, std::vector<int32_t>& vertices) const;
+
+    public:
+    std::vector<int32_t> Patch_tags;                // Physical tag of each patch, ascending
+    std::vector<int32_t> Patch_offsets;             // Where faces of each patch start
+
+    std::vector<int32_t> Face_element;              // Ghost element of each surface face
+    std::vector<uint8_t> Face_type;                 // msh type of each face (1 line, 2 triangle, 3 quad)
+    std::vector<int32_t> Face_vertices_offsets;     // Where vertices of each face start
+    std::vector<int32_t> Face_vertices;             // Surface node indices
+
+    std::vector<int32_t> Node_idx;                  // Mesh node of each surface node, ascending
+
+    mesh_surface(const mesh_struct& _mesh);
+
+    void extract();
+
+    // patch < 0 writes the whole surface, a single patch gets its own compact node set
+    bool write_vtu(const std::string& file_path, int patch = -1) const;      // Binary (appended raw) VTU, tag and element as cell data
+    bool write_stl(const std::string& file_path, int patch = -1) const;      // Binary STL, quads split in two, tag in the attribute
+    bool write_patches(const std::string& base_path, const std::string& format = "vtu") const;    // <base_path>_<tag>.<format>
+};
@@ -0,0 +1,172 @@
+#include "mesh_wall_distance.h"
+#include <math.h>
+#include "helper_functions.h"
+
+static inline double dot(const double* a, const double* b)
+{
+    return a[0]*b[0]+a[1]*b[1]+a[2]*b[2];
+}
+
+// Squared distance of p to segment a,b
+static double segment_distance2(const double* a, const double* b, const double* p)
+{
+    const double ab[3] = {b[0]-a[0],b[1]-a[1],b[2]-a[2]};
+    const double ap[3] = {p[0]-a[0],p[1]-a[1],p[2]-a[2]};
+
+    const double L2 = dot(ab,ab);
+    double t = (L2 > 0) ? dot(ap,ab)/L2 : 0;
+    t = std::min(1.0,std::max(0.0,t));
+
+    const double r[3] = {ap[0]-t*ab[0],ap[1]-t*ab[1],ap[2]-t*ab[2]};
+    return dot(r,r);
+}
+
+// Squared distance of p to triangle a,b,c (closest point by Voronoi regions)
+static double triangle_distance2(const double* a, const double* b, const double* c, const double* p)
+{
+    const double ab[3] = {b[0]-a[0],b[1]-a[1],b[2]-a[2]};
+    const double ac[3] = {c[0]-a[0],c[1]-a[1],c[2]-a[2]};
+    const double ap[3] = {p[0]-a[0],p[1]-a[1],p[2]-a[2]};
+
+    const double d1 = dot(ab,ap), d2 = dot(ac,ap);
+    if(d1 <= 0 && d2 <= 0) return dot(ap,ap);
+
+    const double bp[3] = {p[0]-b[0],p[1]-b[1],p[2]-b[2]};
+    const double d3 = dot(ab,bp), d4 = dot(ac,bp);
+    if(d3 >= 0 && d4 <= d3) return dot(bp,bp);
+
+    const double vc = d1*d4-d3*d2;
+    if(vc <= 0 && d1 >= 0 && d3 <= 0) return segment_distance2(a,b,p);
+
+    const double cp[3] = {p[0]-c[0],p[1]-c[1],p[2]-c[2]};
+    const double d5 = dot(ab,cp), d6 = dot(ac,cp);
+    if(d6 >= 0 && d5 <= d6) return dot(cp,cp);
+
+    const double vb = d5*d2-d1*d6;
+    if(vb <= 0 && d2 >= 0 && d6 <= 0) return segment_distance2(a,c,p);
+
+    const double va = d3*d6-d5*d4;
+    if(va <= 0 && (d4-d3) >= 0 && (d5-d6) >= 0) return segment_distance2(b,c,p);
+
+    // Inside face region
+    const double denom = 1/(va+vb+vc);
+    const double v = vb*denom, w = vc*denom;
+    const double r[3] = {ap[0]-v*ab[0]-w*ac[0],ap[1]-v*ab[1]-w*ac[1],ap[2]-v*ab[2]-w*ac[2]};
+    return dot(r,r);
+}
+
+mesh_wall_distance::mesh_wall_distance(const mesh_struct& _mesh) : mesh(_mesh){}
+
+// Exact squared distance to face, faces with more than 3 vertices are split into a fan around the face centroid
+double mesh_wall_distance::face_distance2(const int face_idx, const double* p) const
+{
+    const double* X = mesh.node_pos_array;
+    const uint32_t* v = &mesh.Face_vertices_idx_array[mesh.Face_vertices_idx_offsets[face_idx]];
+    const int n = mesh.Face_vertices_idx_offsets[face_idx+1]-mesh.Face_vertices_idx_offsets[face_idx];
+
+    if(n == 2) return segment_distance2(&X[3*v[0]],&X[3*v[1]],p);
+    if(n == 3) return triangle_distance2(&X[3*v[0]],&X[3*v[1]],&X[3*v[2]],p);
+
+    const double* fc = &mesh.Face_centroids_array[3*face_idx];
+    double d2 = std::numeric_limits<double>::max();
+    for(int j = 0; j < n; j++)
+    {
+        d2 = std::min(d2,triangle_distance2(fc,&X[3*v[j]],&X[3*v[(j+1)%n]],p));
+    }
+    return d2;
+}
+
+// Collects boundary faces whose ghost has one of the wall tags and builds tree over them
+bool mesh_wall_distance::build(const std::vector<uint8_t>& wall_tags)
+{
+    if(mesh.Face_vertices_idx_array == nullptr || mesh.Face_centroids_array == nullptr || mesh.Element_centroids_array == nullptr)
+    {
+        mesh.out() << "Wall distance needs face vertices, face geometry and element centroids\n";
+        return false;
+    }
+
+    Wall_face_idx.clear();
+    for(int i = 0; i < mesh.N_faces; i++)
+    {
+        const int neighbour_idx = mesh.Face_ON_idx[2*i+1];
+        if(mesh.is_boundary_element(neighbour_idx) && contains(wall_tags,mesh.Phys_idx_array[neighbour_idx]))
+        {
+            Wall_face_idx.push_back(i);
+        }
+    }
+
+    const int N_items = Wall_face_idx.size();
+    std::vector<double> boxes(6*N_items);
+
+    #pragma omp parallel for schedule(static)
+    for(int k = 0; k < N_items; k++)
+    {
+        const int i = Wall_face_idx[k];
+        double* box = &boxes[6*k];
+        for(int d = 0; d < 3; d++)
+        {
+            box[d] = std::numeric_limits<double>::max();
+            box[3+d] = std::numeric_limits<double>::lowest();
+        }
+
+        for(uint32_t j = mesh.Face_vertices_idx_offsets[i]; j < mesh.Face_vertices_idx_offsets[i+1]; j++)
+        {
+            const double* x = &mesh.node_pos_array[3*mesh.Face_vertices_idx_array[j]];
+            for(int d = 0; d < 3; d++)
+            {
+                box[d] = std::min(box[d],x[d]);
+                box[3+d] = std::max(box[3+d],x[d]);
+            }
+        }
+    }
+
+    tree.build(boxes);
+    mesh.out() << "Wall faces:\t" << N_items << "\n";
+    return true;
+}
+
+// Nearest wall face for every element centroid, the previous result of a thread seeds the search bound
+bool mesh_wall_distance::compute()
+{
+    // Centroids may have been released since build
+    if(mesh.Element_centroids_array == nullptr)
+    {
+        mesh.out() << "Wall distance needs element centroids\n";
+        return false;
+    }
+
+    const int N_elements = mesh.N_elements;
+
+    Wall_distance.assign(N_elements,std::numeric_limits<double>::max());
+    Nearest_wall_face.assign(N_elements,-1);
+    if(Wall_face_idx.empty()) return true;
+
+    #pragma omp parallel
+    {
+        int last_item = -1;
+
+        #pragma omp for schedule(dynamic,1024)
+        for(int i = 0; i < N_elements; i++)
+        {
+            const double* p = &mesh.Element_centroids_array[3*i];
+
+            // Neighbouring elements usually share the nearest face
+            double best_dist2 = std::numeric_limits<double>::max();
+            int best_item = -1;
+            if(last_item >= 0)
+            {
+                best_dist2 = std::nextafter(face_distance2(Wall_face_idx[last_item],p),std::numeric_limits<double>::max());
+                best_item = last_item;
+            }
+
+            const int item = tree.find_nearest(p,[this,p](int k){return face_distance2(Wall_face_idx[k],p);},best_dist2);
+            if(item >= 0) best_item = item;
+
+            last_item = best_item;
+            Nearest_wall_face[i] = Wall_face_idx[best_item];
+            Wall_distance[i] = sqrt(best_dist2);
+        }
+    }
+
+    return true;
+}
@@ -0,0 +1,27 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+
+#include "mesh_manager.h"
+#include "bvh_tree.h"
+
+// Distance of element centroids to the nearest wall face, walls are boundary faces with given physical tags
+class mesh_wall_distance
+{
+    private:
+    const mesh_struct& mesh;
+
+    double face_distance2(const int face_idx, const double* p) const;
+
+    public:
+    bvh_tree tree;
+    std::vector<int32_t> Wall_face_idx;         // Tree item -> face
+
+    std::vector<double> Wall_distance;          // Per element distance, 0 for wall ghosts
+    std::vector<int32_t> Nearest_wall_face;     // Per element nearest wall face, -1 without walls
+
+    mesh_wall_distance(const mesh_struct& _mesh);
+
+    bool build(const std::vector<uint8_t>& wall_tags);     // False without face vertices, face geometry and element centroids (volumes)
+    bool compute();                                         // False without element centroids
+};
@@ -0,0 +1,103 @@
+// Batch mesh preprocessing: parse, faces, volumes, face geometry, partition and partition files for a list of meshes
+//
+// usage: mesh_batch [-j workers] [-t threads] [-p parts] [-o output_dir] [-v] <meshes.msh | list file>...
+//  -j  files processed at once (default 4), -t  total threads shared by all files (default all cores)
+//  -p  partitions written per mesh to <output_dir>/<mesh name>.part<p> (default 0, no partition files)
+//  -v  print the full log of each mesh
+// A list file holds one mesh path per line. Exit status is 1 if any mesh failed.
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <chrono>
+
+#include "mesh_batch.h"
+
+static bool ends_with(const std::string& s, const std::string& suffix)
+{
+    return s.size() >= suffix.size() && s.compare(s.size()-suffix.size(),suffix.size(),suffix) == 0;
+}
+
+// <output_dir>/<file name without .msh>, next to the mesh if no directory is given
+static std::string output_base(const std::string& mesh_path, const std::string& output_dir)
+{
+    std::string base = ends_with(mesh_path,".msh") ? mesh_path.substr(0,mesh_path.size()-4) : mesh_path;
+    if(output_dir.empty()) return base;
+
+    const size_t slash = base.find_last_of('/');
+    return output_dir + "/" + (slash == std::string::npos ? base : base.substr(slash+1));
+}
+
+int main(int argc, char** argv)
+{
+    int N_workers = 4, N_threads = 0, N_parts = 0;
+    bool verbose = false;
+    std::string output_dir;
+    std::vector<std::string> paths;
+
+    for(int a = 1; a < argc; a++)
+    {
+        const std::string arg = argv[a];
+        if(arg == "-j" && a+1 < argc) N_workers = std::stoi(argv[++a]);
+        else if(arg == "-t" && a+1 < argc) N_threads = std::stoi(argv[++a]);
+        else if(arg == "-p" && a+1 < argc) N_parts = std::stoi(argv[++a]);
+        else if(arg == "-o" && a+1 < argc) output_dir = argv[++a];
+        else if(arg == "-v") verbose = true;
+        else if(ends_with(arg,".msh")) paths.push_back(arg);
+        else
+        {
+            std::ifstream list(arg);
+            if(!list)
+            {
+                std::cout << "Cannot open list file " << arg << "\n";
+                return 1;
+            }
+
+            std::string line;
+            while(getline(list,line))
+            {
+                if(!line.empty() && line[0] != '#') paths.push_back(line);
+            }
+        }
+    }
+
+    if(paths.empty())
+    {
+        std::cout << "usage: mesh_batch [-j workers] [-t threads] [-p parts] [-o output_dir] [-v] <meshes.msh | list file>...\n";
+        return 1;
+    }
+
+    std::vector<batch_job> jobs(paths.size());
+    for(unsigned int i = 0; i < paths.size(); i++)
+    {
+        jobs[i].mesh_path = paths[i];
+        jobs[i].output_base = output_base(paths[i],output_dir);
+        jobs[i].N_parts = N_parts;
+    }
+
+    std::vector<batch_result> results(jobs.size());
+    std::mutex print_mutex;
+    int N_done = 0, N_failed = 0;
+    auto start = std::chrono::steady_clock::now();
+
+    work_stealing_pool pool(N_workers,N_threads);
+    pool.run(jobs.size(),[&](int i)
+    {
+        results[i] = preprocess_mesh(jobs[i]);
+
+        std::lock_guard<std::mutex> lock(print_mutex);
+        N_done++;
+        if(!results[i].ok) N_failed++;
+
+        std::cout << "[" << N_done << "/" << jobs.size() << "] " << jobs[i].mesh_path << ":\t";
+        if(results[i].ok) std::cout << results[i].N_elements << " elements, " << results[i].N_faces << " faces, " << results[i].seconds << " s\n";
+        else std::cout << "FAILED, " << results[i].error << "\n";
+        if(verbose) std::cout << results[i].log;
+    });
+
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+    std::cout << jobs.size()-N_failed << " of " << jobs.size() << " meshes done in " << seconds << " s\n";
+
+    return N_failed > 0;
+}